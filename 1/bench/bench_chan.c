@@ -0,0 +1,134 @@
+/*
+ * Ping-pong latency of the coroutine synchronization: two
+ * coroutines pass a token back and forth, and the time of a round
+ * trip is printed. The token goes via two channels, via a mutex and
+ * a condition variable, and, as the lower bound, via bare
+ * coro_suspend() and coro_wakeup(). The second argument is the
+ * number of threads of coro_sched_run(), 1 by default.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "corosync.h"
+#include "libcoro.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long round_count;
+static int thread_count;
+
+static struct coro_chan chan_ping;
+static struct coro_chan chan_pong;
+
+static void *
+chan_ping_f(void *arg)
+{
+	(void)arg;
+	void *token = NULL;
+	for (long i = 0; i < round_count; ++i) {
+		coro_chan_send(&chan_ping, token);
+		coro_chan_recv(&chan_pong, &token);
+	}
+	coro_chan_close(&chan_ping);
+	return NULL;
+}
+
+static void *
+chan_pong_f(void *arg)
+{
+	(void)arg;
+	void *token;
+	while (coro_chan_recv(&chan_ping, &token) == 0)
+		coro_chan_send(&chan_pong, token);
+	return NULL;
+}
+
+static struct coro_mutex cond_mutex;
+static struct coro_cond cond;
+/** Whose turn it is: 0 - ping, 1 - pong. */
+static int cond_turn;
+
+static void *
+cond_player_f(void *arg)
+{
+	int me = *(int *)arg;
+	coro_mutex_lock(&cond_mutex);
+	for (long i = 0; i < round_count; ++i) {
+		while (cond_turn != me)
+			coro_cond_wait(&cond, &cond_mutex);
+		cond_turn = 1 - me;
+		coro_cond_signal(&cond);
+	}
+	coro_mutex_unlock(&cond_mutex);
+	return NULL;
+}
+
+static struct coro *raw_coros[2];
+/** Same as cond_turn, atomic. */
+static int raw_turn;
+
+static void *
+raw_player_f(void *arg)
+{
+	int me = *(int *)arg;
+	for (long i = 0; i < round_count; ++i) {
+		while (__atomic_load_n(&raw_turn, __ATOMIC_ACQUIRE) != me)
+			coro_suspend();
+		__atomic_store_n(&raw_turn, 1 - me, __ATOMIC_RELEASE);
+		coro_wakeup(raw_coros[1 - me]);
+	}
+	return NULL;
+}
+
+/** Run the pair to the end, print the round trip time. */
+static void
+bench_run(const char *name, struct coro *a, struct coro *b)
+{
+	raw_coros[0] = a;
+	raw_coros[1] = b;
+	double start = now();
+	if (thread_count > 1)
+		coro_sched_run(thread_count);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double duration = now() - start;
+	printf("%-16s %12ld %12.1f\n", name, round_count,
+	       duration * 1e9 / round_count);
+}
+
+int
+main(int argc, char **argv)
+{
+	round_count = argc > 1 ? atol(argv[1]) : 1000000;
+	thread_count = argc > 2 ? atoi(argv[2]) : 1;
+	static int players[2] = {0, 1};
+	coro_sched_init();
+	printf("%-16s %12s %12s\n", "primitive", "rounds", "ns/round");
+
+	coro_chan_create(&chan_ping, 1);
+	coro_chan_create(&chan_pong, 1);
+	bench_run("channel", coro_new(chan_ping_f, NULL),
+		  coro_new(chan_pong_f, NULL));
+	coro_chan_destroy(&chan_ping);
+	coro_chan_destroy(&chan_pong);
+
+	coro_mutex_create(&cond_mutex);
+	coro_cond_create(&cond);
+	bench_run("mutex+cond", coro_new(cond_player_f, &players[0]),
+		  coro_new(cond_player_f, &players[1]));
+	coro_cond_destroy(&cond);
+	coro_mutex_destroy(&cond_mutex);
+
+	bench_run("suspend+wakeup", coro_new(raw_player_f, &players[0]),
+		  coro_new(raw_player_f, &players[1]));
+
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Microbenchmark of the libcoro primitives: how many coroutines
+ * can be created (and run to completion) per second, and how many
+ * context switches per second can be done. Build it with each
+ * backend to compare them, see 'make bench' in the parent folder.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+bench_empty_f(void *arg)
+{
+	(void)arg;
+	return NULL;
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void
+bench_create(int count)
+{
+	struct coro **coros = malloc(sizeof(*coros) * count);
+	double start = now();
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new(bench_empty_f, NULL);
+	double created = now();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double finished = now();
+	printf("create:   %d coros, %.0f creations/sec, "
+	       "%.0f full lifecycles/sec\n", count,
+	       count / (created - start), count / (finished - start));
+	free(coros);
+}
+
+static void
+bench_switch(int coro_count, long yield_count)
+{
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(bench_yield_f, &yield_count);
+	double start = now();
+	long long switches = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	double duration = now() - start;
+	printf("switch:   %d coros, %lld switches, %.0f switches/sec, "
+	       "%.1f ns/switch\n", coro_count, switches,
+	       switches / duration, duration * 1e9 / switches);
+}
+
+int
+main(int argc, char **argv)
+{
+	int create_count = argc > 1 ? atoi(argv[1]) : 10000;
+	long yield_count = argc > 2 ? atol(argv[2]) : 1000000;
+	coro_sched_init();
+#ifdef CORO_BACKEND_SIGNAL
+	printf("backend:  signal\n");
+#else
+	printf("backend:  asm\n");
+#endif
+	bench_create(create_count);
+	bench_switch(2, yield_count);
+	bench_switch(100, yield_count / 50);
+	/* Second round with the pool big enough to reuse all stacks. */
+	coro_stack_pool_configure(create_count, false);
+	bench_create(create_count);
+	bench_create(create_count);
+	struct coro_stack_pool_stats stats;
+	coro_stack_pool_stats(&stats);
+	printf("pool:     %llu hits, %llu misses, %llu cached\n",
+	       (unsigned long long)stats.hits,
+	       (unsigned long long)stats.misses,
+	       (unsigned long long)stats.cached);
+	return 0;
+}
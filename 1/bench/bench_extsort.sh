@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# External sort: the files hold 10 times more numbers than fit
+# into the memory limit, as ints. They are sorted with the limit
+# and, for comparison, all in memory. Printed are the program
+# time, the peak RSS, the spilled runs and merges. The output is
+# checked against the in-memory one. Usage:
+#
+#     bench/bench_extsort.sh [mem_limit_MiB] [coro_count] [file_count]
+#
+# Must be run from the directory with the built a.out. The make
+# build has no optimizations, build it with -O2 to measure.
+
+set -e
+
+MEM=${1:-16}
+CORO=${2:-4}
+FILES=${3:-8}
+COUNT=$((MEM * 1024 * 1024 / 4 * 10 / FILES))
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+for I in $(seq "$FILES"); do
+	python3 generator.py -f "$DIR/test_$I.txt" -c "$COUNT"
+done
+echo "$FILES files of $COUNT numbers, limit $MEM MiB, $CORO coroutines"
+
+# Runs a.out, prints its output and then its peak RSS in KiB.
+run() {
+	python3 -c '
+import resource, subprocess, sys
+subprocess.run(sys.argv[1:], check=True)
+print("RSS", resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss)
+' ./a.out "$@"
+}
+
+printf "%10s %10s %10s %6s %8s\n" mode time_ms rss_mib runs merges
+for MODE in external memory; do
+	if [ $MODE = external ]; then
+		OPT="--mem-limit=${MEM}M"
+	else
+		OPT=""
+	fi
+	OUT=$(run $OPT --algo=radix "$CORO" "$DIR"/test_*.txt)
+	US=$(echo "$OUT" | grep -a 'программы' | grep -o '[0-9]*$')
+	RSS=$(echo "$OUT" | grep -a '^RSS' | grep -o '[0-9]*$')
+	RUNS=$(echo "$OUT" | grep -a 'Серий' | grep -o '[0-9]\+' | tr '\n' ' ')
+	printf "%10s %10d %10d %6s %8s\n" $MODE $((US / 1000)) $((RSS / 1024)) \
+	       ${RUNS:-- -}
+	mv out.txt "$DIR/out_$MODE.txt"
+done
+cmp "$DIR/out_external.txt" "$DIR/out_memory.txt" && echo "Outputs match"
@@ -0,0 +1,131 @@
+/*
+ * Final merge benchmark: N numbers split into k sorted arrays are
+ * merged and printed as text. Compared are the old linear min
+ * scan with fprintf(), the loser tree with fprintf(), and the
+ * loser tree with the buffered writer. Output goes to /dev/null,
+ * so only the CPU work is measured. The old scan is O(k * N) and
+ * takes long for big k, it is limited by BENCH_SCAN_MAX_K.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "kmerge.h"
+#include "numwrite.h"
+
+enum {
+	BENCH_NUMBER_COUNT = 4 * 1000 * 1000,
+	BENCH_MAX_K = 1024,
+	BENCH_SCAN_MAX_K = 256,
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_int(const void *a, const void *b)
+{
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+/** The merge of the original solution. */
+static void
+merge_scan(int **data, const int *sizes, int k, FILE *out)
+{
+	int *indx = calloc(k, sizeof(int));
+	int min_idx = 0;
+	while (min_idx != -1) {
+		int curr_min = INT_MAX;
+		min_idx = -1;
+		for (int i = 0; i < k; ++i) {
+			if (sizes[i] > indx[i] && data[i][indx[i]] < curr_min) {
+				curr_min = data[i][indx[i]];
+				min_idx = i;
+			}
+		}
+		if (min_idx != -1) {
+			fprintf(out, "%d ", data[min_idx][indx[min_idx]]);
+			indx[min_idx] += 1;
+		}
+	}
+	free(indx);
+}
+
+static void
+merge_tree(int **data, const int *sizes, int k, FILE *out, int fd)
+{
+	struct kmerge_source *sources = malloc(k * sizeof(*sources));
+	for (int i = 0; i < k; ++i) {
+		sources[i].pos = data[i];
+		sources[i].end = data[i] + sizes[i];
+		sources[i].refill = NULL;
+	}
+	struct kmerge m;
+	kmerge_create(&m, sources, k);
+	int value;
+	if (out != NULL) {
+		while (kmerge_next(&m, &value))
+			fprintf(out, "%d ", value);
+	} else {
+		struct numwriter w;
+		numwriter_create(&w, fd, NUMWRITE_BUFFER_SIZE);
+		while (kmerge_next(&m, &value))
+			numwriter_put(&w, value);
+		numwriter_destroy(&w);
+	}
+	kmerge_destroy(&m);
+	free(sources);
+}
+
+int
+main(void)
+{
+	int n = BENCH_NUMBER_COUNT;
+	int *numbers = malloc(n * sizeof(int));
+	for (int i = 0; i < n; ++i)
+		numbers[i] = rand();
+	int fd = open("/dev/null", O_WRONLY);
+	FILE *out = fdopen(dup(fd), "w");
+	printf("%d numbers, ms per merge\n", n);
+	printf("%6s %14s %14s %14s\n", "k", "scan+fprintf", "tree+fprintf",
+	       "tree+writer");
+	for (int k = 2; k <= BENCH_MAX_K; k *= 2) {
+		int *data[BENCH_MAX_K];
+		int sizes[BENCH_MAX_K];
+		for (int i = 0; i < k; ++i) {
+			int begin = (long)n * i / k;
+			sizes[i] = (long)n * (i + 1) / k - begin;
+			data[i] = numbers + begin;
+			qsort(data[i], sizes[i], sizeof(int), cmp_int);
+		}
+		printf("%6d", k);
+		if (k <= BENCH_SCAN_MAX_K) {
+			double t = now();
+			merge_scan(data, sizes, k, out);
+			fflush(out);
+			printf(" %14.1f", (now() - t) * 1e3);
+		} else {
+			printf(" %14s", "-");
+		}
+		double t = now();
+		merge_tree(data, sizes, k, out, -1);
+		fflush(out);
+		printf(" %14.1f", (now() - t) * 1e3);
+		t = now();
+		merge_tree(data, sizes, k, NULL, fd);
+		printf(" %14.1f\n", (now() - t) * 1e3);
+	}
+	fclose(out);
+	close(fd);
+	free(numbers);
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Integer loading benchmark. The same text is parsed by the old
+ * two-pass loaders (fscanf(), then strtol()) and by numparse()
+ * with each supported instruction set. Text comes from files made
+ * by generator.py, or is generated in memory the same way when no
+ * files are given:
+ *
+ *     python3 generator.py -f test.txt -c 10000000
+ *     ./bench/bench_parse test.txt
+ *
+ * The file is read into memory first, so only parsing is timed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "numparse.h"
+
+enum {
+	BENCH_DEFAULT_COUNT = 1000000,
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** The loader of the original solution: count, rewind, fill. */
+static int *
+load_fscanf(const char *text, size_t size, size_t *count)
+{
+	FILE *f = fmemopen((void *)text, size, "r");
+	int number;
+	size_t n = 0;
+	while (fscanf(f, "%d", &number) == 1)
+		++n;
+	rewind(f);
+	int *array = malloc(n * sizeof(int) + 1);
+	size_t i = 0;
+	while (i < n && fscanf(f, "%d", &array[i]) == 1)
+		++i;
+	fclose(f);
+	*count = n;
+	return array;
+}
+
+/** Two passes of strtol() over the text in memory. */
+static int *
+load_strtol(const char *text, size_t size, size_t *count)
+{
+	(void)size;
+	size_t n = 0;
+	const char *p = text;
+	char *end;
+	while (true) {
+		strtol(p, &end, 10);
+		if (end == p)
+			break;
+		p = end;
+		++n;
+	}
+	int *array = malloc(n * sizeof(int) + 1);
+	p = text;
+	for (size_t i = 0; i < n; ++i) {
+		array[i] = strtol(p, &end, 10);
+		p = end;
+	}
+	*count = n;
+	return array;
+}
+
+static char *
+read_text(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	rewind(f);
+	char *text = calloc(*size + NUMPARSE_PADDING, 1);
+	if (fread(text, 1, *size, f) != *size) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+	return text;
+}
+
+/** Text like generator.py makes: random numbers up to 2^31. */
+static char *
+make_text(size_t count, size_t *size)
+{
+	char *text = calloc(count * 11 + NUMPARSE_PADDING, 1);
+	size_t pos = 0;
+	for (size_t i = 0; i < count; ++i) {
+		unsigned long v = ((unsigned long)rand() << 1 | (rand() & 1));
+		pos += sprintf(text + pos, i + 1 != count ? "%lu " : "%lu", v);
+	}
+	*size = pos;
+	return text;
+}
+
+static void
+bench_one(const char *name, int *(*load)(const char *, size_t, size_t *),
+	  enum numparse_isa isa, const char *text, size_t size,
+	  const int *expected, size_t expected_count, double *base)
+{
+	double t = now();
+	size_t count;
+	int *array = load != NULL ? load(text, size, &count) :
+		     numparse_with_isa(isa, text, size, &count);
+	t = now() - t;
+	if (expected != NULL && (count != expected_count ||
+	    memcmp(array, expected, count * sizeof(int)) != 0)) {
+		printf("%-8s result mismatch\n", name);
+		exit(1);
+	}
+	free(array);
+	if (*base == 0)
+		*base = t;
+	printf("%-8s %10.1f ms %8.1f M numbers/sec %6.1fx\n", name, t * 1e3,
+	       count / t / 1e6, *base / t);
+}
+
+static void
+bench_text(const char *title, const char *text, size_t size)
+{
+	size_t expected_count;
+	int *expected = load_strtol(text, size, &expected_count);
+	printf("%s: %zu numbers, %.1f MB\n", title, expected_count,
+	       size / 1e6);
+	double base = 0;
+	bench_one("fscanf", load_fscanf, 0, text, size, expected,
+		  expected_count, &base);
+	bench_one("strtol", load_strtol, 0, text, size, expected,
+		  expected_count, &base);
+	for (int isa = 0; isa < NUMPARSE_ISA_COUNT; ++isa) {
+		if (! numparse_isa_is_supported(isa))
+			continue;
+		bench_one(numparse_isa_name(isa), NULL, isa, text, size,
+			  expected, expected_count, &base);
+	}
+	free(expected);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size;
+	if (argc < 2) {
+		char *text = make_text(BENCH_DEFAULT_COUNT, &size);
+		bench_text("generated", text, size);
+		free(text);
+		return 0;
+	}
+	for (int i = 1; i < argc; ++i) {
+		char *text = read_text(argv[i], &size);
+		bench_text(argv[i], text, size);
+		free(text);
+	}
+	return 0;
+}
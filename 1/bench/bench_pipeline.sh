@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Merge after the barrier against the merge pipeline: the same
+# files are sorted with and without --pipeline. Printed are the
+# end-to-end program time and the merge time after the last
+# coroutine is done, which is the serial tail. Usage:
+#
+#     bench/bench_pipeline.sh [file_count] [numbers_per_file] ["options"]
+#
+# Options go to both runs, e.g. "--workers=4 --algo=radix". Must
+# be run from the directory with the built a.out. The make build
+# has no optimizations, build it with -O2 to measure.
+
+set -e
+
+FILES=${1:-16}
+COUNT=${2:-500000}
+OPTS=${3:-}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+for I in $(seq "$FILES"); do
+	python3 generator.py -f "$DIR/test_$I.txt" -c "$COUNT"
+done
+echo "$FILES files of $COUNT numbers, options: ${OPTS:-none}"
+
+printf "%6s %10s %10s %10s\n" coros mode total_ms tail_ms
+for CORO in 1 4 "$FILES"; do
+	for MODE in barrier pipeline; do
+		FLAG=""
+		[ $MODE = pipeline ] && FLAG="--pipeline"
+		OUT=$(./a.out $OPTS $FLAG "$CORO" "$DIR"/test_*.txt)
+		US=$(echo "$OUT" | grep -a 'программы' | grep -o '[0-9]*$')
+		TAIL=$(echo "$OUT" | grep -a 'слияния' | grep -o '[0-9]*$')
+		printf "%6s %10s %10d %10d\n" "$CORO" $MODE $((US / 1000)) \
+		       $((TAIL / 1000))
+		mv out.txt "$DIR/out_$MODE.txt"
+	done
+	cmp "$DIR/out_barrier.txt" "$DIR/out_pipeline.txt"
+done
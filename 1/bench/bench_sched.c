@@ -0,0 +1,61 @@
+/*
+ * Scheduler scalability benchmark: N coroutines each yield a
+ * fixed number of times and then finish, the scheduler collects
+ * them via coro_sched_wait(). Total work grows linearly with N,
+ * so time per switch should stay flat if the scheduler is O(1).
+ *
+ * Each coroutine stack takes 2 memory mappings (the stack and its
+ * guard page), so for 100k coroutines vm.max_map_count has to be
+ * above the default 65530.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+enum {
+	BENCH_YIELD_COUNT = 10,
+	BENCH_STACK_SIZE = 16 * 1024,
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_YIELD_COUNT; ++i)
+		coro_yield();
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_count = argc > 1 ? atoi(argv[1]) : 100000;
+	coro_sched_init();
+	printf("%10s %12s %12s %12s\n", "coros", "total ms", "switches",
+	       "ns/switch");
+	for (int count = 10; count <= max_count; count *= 10) {
+		double start = now();
+		for (int i = 0; i < count; ++i)
+			coro_new_with_stack(bench_yield_f, NULL,
+					    BENCH_STACK_SIZE);
+		long long switches = 0;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL) {
+			switches += coro_switch_count(c);
+			coro_delete(c);
+		}
+		double duration = now() - start;
+		printf("%10d %12.2f %12lld %12.1f\n", count, duration * 1e3,
+		       switches, duration * 1e9 / switches);
+	}
+	return 0;
+}
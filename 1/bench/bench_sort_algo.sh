@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Sort engine matrix: one file of each size and value range
+# (generator.py -m) is sorted by one coroutine with each --algo.
+# Printed is the coroutine time, which is reading, parsing and
+# sorting the file. Usage:
+#
+#     bench/bench_sort_algo.sh ["sizes"] ["ranges"]
+#
+# Must be run from the directory with the built a.out. The make
+# build has no optimizations, build it with -O2 to compare engines.
+
+set -e
+
+SIZES=${1:-"100000 1000000 10000000"}
+RANGES=${2:-"255 65535 2147483648"}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+printf "%10s %12s %10s %10s %10s\n" size range merge radix hybrid
+for SIZE in $SIZES; do
+	for RANGE in $RANGES; do
+		python3 generator.py -f "$DIR/test.txt" -c "$SIZE" -m "$RANGE"
+		LINE=$(printf "%10s %12s" "$SIZE" "$RANGE")
+		for ALGO in merge radix hybrid; do
+			# Coroutine time is in microseconds.
+			US=$(./a.out --algo=$ALGO 1 "$DIR/test.txt" |
+			     grep -a 'coro_0:' | grep -o '[0-9]*$')
+			LINE="$LINE $(printf "%7d ms" $((US / 1000)))"
+		done
+		echo "$LINE"
+	done
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Thread scaling of the sorter: the same files are sorted with
+# --workers=K for K from 1 to the number of CPUs, each run prints
+# its wall time. Usage:
+#
+#     bench/bench_sort_scaling.sh [file_count] [numbers_per_file]
+#
+# Must be run from the directory with the built a.out.
+
+set -e
+
+FILES=${1:-8}
+NUMBERS=${2:-1000000}
+CORO_COUNT=$((FILES * 2))
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+i=0
+while [ $i -lt "$FILES" ]; do
+	python3 generator.py -f "$DIR/test$i.txt" -c "$NUMBERS"
+	i=$((i + 1))
+done
+
+CPUS=$(nproc)
+echo "files: $FILES x $NUMBERS numbers, coroutines: $CORO_COUNT, cpus: $CPUS"
+K=1
+while [ $K -le "$CPUS" ]; do
+	# Output is written to out.txt in the current directory.
+	TIME=$(./a.out --workers=$K $CORO_COUNT "$DIR"/test*.txt | tail -n 1 |
+	       grep -o '[0-9]*$')
+	echo "workers: $K, time: $TIME us"
+	K=$((K * 2))
+done
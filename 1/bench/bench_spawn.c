@@ -0,0 +1,87 @@
+/*
+ * Spawn throughput: N tiny coroutines are created at once and then
+ * run to the end, each one adds its argument to a sum. Arguments
+ * are passed in a malloc()ed struct, as the sorter used to do, and
+ * copied into the coroutine by coro_new_with_arg(). Printed are
+ * the spawns per second, the stacks mapped, and the peak RSS.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "libcoro.h"
+
+struct bench_arg {
+	long value;
+	long *sum;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+bench_add_f(void *arg)
+{
+	struct bench_arg *a = arg;
+	*a->sum += a->value;
+	return NULL;
+}
+
+static void *
+bench_add_free_f(void *arg)
+{
+	bench_add_f(arg);
+	free(arg);
+	return NULL;
+}
+
+static void
+bench_spawn(const char *name, int count, bool is_inline)
+{
+	struct coro_stack_pool_stats before, after;
+	coro_stack_pool_stats(&before);
+	long sum = 0;
+	double start = now();
+	for (int i = 0; i < count; ++i) {
+		struct bench_arg arg = {i, &sum};
+		if (is_inline) {
+			coro_new_with_arg(bench_add_f, &arg, sizeof(arg));
+		} else {
+			struct bench_arg *copy = malloc(sizeof(*copy));
+			*copy = arg;
+			coro_new(bench_add_free_f, copy);
+		}
+	}
+	double created = now();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double finished = now();
+	coro_stack_pool_stats(&after);
+	if (sum != (long)count * (count - 1) / 2)
+		printf("wrong sum %ld\n", sum);
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-8s %10d %14.0f %14.0f %10llu %10ld\n", name, count,
+	       count / (created - start), count / (finished - start),
+	       (unsigned long long)(after.misses - before.misses),
+	       ru.ru_maxrss / 1024);
+}
+
+int
+main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000000;
+	coro_sched_init();
+	printf("%-8s %10s %14s %14s %10s %10s\n", "arg", "coros",
+	       "creations/sec", "lifecycles/sec", "mmaps", "max_rss_mb");
+	bench_spawn("malloc", count, false);
+	bench_spawn("inline", count, true);
+	coro_sched_destroy();
+	return 0;
+}
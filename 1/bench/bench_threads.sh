@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Coroutines against the thread pool: the same files are sorted
+# by coroutines and with --threads=N for each N. Printed is the
+# program time, outputs are compared. Usage:
+#
+#     bench/bench_threads.sh [file_count] [numbers_per_file] ["threads"] ["options"]
+#
+# Options go to all runs, e.g. "--algo=radix". Must be run from
+# the directory with the built a.out. The make build has no
+# optimizations, build it with -O2 to measure.
+
+set -e
+
+FILES=${1:-6}
+COUNT=${2:-40000}
+THREADS=${3:-"1 2 4 8"}
+OPTS=${4:-}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+for I in $(seq "$FILES"); do
+	python3 generator.py -f "$DIR/test_$I.txt" -c "$COUNT"
+done
+echo "$FILES files of $COUNT numbers, options: ${OPTS:-none}," \
+     "$(nproc) CPUs"
+
+# Prints the program time in ms of the given a.out arguments.
+run() {
+	US=$(./a.out $OPTS "$@" | grep -a 'программы' | grep -o '[0-9]*$')
+	echo $((US / 1000))
+}
+
+printf "%16s %10s\n" mode time_ms
+printf "%16s %10d\n" "coroutines x4" "$(run 4 "$DIR"/test_*.txt)"
+mv out.txt "$DIR/out_coro.txt"
+for N in $THREADS; do
+	printf "%16s %10d\n" "threads=$N" \
+	       "$(run --threads="$N" 0 "$DIR"/test_*.txt)"
+	cmp "$DIR/out_coro.txt" out.txt
+done
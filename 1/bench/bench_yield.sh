@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Context switches against the achieved latency. The same files
+# are sorted with a yield at every step, as without options, and
+# with the adaptive yields for several --latency targets. Printed
+# are the switches of all the coroutines, the target slice
+# (latency / coro_count) against the mean and the longest slice of
+# a sort, and the program time. The longest slice catches the
+# preemptions and page faults too, so it is noisy. Usage:
+#
+#     bench/bench_yield.sh [file_count] [numbers_per_file] ["options"]
+#
+# Options go to all runs, e.g. "--algo=radix". Must be run from
+# the directory with the built a.out. The make build has no
+# optimizations, build it with -O2 to measure.
+
+set -e
+
+FILES=${1:-8}
+COUNT=${2:-500000}
+OPTS=${3:-}
+CORO=4
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+for I in $(seq "$FILES"); do
+	python3 generator.py -f "$DIR/test_$I.txt" -c "$COUNT"
+done
+echo "$FILES files of $COUNT numbers, $CORO coros, options: ${OPTS:-none}"
+
+printf "%12s %10s %10s %10s %10s %10s\n" latency_us switches target_us \
+       mean_us max_us total_ms
+for LATENCY in 0 100 1000 10000 100000; do
+	FLAG=""
+	[ "$LATENCY" -gt 0 ] && FLAG="--latency=$LATENCY"
+	OUT=$(./a.out $OPTS $FLAG "$CORO" "$DIR"/test_*.txt)
+	SWITCHES=$(echo "$OUT" | grep -a 'переключений' |
+		   sed 's/.*переключений - \([0-9]*\).*/\1/' |
+		   awk '{s += $1} END {print s}')
+	RUN=$(echo "$OUT" | grep -a 'переключений' | grep -o '[0-9]*$' |
+	      awk '{s += $1} END {print s}')
+	MAX=$(echo "$OUT" | grep -a 'квант сортировки' |
+	      grep -o '[0-9]*$' | sort -n | tail -n 1)
+	US=$(echo "$OUT" | grep -a 'программы' | grep -o '[0-9]*$')
+	if [ "$LATENCY" -gt 0 ]; then
+		printf "%12d %10d %10d %10d %10d %10d\n" "$LATENCY" \
+		       "$SWITCHES" $((LATENCY / CORO)) $((RUN / SWITCHES)) \
+		       "$MAX" $((US / 1000))
+	else
+		printf "%12s %10d %10s %10d %10s %10d\n" every_step \
+		       "$SWITCHES" - $((RUN / SWITCHES)) - $((US / 1000))
+	fi
+	mv out.txt "$DIR/out_$LATENCY.txt"
+	cmp "$DIR/out_0.txt" "$DIR/out_$LATENCY.txt"
+done
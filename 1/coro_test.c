@@ -0,0 +1,656 @@
+#include "corosync.h"
+#include "libcoro.h"
+#include "unit.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Tests of the waits of libcoro: channels, mutex, condition
+ * variable, wait group, coro_join(), sleeps and I/O, and of the
+ * stack pool. Each test is run on one thread and on several
+ * threads of coro_sched_run().
+ */
+
+enum {
+	THREADS_MAX = 3,
+};
+
+/** Run all the coroutines on @a thread_count threads, delete them. */
+static void
+run_all(int thread_count)
+{
+	unit_fail_if(coro_sched_run(thread_count) != 0);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+}
+
+enum {
+	CHAN_SENDERS = 4,
+	CHAN_RECEIVERS = 3,
+	CHAN_MESSAGES = 1000,
+};
+
+static struct coro_chan chan;
+static struct coro_wait_group chan_senders;
+static long chan_sum;
+static long chan_count;
+
+static void *
+chan_sender_f(void *arg)
+{
+	(void)arg;
+	for (long i = 1; i <= CHAN_MESSAGES; ++i) {
+		unit_fail_if(coro_chan_send(&chan, (void *)i) != 0);
+		if (i % 7 == 0)
+			coro_yield();
+	}
+	coro_wait_group_done(&chan_senders);
+	return NULL;
+}
+
+static void *
+chan_receiver_f(void *arg)
+{
+	(void)arg;
+	void *item;
+	while (coro_chan_recv(&chan, &item) == 0) {
+		__atomic_add_fetch(&chan_sum, (long)item, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&chan_count, 1, __ATOMIC_RELAXED);
+	}
+	unit_fail_if(errno != EPIPE);
+	return NULL;
+}
+
+static void *
+chan_closer_f(void *arg)
+{
+	(void)arg;
+	coro_wait_group_wait(&chan_senders);
+	coro_chan_close(&chan);
+	return NULL;
+}
+
+/**
+ * Senders and receivers through a channel of 2 messages, so both
+ * of them park. The channel is closed when all are sent, then the
+ * receivers take what is left and stop.
+ */
+static void
+test_chan(int thread_count)
+{
+	unit_test_start();
+	unit_msg("%d threads", thread_count);
+
+	unit_fail_if(coro_chan_create(&chan, 2) != 0);
+	coro_wait_group_create(&chan_senders);
+	coro_wait_group_add(&chan_senders, CHAN_SENDERS);
+	chan_sum = 0;
+	chan_count = 0;
+	for (int i = 0; i < CHAN_RECEIVERS; ++i)
+		coro_new(chan_receiver_f, NULL);
+	for (int i = 0; i < CHAN_SENDERS; ++i)
+		coro_new(chan_sender_f, NULL);
+	coro_new(chan_closer_f, NULL);
+	run_all(thread_count);
+	unit_check(chan_count == CHAN_SENDERS * CHAN_MESSAGES,
+		   "all the messages are received");
+	unit_check(chan_sum == (long)CHAN_SENDERS * CHAN_MESSAGES *
+		   (CHAN_MESSAGES + 1) / 2, "each message once");
+	coro_wait_group_destroy(&chan_senders);
+	coro_chan_destroy(&chan);
+
+	unit_test_finish();
+}
+
+static int close_failed_sends;
+static int close_failed_recvs;
+
+static void *
+close_sender_f(void *arg)
+{
+	if (coro_chan_send(&chan, arg) != 0 && errno == EPIPE)
+		__atomic_add_fetch(&close_failed_sends, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *
+close_receiver_f(void *arg)
+{
+	(void)arg;
+	void *item;
+	if (coro_chan_recv(&chan, &item) != 0 && errno == EPIPE)
+		__atomic_add_fetch(&close_failed_recvs, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *
+close_f(void *arg)
+{
+	/* Let the others reach the channel and park. */
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	coro_chan_close(&chan);
+	return arg;
+}
+
+/**
+ * Close wakes up the parked senders of a full channel and the
+ * parked receivers of an empty one, all of them fail. The messages
+ * sent before the close are still received.
+ */
+static void
+test_chan_close(int thread_count)
+{
+	unit_test_start();
+	unit_msg("%d threads", thread_count);
+
+	unit_fail_if(coro_chan_create(&chan, 1) != 0);
+	unit_fail_if(coro_chan_send(&chan, (void *)1) != 0);
+	close_failed_sends = 0;
+	for (int i = 0; i < 3; ++i)
+		coro_new(close_sender_f, (void *)2);
+	coro_new(close_f, NULL);
+	run_all(thread_count);
+	unit_check(close_failed_sends == 3, "parked senders fail on close");
+	void *item = NULL;
+	unit_check(coro_chan_recv(&chan, &item) == 0 && item == (void *)1,
+		   "the message sent before close is received");
+	unit_check(coro_chan_recv(&chan, &item) != 0 && errno == EPIPE,
+		   "then the closed channel is empty");
+	unit_check(coro_chan_send(&chan, item) != 0 && errno == EPIPE,
+		   "send to a closed channel fails");
+	coro_chan_destroy(&chan);
+
+	unit_fail_if(coro_chan_create(&chan, 1) != 0);
+	close_failed_recvs = 0;
+	for (int i = 0; i < 3; ++i)
+		coro_new(close_receiver_f, NULL);
+	coro_new(close_f, NULL);
+	run_all(thread_count);
+	unit_check(close_failed_recvs == 3, "parked receivers fail on close");
+	coro_chan_destroy(&chan);
+
+	unit_test_finish();
+}
+
+enum {
+	MUTEX_COROS = 6,
+	MUTEX_ROUNDS = 500,
+};
+
+static struct coro_mutex mutex;
+static struct coro_cond cond;
+static long mutex_counter;
+static bool mutex_is_inside;
+static bool mutex_is_broken;
+/** Whose turn it is in the condition variable test. */
+static long cond_turn;
+
+static void *
+mutex_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < MUTEX_ROUNDS; ++i) {
+		coro_mutex_lock(&mutex);
+		if (mutex_is_inside)
+			mutex_is_broken = true;
+		mutex_is_inside = true;
+		long value = mutex_counter;
+		/* Hold the mutex across a yield. */
+		coro_yield();
+		mutex_counter = value + 1;
+		mutex_is_inside = false;
+		coro_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+static void *
+cond_f(void *arg)
+{
+	long me = (long)arg;
+	coro_mutex_lock(&mutex);
+	for (int i = 0; i < MUTEX_ROUNDS; ++i) {
+		while (cond_turn % MUTEX_COROS != me)
+			coro_cond_wait(&cond, &mutex);
+		++cond_turn;
+		coro_cond_broadcast(&cond);
+	}
+	coro_mutex_unlock(&mutex);
+	return NULL;
+}
+
+static void
+test_mutex_cond(int thread_count)
+{
+	unit_test_start();
+	unit_msg("%d threads", thread_count);
+
+	coro_mutex_create(&mutex);
+	coro_cond_create(&cond);
+	mutex_counter = 0;
+	mutex_is_inside = false;
+	mutex_is_broken = false;
+	for (int i = 0; i < MUTEX_COROS; ++i)
+		coro_new(mutex_f, NULL);
+	run_all(thread_count);
+	unit_check(! mutex_is_broken, "one owner at a time");
+	unit_check(mutex_counter == MUTEX_COROS * MUTEX_ROUNDS,
+		   "no increment is lost");
+	unit_check(coro_mutex_trylock(&mutex), "trylock of a free mutex");
+	unit_check(! coro_mutex_trylock(&mutex), "trylock of a held mutex");
+	coro_mutex_unlock(&mutex);
+
+	cond_turn = 0;
+	for (long i = 0; i < MUTEX_COROS; ++i)
+		coro_new(cond_f, (void *)i);
+	run_all(thread_count);
+	unit_check(cond_turn == MUTEX_COROS * MUTEX_ROUNDS,
+		   "condition variable passes the turns around");
+	coro_cond_destroy(&cond);
+	coro_mutex_destroy(&mutex);
+
+	unit_test_finish();
+}
+
+enum {
+	WAIT_GROUP_JOBS = 50,
+};
+
+static struct coro_wait_group wait_group;
+static int wait_group_done;
+static bool wait_group_is_early;
+
+static void *
+wait_group_job_f(void *arg)
+{
+	long yields = (long)arg;
+	for (long i = 0; i < yields; ++i)
+		coro_yield();
+	__atomic_add_fetch(&wait_group_done, 1, __ATOMIC_RELAXED);
+	coro_wait_group_done(&wait_group);
+	return NULL;
+}
+
+static void *
+wait_group_waiter_f(void *arg)
+{
+	(void)arg;
+	coro_wait_group_wait(&wait_group);
+	if (__atomic_load_n(&wait_group_done, __ATOMIC_RELAXED) !=
+	    WAIT_GROUP_JOBS)
+		wait_group_is_early = true;
+	return NULL;
+}
+
+static void
+test_wait_group(int thread_count)
+{
+	unit_test_start();
+	unit_msg("%d threads", thread_count);
+
+	coro_wait_group_create(&wait_group);
+	wait_group_done = 0;
+	wait_group_is_early = false;
+	coro_wait_group_add(&wait_group, WAIT_GROUP_JOBS);
+	for (int i = 0; i < 3; ++i)
+		coro_new(wait_group_waiter_f, NULL);
+	for (long i = 0; i < WAIT_GROUP_JOBS; ++i)
+		coro_new(wait_group_job_f, (void *)(i % 5));
+	run_all(thread_count);
+	unit_check(wait_group_done == WAIT_GROUP_JOBS, "all the jobs are done");
+	unit_check(! wait_group_is_early, "the waiters wake up after them");
+	/* Nothing to wait for, returns right away. */
+	coro_wait_group_wait(&wait_group);
+	coro_wait_group_destroy(&wait_group);
+
+	unit_test_finish();
+}
+
+enum {
+	JOIN_PARENTS = 8,
+	JOIN_CHILDREN = 100,
+	JOIN_WAITERS = 5,
+};
+
+static long join_sum;
+static bool join_is_wrong;
+
+static void *
+join_child_f(void *arg)
+{
+	if ((intptr_t)arg % 3 == 0)
+		coro_yield();
+	return arg;
+}
+
+/** Join each child twice: while it runs and when it is finished. */
+static void *
+join_parent_f(void *arg)
+{
+	(void)arg;
+	struct coro *children[JOIN_CHILDREN];
+	for (intptr_t i = 0; i < JOIN_CHILDREN; ++i)
+		children[i] = coro_new(join_child_f, (void *)(i + 1));
+	long sum = 0;
+	for (intptr_t i = 0; i < JOIN_CHILDREN; ++i) {
+		intptr_t result = (intptr_t)coro_join(children[i]);
+		if ((intptr_t)coro_join(children[i]) != result ||
+		    result != i + 1)
+			join_is_wrong = true;
+		sum += result;
+	}
+	__atomic_add_fetch(&join_sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static struct coro *join_slow;
+
+static void *
+join_slow_f(void *arg)
+{
+	for (int i = 0; i < 100; ++i)
+		coro_yield();
+	return arg;
+}
+
+static void *
+join_waiter_f(void *arg)
+{
+	(void)arg;
+	if (coro_join(join_slow) != (void *)42)
+		join_is_wrong = true;
+	return NULL;
+}
+
+/**
+ * Fan-out: the parents join their children, several coroutines
+ * join one slow coroutine, and the scheduler joins too.
+ */
+static void
+test_join(int thread_count)
+{
+	unit_test_start();
+	unit_msg("%d threads", thread_count);
+
+	join_sum = 0;
+	join_is_wrong = false;
+	for (int i = 0; i < JOIN_PARENTS; ++i)
+		coro_new(join_parent_f, NULL);
+	join_slow = coro_new(join_slow_f, (void *)42);
+	for (int i = 0; i < JOIN_WAITERS; ++i)
+		coro_new(join_waiter_f, NULL);
+	run_all(thread_count);
+	unit_check(! join_is_wrong, "joins return the results");
+	unit_check(join_sum == (long)JOIN_PARENTS * JOIN_CHILDREN *
+		   (JOIN_CHILDREN + 1) / 2, "every child is joined");
+
+	struct coro *c = coro_new(join_slow_f, (void *)7);
+	unit_check(coro_join(c) == (void *)7, "the scheduler joins");
+	unit_check(coro_is_finished(c), "the joined coroutine is finished");
+	unit_check(coro_sched_wait() == c, "and is still returned by wait");
+	coro_delete(c);
+
+	unit_test_finish();
+}
+
+enum {
+	SLEEP_COROS = 20,
+	SLEEP_ROUNDS = 5,
+};
+
+static bool sleep_is_early;
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void *
+sleep_f(void *arg)
+{
+	uint64_t usec = (uintptr_t)arg;
+	for (int i = 0; i < SLEEP_ROUNDS; ++i) {
+		uint64_t start = now_us();
+		coro_sleep(usec);
+		if (now_us() - start < usec)
+			sleep_is_early = true;
+		/* Wake up maybe on another thread, and go on. */
+		coro_yield();
+	}
+	return arg;
+}
+
+/**
+ * Sleepers of different lengths, which move between the threads.
+ * None of them wakes up early, and all of them wake up.
+ */
+static void
+test_sleep(int thread_count)
+{
+	unit_test_start();
+	unit_msg("%d threads", thread_count);
+
+	sleep_is_early = false;
+	for (uintptr_t i = 0; i < SLEEP_COROS; ++i)
+		coro_new(sleep_f, (void *)(100 + i % 7 * 700));
+	uint64_t start = now_us();
+	run_all(thread_count);
+	unit_check(! sleep_is_early, "no sleep ends early");
+	unit_check(now_us() - start >= (100 + 6 * 700) * SLEEP_ROUNDS,
+		   "the run lasts as long as the longest sleeper");
+
+	unit_test_finish();
+}
+
+enum {
+	IO_PAIRS = 4,
+	/* More than a pipe holds, so both sides wait. */
+	IO_SIZE = 256 * 1024,
+	IO_CHUNK = 3000,
+};
+
+static int io_pipes[IO_PAIRS][2];
+static bool io_is_wrong;
+static const char *io_file;
+
+static inline char
+io_byte(int pair, size_t pos)
+{
+	return (char)(pos * 31 + pair);
+}
+
+static void *
+io_writer_f(void *arg)
+{
+	int pair = (intptr_t)arg;
+	int fd = io_pipes[pair][1];
+	char buf[IO_CHUNK];
+	for (size_t pos = 0; pos < IO_SIZE;) {
+		size_t size = IO_SIZE - pos < IO_CHUNK ? IO_SIZE - pos :
+			      IO_CHUNK;
+		for (size_t i = 0; i < size; ++i)
+			buf[i] = io_byte(pair, pos + i);
+		for (size_t done = 0; done < size;) {
+			ssize_t rc = coro_write(fd, buf + done, size - done);
+			if (rc <= 0) {
+				io_is_wrong = true;
+				goto out;
+			}
+			done += rc;
+		}
+		pos += size;
+		coro_yield();
+	}
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *
+io_reader_f(void *arg)
+{
+	int pair = (intptr_t)arg;
+	int fd = io_pipes[pair][0];
+	char buf[IO_CHUNK];
+	size_t pos = 0;
+	ssize_t rc;
+	while ((rc = coro_read(fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < rc; ++i) {
+			if (buf[i] != io_byte(pair, pos + i))
+				io_is_wrong = true;
+		}
+		pos += rc;
+	}
+	if (rc < 0 || pos != IO_SIZE)
+		io_is_wrong = true;
+	close(fd);
+	return NULL;
+}
+
+/** Read the test file via io_uring, or plain reads without it. */
+static void *
+io_file_reader_f(void *arg)
+{
+	(void)arg;
+	int fd = coro_open(io_file, O_RDONLY, 0);
+	if (fd < 0) {
+		io_is_wrong = true;
+		return NULL;
+	}
+	char buf[IO_CHUNK];
+	size_t pos = 0;
+	ssize_t rc;
+	while ((rc = coro_read(fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < rc; ++i) {
+			if (buf[i] != io_byte(0, pos + i))
+				io_is_wrong = true;
+		}
+		pos += rc;
+		coro_yield();
+	}
+	if (rc < 0 || pos != IO_SIZE)
+		io_is_wrong = true;
+	close(fd);
+	return NULL;
+}
+
+/**
+ * Writers and readers of pipes, which fill up and run dry, so both
+ * sides park in the reactor and may wake up on another thread.
+ * Several coroutines read one regular file at the same time.
+ */
+static void
+test_io(int thread_count)
+{
+	unit_test_start();
+	unit_msg("%d threads", thread_count);
+
+	char path[] = "/tmp/coro_test_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	char *data = malloc(IO_SIZE);
+	for (size_t i = 0; i < IO_SIZE; ++i)
+		data[i] = io_byte(0, i);
+	unit_fail_if(write(fd, data, IO_SIZE) != IO_SIZE);
+	free(data);
+	close(fd);
+	io_file = path;
+
+	io_is_wrong = false;
+	for (intptr_t i = 0; i < IO_PAIRS; ++i) {
+		unit_fail_if(pipe(io_pipes[i]) != 0);
+		fcntl(io_pipes[i][0], F_SETFL, O_NONBLOCK);
+		fcntl(io_pipes[i][1], F_SETFL, O_NONBLOCK);
+		coro_new(io_reader_f, (void *)i);
+		coro_new(io_writer_f, (void *)i);
+		coro_new(io_file_reader_f, NULL);
+	}
+	run_all(thread_count);
+	unit_check(! io_is_wrong, "all the bytes are read, in order");
+	unlink(path);
+
+	unit_test_finish();
+}
+
+enum {
+	STACK_COROS = 8,
+	/* About 300 KB of the 1 MB stack. */
+	STACK_DEPTH = 300,
+};
+
+static int
+stack_recurse(int depth)
+{
+	volatile char frame[1024];
+	frame[0] = (char)depth;
+	if (depth == 0)
+		return frame[0];
+	return stack_recurse(depth - 1) + frame[0];
+}
+
+static void *
+stack_deep_f(void *arg)
+{
+	stack_recurse(STACK_DEPTH);
+	return arg;
+}
+
+/**
+ * The stacks are taken and grown on all the threads. With no
+ * stacks cached, each coroutine maps its own, on any thread, and
+ * all that is counted in the stats of the caller.
+ */
+static void
+test_stack_pool(int thread_count)
+{
+	unit_test_start();
+	unit_msg("%d threads", thread_count);
+
+	coro_stack_pool_configure(0, false);
+	struct coro_stack_pool_stats before, after;
+	coro_stack_pool_stats(&before);
+	for (int i = 0; i < STACK_COROS; ++i)
+		coro_new(stack_deep_f, NULL);
+	run_all(thread_count);
+	coro_stack_pool_stats(&after);
+	unit_check(after.hits == before.hits,
+		   "no cached stacks on any thread");
+	unit_check(after.misses - before.misses == STACK_COROS,
+		   "each stack is mapped and counted once");
+	unit_check(after.grows - before.grows >= STACK_COROS,
+		   "each stack grows, it is counted");
+	unit_check(after.cached == 0, "nothing is cached");
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	for (int threads = 1; threads <= THREADS_MAX; threads += 2) {
+		test_chan(threads);
+		test_chan_close(threads);
+		test_mutex_cond(threads);
+		test_wait_group(threads);
+		test_join(threads);
+		test_sleep(threads);
+		test_io(threads);
+		test_stack_pool(threads);
+	}
+	coro_sched_destroy();
+
+	unit_test_finish();
+	return 0;
+}
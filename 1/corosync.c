@@ -0,0 +1,339 @@
+#include "corosync.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include "libcoro.h"
+
+/**
+ * A waiting coroutine. Lives on its stack, so once is_done is set
+ * and the lock of the object is released, it can be gone.
+ */
+struct coro_waiter {
+	struct coro *coro;
+	struct coro_waiter *next;
+	/** Channel message, to send or received. */
+	void *item;
+	/** Set by the waker, under the lock of the object. */
+	bool is_done;
+	/** False, if the wait has failed. */
+	bool is_ok;
+};
+
+static void
+coro_wait_list_create(struct coro_wait_list *list)
+{
+	list->first = NULL;
+	list->last = NULL;
+}
+
+static void
+coro_wait_list_push(struct coro_wait_list *list, struct coro_waiter *w)
+{
+	w->next = NULL;
+	if (list->last == NULL)
+		list->first = w;
+	else
+		list->last->next = w;
+	list->last = w;
+}
+
+static struct coro_waiter *
+coro_wait_list_pop(struct coro_wait_list *list)
+{
+	struct coro_waiter *w = list->first;
+	if (w == NULL)
+		return NULL;
+	list->first = w->next;
+	if (list->first == NULL)
+		list->last = NULL;
+	return w;
+}
+
+/**
+ * Put the current coroutine into @a list and suspend it until
+ * coro_waiter_wake(). Is called and returns with @a lock locked.
+ * Returns the waiter's is_ok.
+ */
+static bool
+coro_waiter_park(struct coro_wait_list *list, pthread_mutex_t *lock,
+		 void **item)
+{
+	struct coro_waiter w;
+	w.coro = coro_this();
+	w.item = item != NULL ? *item : NULL;
+	w.is_done = false;
+	w.is_ok = false;
+	coro_wait_list_push(list, &w);
+	/*
+	 * A wakeup between the unlock and coro_suspend() is not lost,
+	 * coro_suspend() returns right away then. Other wakeups of
+	 * this coroutine only make the loop check is_done again.
+	 */
+	do {
+		pthread_mutex_unlock(lock);
+		coro_suspend();
+		pthread_mutex_lock(lock);
+	} while (! w.is_done);
+	if (item != NULL)
+		*item = w.item;
+	return w.is_ok;
+}
+
+/**
+ * Let a waiter go. Must be called with the lock of the object
+ * held, so the waiter can't see is_done and leave before the
+ * wakeup.
+ */
+static void
+coro_waiter_wake(struct coro_waiter *w, bool is_ok)
+{
+	w->is_ok = is_ok;
+	w->is_done = true;
+	coro_wakeup(w->coro);
+}
+
+static void
+coro_waiter_wake_all(struct coro_wait_list *list, bool is_ok)
+{
+	struct coro_waiter *w;
+	while ((w = coro_wait_list_pop(list)) != NULL)
+		coro_waiter_wake(w, is_ok);
+}
+
+void
+coro_mutex_create(struct coro_mutex *m)
+{
+	pthread_mutex_init(&m->lock, NULL);
+	m->is_locked = false;
+	coro_wait_list_create(&m->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *m)
+{
+	assert(m->waiters.first == NULL);
+	pthread_mutex_destroy(&m->lock);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	if (! m->is_locked)
+		m->is_locked = true;
+	else
+		/* Locked for us by coro_mutex_unlock(). */
+		coro_waiter_park(&m->waiters, &m->lock, NULL);
+	pthread_mutex_unlock(&m->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	bool is_free = ! m->is_locked;
+	m->is_locked = true;
+	pthread_mutex_unlock(&m->lock);
+	return is_free;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	assert(m->is_locked);
+	struct coro_waiter *w = coro_wait_list_pop(&m->waiters);
+	if (w != NULL)
+		coro_waiter_wake(w, true);
+	else
+		m->is_locked = false;
+	pthread_mutex_unlock(&m->lock);
+}
+
+void
+coro_cond_create(struct coro_cond *c)
+{
+	pthread_mutex_init(&c->lock, NULL);
+	coro_wait_list_create(&c->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *c)
+{
+	assert(c->waiters.first == NULL);
+	pthread_mutex_destroy(&c->lock);
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	pthread_mutex_lock(&c->lock);
+	/*
+	 * The mutex is unlocked with the cond lock held, so a signal
+	 * sent right after the unlock finds this waiter in the list.
+	 */
+	coro_mutex_unlock(m);
+	coro_waiter_park(&c->waiters, &c->lock, NULL);
+	pthread_mutex_unlock(&c->lock);
+	coro_mutex_lock(m);
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	pthread_mutex_lock(&c->lock);
+	struct coro_waiter *w = coro_wait_list_pop(&c->waiters);
+	if (w != NULL)
+		coro_waiter_wake(w, true);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	pthread_mutex_lock(&c->lock);
+	coro_waiter_wake_all(&c->waiters, true);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+coro_wait_group_create(struct coro_wait_group *wg)
+{
+	pthread_mutex_init(&wg->lock, NULL);
+	wg->count = 0;
+	coro_wait_list_create(&wg->waiters);
+}
+
+void
+coro_wait_group_destroy(struct coro_wait_group *wg)
+{
+	assert(wg->waiters.first == NULL);
+	pthread_mutex_destroy(&wg->lock);
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *wg, long count)
+{
+	pthread_mutex_lock(&wg->lock);
+	wg->count += count;
+	assert(wg->count >= 0);
+	if (wg->count == 0)
+		coro_waiter_wake_all(&wg->waiters, true);
+	pthread_mutex_unlock(&wg->lock);
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *wg)
+{
+	pthread_mutex_lock(&wg->lock);
+	if (wg->count > 0)
+		coro_waiter_park(&wg->waiters, &wg->lock, NULL);
+	pthread_mutex_unlock(&wg->lock);
+}
+
+int
+coro_chan_create(struct coro_chan *ch, size_t capacity)
+{
+	if (capacity == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	ch->items = malloc(capacity * sizeof(ch->items[0]));
+	if (ch->items == NULL)
+		return -1;
+	pthread_mutex_init(&ch->lock, NULL);
+	ch->capacity = capacity;
+	ch->head = 0;
+	ch->count = 0;
+	ch->is_closed = false;
+	coro_wait_list_create(&ch->senders);
+	coro_wait_list_create(&ch->receivers);
+	return 0;
+}
+
+void
+coro_chan_destroy(struct coro_chan *ch)
+{
+	assert(ch->senders.first == NULL && ch->receivers.first == NULL);
+	pthread_mutex_destroy(&ch->lock);
+	free(ch->items);
+}
+
+/** Append a message to the ring buffer, which must not be full. */
+static void
+coro_chan_push(struct coro_chan *ch, void *item)
+{
+	size_t tail = ch->head + ch->count;
+	if (tail >= ch->capacity)
+		tail -= ch->capacity;
+	ch->items[tail] = item;
+	++ch->count;
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *item)
+{
+	pthread_mutex_lock(&ch->lock);
+	bool is_ok = true;
+	struct coro_waiter *receiver;
+	if (ch->is_closed) {
+		is_ok = false;
+	} else if ((receiver = coro_wait_list_pop(&ch->receivers)) != NULL) {
+		/* The channel is empty, skip it. */
+		receiver->item = item;
+		coro_waiter_wake(receiver, true);
+	} else if (ch->count < ch->capacity) {
+		coro_chan_push(ch, item);
+	} else {
+		/* A receiver moves the message into the channel. */
+		is_ok = coro_waiter_park(&ch->senders, &ch->lock, &item);
+	}
+	pthread_mutex_unlock(&ch->lock);
+	if (! is_ok) {
+		errno = EPIPE;
+		return -1;
+	}
+	return 0;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **item)
+{
+	pthread_mutex_lock(&ch->lock);
+	bool is_ok = true;
+	if (ch->count > 0) {
+		*item = ch->items[ch->head];
+		if (++ch->head == ch->capacity)
+			ch->head = 0;
+		--ch->count;
+		struct coro_waiter *sender =
+			coro_wait_list_pop(&ch->senders);
+		if (sender != NULL) {
+			coro_chan_push(ch, sender->item);
+			coro_waiter_wake(sender, true);
+		}
+	} else if (ch->is_closed) {
+		is_ok = false;
+	} else {
+		*item = NULL;
+		is_ok = coro_waiter_park(&ch->receivers, &ch->lock, item);
+	}
+	pthread_mutex_unlock(&ch->lock);
+	if (! is_ok) {
+		errno = EPIPE;
+		return -1;
+	}
+	return 0;
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	pthread_mutex_lock(&ch->lock);
+	ch->is_closed = true;
+	/* Waiting receivers mean the channel is empty. */
+	coro_waiter_wake_all(&ch->receivers, false);
+	coro_waiter_wake_all(&ch->senders, false);
+	pthread_mutex_unlock(&ch->lock);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Synchronization of coroutines: a mutex, a condition variable, a
+ * wait group and a bounded channel. A coroutine which has to wait
+ * is suspended with coro_suspend() and is woken up by the one that
+ * lets it go, so the waits don't spin or yield in a loop. All of
+ * them work between coroutines of different threads of
+ * coro_sched_run() too. Waiters are served in FIFO order.
+ *
+ * The objects must not be copied, and must not be destroyed while
+ * anyone waits on them.
+ */
+
+struct coro_waiter;
+
+/** FIFO list of waiting coroutines. */
+struct coro_wait_list {
+	struct coro_waiter *first;
+	struct coro_waiter *last;
+};
+
+/**
+ * Mutex which is held by a coroutine, and can be held across
+ * yields and I/O. Unlocking passes it to the first waiter right
+ * away.
+ */
+struct coro_mutex {
+	/** Protects the fields, held only for a few instructions. */
+	pthread_mutex_t lock;
+	bool is_locked;
+	struct coro_wait_list waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *m);
+
+void
+coro_mutex_destroy(struct coro_mutex *m);
+
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Lock the mutex, if it is free. Returns true, if locked. */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+/** Condition variable to use with struct coro_mutex. */
+struct coro_cond {
+	pthread_mutex_t lock;
+	struct coro_wait_list waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *c);
+
+void
+coro_cond_destroy(struct coro_cond *c);
+
+/**
+ * Unlock @a m, wait for a signal and lock @a m back. There are no
+ * spurious wakeups, but the condition still has to be checked in
+ * a loop: another coroutine can change it before @a m is locked.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/** Wake up the first waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/**
+ * Counter of unfinished jobs, like Go's sync.WaitGroup. The jobs
+ * are added with coro_wait_group_add() before they are started,
+ * each of them calls coro_wait_group_done() in the end, and
+ * coro_wait_group_wait() blocks until all are done.
+ */
+struct coro_wait_group {
+	pthread_mutex_t lock;
+	long count;
+	struct coro_wait_list waiters;
+};
+
+void
+coro_wait_group_create(struct coro_wait_group *wg);
+
+void
+coro_wait_group_destroy(struct coro_wait_group *wg);
+
+/** Add @a count jobs, can be negative. */
+void
+coro_wait_group_add(struct coro_wait_group *wg, long count);
+
+static inline void
+coro_wait_group_done(struct coro_wait_group *wg)
+{
+	coro_wait_group_add(wg, -1);
+}
+
+/** Wait until the counter is 0. */
+void
+coro_wait_group_wait(struct coro_wait_group *wg);
+
+/**
+ * Bounded FIFO channel of pointers. Senders wait while it is full,
+ * receivers wait while it is empty. A message sent when a receiver
+ * is waiting goes to the receiver directly.
+ */
+struct coro_chan {
+	pthread_mutex_t lock;
+	/** Ring buffer of the messages. */
+	void **items;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	bool is_closed;
+	struct coro_wait_list senders;
+	struct coro_wait_list receivers;
+};
+
+/**
+ * Create a channel for @a capacity messages, at least 1.
+ * @retval 0 Success.
+ * @retval -1 Invalid capacity or no memory, errno is set.
+ */
+int
+coro_chan_create(struct coro_chan *ch, size_t capacity);
+
+/** Free the channel. The messages left in it are dropped. */
+void
+coro_chan_destroy(struct coro_chan *ch);
+
+/**
+ * Send a message, waiting while the channel is full.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed, errno is EPIPE.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *item);
+
+/**
+ * Receive a message into @a item, waiting while the channel is
+ * empty.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and empty, errno is EPIPE.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **item);
+
+/**
+ * Close the channel: the senders fail from now on, including the
+ * waiting ones, and the receivers fail once the messages left in
+ * it are taken.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "extsort.h"
+#include "kmerge.h"
+#include "runfile.h"
+
+void
+extsort_create(struct extsort *s, size_t mem_limit)
+{
+	const char *dir = getenv("TMPDIR");
+	s->dir = strdup(dir != NULL && *dir != 0 ? dir : "/tmp");
+	s->mem_limit = mem_limit;
+	pthread_mutex_init(&s->lock, NULL);
+	s->runs = NULL;
+	s->run_count = 0;
+	s->run_capacity = 0;
+	s->merge_count = 0;
+}
+
+void
+extsort_destroy(struct extsort *s)
+{
+	for (int i = 0; i < s->run_count; ++i)
+		close(s->runs[i].fd);
+	free(s->runs);
+	free(s->dir);
+	pthread_mutex_destroy(&s->lock);
+}
+
+/** Create an anonymous temporary file for a run. */
+static int
+extsort_run_open(struct extsort *s)
+{
+	size_t len = strlen(s->dir) + sizeof("/sort_run_XXXXXX");
+	char *path = malloc(len);
+	snprintf(path, len, "%s/sort_run_XXXXXX", s->dir);
+	int fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+static void
+extsort_run_add(struct extsort *s, int fd, size_t count)
+{
+	pthread_mutex_lock(&s->lock);
+	if (s->run_count == s->run_capacity) {
+		s->run_capacity = s->run_capacity == 0 ? 16 :
+				  s->run_capacity * 2;
+		s->runs = realloc(s->runs,
+				  s->run_capacity * sizeof(s->runs[0]));
+	}
+	s->runs[s->run_count].fd = fd;
+	s->runs[s->run_count].count = count;
+	++s->run_count;
+	pthread_mutex_unlock(&s->lock);
+}
+
+int
+extsort_spill(struct extsort *s, const int *data, size_t count)
+{
+	int fd = extsort_run_open(s);
+	if (fd < 0)
+		return -1;
+	struct runfile_writer writer;
+	runfile_writer_create(&writer, fd, 0, EXTSORT_BUFFER_MIN);
+	runfile_writer_put_array(&writer, data, count);
+	if (runfile_writer_destroy(&writer) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	extsort_run_add(s, fd, count);
+	return 0;
+}
+
+/**
+ * Merge @a count runs starting from @a runs into @a fd in the
+ * given format. The merged runs are closed.
+ */
+static int
+extsort_merge_runs(struct extsort_run *runs, int count, size_t buffer_size,
+		   int fd, enum run_format format)
+{
+	struct runfile_reader *readers = malloc(count * sizeof(*readers));
+	struct kmerge_source *sources = malloc(count * sizeof(*sources));
+	int rc = 0;
+	int opened = 0;
+	for (; opened < count; ++opened) {
+		if (runfile_reader_open(&readers[opened], runs[opened].fd) != 0) {
+			rc = -1;
+			break;
+		}
+		runfile_reader_source(&readers[opened], &sources[opened]);
+	}
+	if (rc == 0) {
+		struct kmerge merge;
+		kmerge_create(&merge, sources, count);
+		struct run_output output;
+		run_output_create(&output, fd, format, buffer_size);
+		int value;
+		while (kmerge_next(&merge, &value)) {
+			run_output_put(&output, value);
+		}
+		rc = run_output_destroy(&output);
+		kmerge_destroy(&merge);
+	}
+	for (int i = 0; i < opened; ++i) {
+		if (readers[i].is_error && rc == 0) {
+			errno = EIO;
+			rc = -1;
+		}
+		runfile_reader_destroy(&readers[i]);
+	}
+	for (int i = 0; i < count; ++i)
+		close(runs[i].fd);
+	free(sources);
+	free(readers);
+	return rc;
+}
+
+/**
+ * Size of each of @a count + 1 buffers of a merge, bytes. At least
+ * EXTSORT_BUFFER_MIN, even if the memory limit is exceeded then:
+ * smaller buffers make the merge a storm of tiny reads and writes.
+ */
+static size_t
+extsort_buffer_size(struct extsort *s, int count)
+{
+	size_t size = s->mem_limit / (count + 1);
+	if (size < EXTSORT_BUFFER_MIN)
+		size = EXTSORT_BUFFER_MIN;
+	return size / sizeof(int) * sizeof(int);
+}
+
+int
+extsort_merge(struct extsort *s, int fd, enum run_format format)
+{
+	/* One buffer per merged run and one for the output. */
+	long fan_in = s->mem_limit / EXTSORT_BUFFER_MIN - 1;
+	if (fan_in < 2)
+		fan_in = 2;
+	if (fan_in > EXTSORT_FAN_IN_MAX)
+		fan_in = EXTSORT_FAN_IN_MAX;
+
+	/*
+	 * The runs are a queue: each intermediate pass takes fan_in
+	 * runs from the head and appends the result to the tail.
+	 */
+	int head = 0;
+	int rc = 0;
+	while (rc == 0 && s->run_count - head > fan_in) {
+		size_t buffer_size = extsort_buffer_size(s, fan_in);
+		int out = extsort_run_open(s);
+		if (out < 0) {
+			rc = -1;
+			break;
+		}
+		size_t total = 0;
+		for (int i = head; i < head + fan_in; ++i)
+			total += s->runs[i].count;
+		rc = extsort_merge_runs(s->runs + head, fan_in, buffer_size,
+					out, RUN_FORMAT_BINARY);
+		if (rc != 0) {
+			int err = errno;
+			close(out);
+			errno = err;
+		} else {
+			/* Only an intermediate result is a run, not @a fd. */
+			extsort_run_add(s, out, total);
+		}
+		head += fan_in;
+		++s->merge_count;
+	}
+	if (rc == 0) {
+		int count = s->run_count - head;
+		size_t buffer_size = extsort_buffer_size(s, count);
+		rc = extsort_merge_runs(s->runs + head, count, buffer_size,
+					fd, format);
+		head += count;
+		++s->merge_count;
+	}
+	/* Drop the consumed runs, the descriptors are closed. */
+	memmove(s->runs, s->runs + head,
+		(s->run_count - head) * sizeof(s->runs[0]));
+	s->run_count -= head;
+	return rc;
+}
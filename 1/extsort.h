@@ -0,0 +1,75 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include "runfile.h"
+
+enum {
+	/** Smallest memory share of a run in a merge, bytes. */
+	EXTSORT_BUFFER_MIN = 64 * 1024,
+	/** Most runs merged at once. */
+	EXTSORT_FAN_IN_MAX = 1024,
+};
+
+/**
+ * A sorted run spilled to a temporary file. The file is a run
+ * file with plain blocks, merged via mmap() without copying. It is
+ * unlinked right after creation, so it is gone with the descriptor.
+ */
+struct extsort_run {
+	int fd;
+	/** Number of integers in the run. */
+	size_t count;
+};
+
+/**
+ * External sort. Sorted runs of a bounded size are spilled to
+ * temporary files, possibly from many threads, then all of them
+ * are merged to the output in one or more passes. Each pass keeps
+ * in memory only the current block of each merged run and one
+ * output buffer, so the merge fits into the memory limit
+ * regardless of the data size. Though no buffer is smaller than
+ * EXTSORT_BUFFER_MIN, so a limit under 3 of them is exceeded.
+ */
+struct extsort {
+	/** Directory for the temporary files. */
+	char *dir;
+	/** Memory of the merge for all its buffers, bytes. */
+	size_t mem_limit;
+	/** Protects the run list from concurrent spills. */
+	pthread_mutex_t lock;
+	struct extsort_run *runs;
+	int run_count;
+	int run_capacity;
+	/** Merges made, including the final one. */
+	int merge_count;
+};
+
+/**
+ * Create an external sort. The temporary files are created in
+ * $TMPDIR, or /tmp if it is not set.
+ */
+void
+extsort_create(struct extsort *s, size_t mem_limit);
+
+/** Close all the remaining runs and free the memory. */
+void
+extsort_destroy(struct extsort *s);
+
+/**
+ * Write sorted @a data as a new run. Thread-safe.
+ * @retval 0 Success.
+ * @retval -1 File error, errno is set.
+ */
+int
+extsort_spill(struct extsort *s, const int *data, size_t count);
+
+/**
+ * Merge all the runs into @a fd in the given format. While there
+ * are more runs than can be merged at once, groups of them are
+ * merged into new runs first. The runs are consumed.
+ * @retval 0 Success.
+ * @retval -1 File error, errno is set.
+ */
+int
+extsort_merge(struct extsort *s, int fd, enum run_format format);
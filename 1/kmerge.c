@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include "kmerge.h"
+
+void
+kmerge_create(struct kmerge *m, struct kmerge_source *sources, int k)
+{
+	m->k = k;
+	m->sources = sources;
+	/* An empty merge has one exhausted fake source. */
+	int size = k > 0 ? k : 1;
+	m->tree = malloc(size * sizeof(m->tree[0]));
+	m->keys = malloc(size * sizeof(m->keys[0]));
+	m->tree[0] = 0;
+	m->keys[0] = INT64_MAX;
+	if (k == 0)
+		return;
+	for (int i = 0; i < k; ++i)
+		m->keys[i] = kmerge_source_advance(&sources[i]);
+	/*
+	 * Play the matches bottom-up. Nodes are numbered from 1,
+	 * leaves are k..2k-1 standing for the sources 0..k-1.
+	 */
+	int *winners = malloc(2 * k * sizeof(int));
+	for (int i = 0; i < k; ++i)
+		winners[k + i] = i;
+	for (int node = k - 1; node > 0; --node) {
+		int a = winners[2 * node];
+		int b = winners[2 * node + 1];
+		bool a_wins = m->keys[a] < m->keys[b] ||
+			      (m->keys[a] == m->keys[b] && a < b);
+		winners[node] = a_wins ? a : b;
+		m->tree[node] = a_wins ? b : a;
+	}
+	m->tree[0] = winners[1];
+	free(winners);
+}
+
+void
+kmerge_destroy(struct kmerge *m)
+{
+	free(m->tree);
+	free(m->keys);
+}
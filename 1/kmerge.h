@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** A sorted sequence of integers, one input of a k-way merge. */
+struct kmerge_source {
+	/** Next element. */
+	const int *pos;
+	/** End of the elements available now. */
+	const int *end;
+	/**
+	 * Called when the available elements are over, to get the
+	 * next portion into pos and end. Returns false when the
+	 * sequence is over. NULL if there is nothing to refill.
+	 */
+	bool (*refill)(struct kmerge_source *src);
+	/** Anything for the refill callback. */
+	void *ctx;
+};
+
+/**
+ * K-way merge on a tournament tree of losers. Each internal node
+ * keeps the source which lost the match there, the overall winner
+ * is kept aside. Taking the next element replays only the matches
+ * on the path from the winner's leaf to the root: log2(k)
+ * comparisons, without scanning all the sources.
+ */
+struct kmerge {
+	int k;
+	/** Loser source indexes, tree[0] is the winner. */
+	int *tree;
+	/** Current element of each source, INT64_MAX if over. */
+	int64_t *keys;
+	struct kmerge_source *sources;
+};
+
+/**
+ * Prepare a merge of @a k sources. The sources are used by the
+ * merge until it is destroyed.
+ */
+void
+kmerge_create(struct kmerge *m, struct kmerge_source *sources, int k);
+
+void
+kmerge_destroy(struct kmerge *m);
+
+/**
+ * Take the least of the next elements of all sources into
+ * @a value. Equal elements are taken in the order of sources.
+ * Returns false when all sources are over.
+ */
+static inline bool
+kmerge_next(struct kmerge *m, int *value);
+
+/** Implementation details. */
+
+/** Move the source to its next element, refill it if needed. */
+static inline int64_t
+kmerge_source_advance(struct kmerge_source *src)
+{
+	while (src->pos == src->end) {
+		if (src->refill == NULL || ! src->refill(src))
+			return INT64_MAX;
+	}
+	return *src->pos++;
+}
+
+static inline bool
+kmerge_next(struct kmerge *m, int *value)
+{
+	int winner = m->tree[0];
+	int64_t key = m->keys[winner];
+	if (key == INT64_MAX)
+		return false;
+	*value = (int)key;
+	key = kmerge_source_advance(&m->sources[winner]);
+	m->keys[winner] = key;
+	for (int node = (winner + m->k) >> 1; node > 0; node >>= 1) {
+		int loser = m->tree[node];
+		int64_t loser_key = m->keys[loser];
+		if (loser_key < key || (loser_key == key && loser < winner)) {
+			m->tree[node] = winner;
+			winner = loser;
+			key = loser_key;
+		}
+	}
+	m->tree[0] = winner;
+	return true;
+}
@@ -1,155 +1,1702 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#endif
 #include "libcoro.h"
 
+/*
+ * Context switch backend, chosen at build time. The default one
+ * is a small hand-written register swap for x86-64 and AArch64:
+ * neither creation nor switch of a coroutine does any syscall.
+ * On other platforms, or when built with -DCORO_BACKEND_SIGNAL,
+ * the portable sigaltstack() + sigsetjmp() backend is used.
+ */
+#if !defined(CORO_BACKEND_ASM) && !defined(CORO_BACKEND_SIGNAL)
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__)
+#define CORO_BACKEND_ASM
+#else
+#define CORO_BACKEND_SIGNAL
+#endif
+#endif
+
+#if defined(CORO_BACKEND_ASM) && \
+    !((defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__))
+#error "CORO_BACKEND_ASM is supported only on x86-64 and AArch64 ELF"
+#endif
+
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
-	int ret;
-	/** Stack, used by the coroutine. */
+	void *result;
+	/** Waiters of coro_join(), protected by coro_join_lock(). */
+	struct coro_joiner *joiners;
+	/**
+	 * Stack, used by the coroutine. It is taken on the first
+	 * switch to the coroutine, and is given back right after
+	 * the coroutine finishes.
+	 */
 	void *stack;
+	/**
+	 * Usable size of the stack, without the guard page. Before
+	 * the start it is the size asked for.
+	 */
+	size_t stack_size;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
 	/** Last remembered coroutine context. */
+#ifdef CORO_BACKEND_ASM
+	void *ctx;
+#else
 	sigjmp_buf ctx;
+#endif
+	/** True, if the coroutine has got its stack and context. */
+	bool is_started;
 	/** True, if the coroutine has finished. */
 	bool is_finished;
+	/**
+	 * Suspension state, enum coro_state. Atomic, because in
+	 * the multi-threaded runtime a coroutine can be woken up
+	 * from another thread while it is still switching out.
+	 */
+	int state;
+	/** True, while the coroutine is parked in the epoll. */
+	bool is_io_waiting;
+	/** True, until the last io_uring request is completed. */
+	bool is_io_pending;
+	/** True, while the coroutine is in the timer wheel. */
+	bool is_sleeping;
+	/** Result of the last asynchronous I/O request. */
+	int io_result;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
-	struct coro *next, *prev;
+	/**
+	 * Clock reading of the last switch to or from the
+	 * coroutine: a slice start while it runs, a start of the
+	 * wait otherwise.
+	 */
+	uint64_t switch_time;
+	/** Time spent running, in clock ticks. */
+	uint64_t cpu_time;
+	/** Time spent not running, in clock ticks. */
+	uint64_t wait_time;
+	/**
+	 * Clock reading of the moment the coroutine became ready
+	 * to run: its switch out, or the wakeup.
+	 */
+	uint64_t ready_time;
+	/** Time spent in the ready queue, in clock ticks. */
+	uint64_t ready_wait_time;
+	/** See coro_stats.slice_hist. 32 bits to keep the coroutine small. */
+	uint32_t slice_hist[CORO_STATS_HIST_SIZE];
+	/** See coro_stats.id. */
+	uint64_t id;
+	/** Time slice, see coro_yield_if_quantum_expired(). */
+	uint64_t quantum;
+	/** Timer wheel tick to wake up at while sleeping. */
+	uint64_t wake_tick;
+	/** Link in a timer wheel slot. */
+	struct coro *timer_next;
+	/** Link in a scheduler queue: ready or finished. */
+	struct coro *next;
+};
+
+enum {
+	/**
+	 * Offset of the argument copy of coro_new_with_arg(), which
+	 * is allocated together with the coroutine.
+	 */
+	CORO_ARG_OFFSET = (sizeof(struct coro) + _Alignof(max_align_t) - 1) /
+			  _Alignof(max_align_t) * _Alignof(max_align_t),
+};
+
+enum coro_state {
+	/** Running or ready to run. */
+	CORO_STATE_RUNNING,
+	/** Running, and the next coro_suspend() returns at once. */
+	CORO_STATE_NOTIFIED,
+	/** Suspended, but its context is not saved yet. */
+	CORO_STATE_PARKING,
+	/** Suspended, waits for coro_wakeup(). */
+	CORO_STATE_SUSPENDED,
+};
+
+/** Stats of finished coroutines, kept for the dump. */
+struct coro_stats_log {
+	struct coro_stats *entries;
+	size_t count;
+	size_t capacity;
+};
+
+/** Last given coroutine id. */
+static uint64_t coro_next_id;
+
+/** A coroutine waiting in coro_join(), lives on its stack. */
+struct coro_joiner {
+	struct coro *coro;
+	struct coro_joiner *next;
+	void *result;
+	bool is_done;
+};
+
+enum {
+	/** Locks of the joiner lists, shared by the coroutines. */
+	CORO_JOIN_LOCK_COUNT = 64,
+};
+
+static pthread_mutex_t coro_join_locks[CORO_JOIN_LOCK_COUNT] = {
+	[0 ... CORO_JOIN_LOCK_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Lock of the joiners and of the finish of @a c. Joins are rare,
+ * so a few locks for all coroutines are enough, and struct coro
+ * stays small.
+ */
+static inline pthread_mutex_t *
+coro_join_lock(const struct coro *c)
+{
+	return &coro_join_locks[(uintptr_t)c / sizeof(*c) %
+				CORO_JOIN_LOCK_COUNT];
+}
+
+/** Intrusive FIFO list of coroutines, linked via coro.next. */
+struct coro_queue {
+	struct coro *first;
+	struct coro *last;
+};
+
+enum {
+	/** Max events fetched by one epoll_wait(). */
+	CORO_IO_EVENT_BATCH = 64,
+	/** Size of the io_uring submission queue. */
+	CORO_URING_ENTRIES = 256,
+	/**
+	 * While there are coroutines waiting for I/O, poll for
+	 * its readiness once per this many coro_yield() calls, so
+	 * busy coroutines don't starve the waiting ones.
+	 */
+	CORO_IO_POLL_INTERVAL = 64,
 };
 
+/** Raw io_uring instance, used for regular files. */
+struct coro_uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *ring;
+	size_t ring_size;
+	size_t sqes_size;
+	/** Requests submitted, but not completed yet. */
+	unsigned inflight;
+};
+
+/**
+ * I/O reactor. Coroutines waiting for a descriptor are parked in
+ * epoll, regular files are read via io_uring, whose descriptor is
+ * itself registered in the epoll. The scheduler sleeps in
+ * epoll_wait() only when no coroutine is runnable.
+ */
+struct coro_reactor {
+	/** Epoll descriptor, -1 if not created yet. */
+	int epoll_fd;
+	/** Coroutines parked in epoll. */
+	unsigned epoll_waiting;
+	/** False, if io_uring is not supported by the kernel. */
+	bool is_uring_available;
+	/** True, if the ring was tried to be created. */
+	bool is_uring_inited;
+	struct coro_uring uring;
+	/** Yields since the last poll, see CORO_IO_POLL_INTERVAL. */
+	unsigned yields_since_poll;
+};
+
+enum {
+	/** Bits of a timer wheel level index. */
+	CORO_WHEEL_BITS = 6,
+	/** Slots in one timer wheel level. */
+	CORO_WHEEL_SLOTS = 1 << CORO_WHEEL_BITS,
+	/**
+	 * Levels of the timer wheel. With 1 microsecond ticks it
+	 * covers 2^36 us, about 19 hours. Longer sleeps are
+	 * re-armed on expiration.
+	 */
+	CORO_WHEEL_LEVELS = 6,
+};
+
+/**
+ * Clock used for the time accounting: the time stamp counter on
+ * x86-64 with invariant TSC, the virtual counter on AArch64, and
+ * CLOCK_MONOTONIC otherwise. Reading it costs no syscall.
+ */
+static struct {
+	/** Nanoseconds per tick, 32.32 fixed point. */
+	uint64_t mult;
+	bool is_counter;
+} coro_clock_cfg;
+
+/**
+ * Hierarchical timer wheel of sleeping coroutines. Level L has
+ * slots of 64^L ticks, a tick is a microsecond. A slot of a level
+ * above 0 is cascaded into the lower levels when its period
+ * starts, level 0 slots expire. Bitmaps of non-empty slots allow
+ * to find the next event without walking empty slots.
+ */
+struct coro_wheel {
+	struct coro *slots[CORO_WHEEL_LEVELS][CORO_WHEEL_SLOTS];
+	uint64_t bitmap[CORO_WHEEL_LEVELS];
+	/** Next tick to process. All previous ones are done. */
+	uint64_t tick;
+	/** Number of coroutines in the wheel. */
+	size_t count;
+};
+
+enum {
+	/** Smallest stack, anything less is rounded up to it. */
+	CORO_STACK_SIZE_MIN = 16 * 1024,
+	/** Number of power-of-two stack size classes. */
+	CORO_STACK_CLASS_COUNT = 48,
+	/** Default limit of cached free stacks. */
+	CORO_STACK_POOL_MAX_DEFAULT = 256,
+	/** Stack of the SIGSEGV handler growing the stacks. */
+	CORO_FAULT_STACK_SIZE = 64 * 1024,
+};
+
+/**
+ * Descriptor of a stack, stored at the top of the stack memory
+ * itself, so caching costs no allocations. The coroutine context
+ * starts below it.
+ */
+struct coro_stack {
+	/** Next free stack in the pool. */
+	struct coro_stack *next;
+	/** Start of the accessible part, see coro_stack_grow(). */
+	char *low;
+};
+
+/**
+ * Pool of mmap()ed coroutine stacks. Each stack is preceded by a
+ * PROT_NONE guard page so an overflow crashes instead of silently
+ * corrupting the neighbour memory. Stacks of deleted coroutines
+ * are kept in free lists, one per power-of-two size class.
+ *
+ * Only the top CORO_STACK_SIZE_INITIAL bytes of a new stack are
+ * accessible, the rest is PROT_NONE and is not charged as memory
+ * in use. A fault below the accessible part, but above the guard,
+ * makes it accessible in the SIGSEGV handler, see
+ * coro_stack_fault(). So the stack size is only a limit, and deep
+ * stacks cost memory only while they are deep.
+ */
+struct coro_stack_pool {
+	/** Free stacks, indexed by log2 of the size. */
+	struct coro_stack *free[CORO_STACK_CLASS_COUNT];
+	/** Max number of cached free stacks. */
+	size_t max_cached;
+	/** Give the memory of cached stacks back to the kernel. */
+	bool release_on_put;
+	struct coro_stack_pool_stats stats;
+};
+
+/** Page size, also the guard size. */
+static size_t coro_page_size;
+
+/**
+ * Scheduler of one thread. Each thread calling coro_sched_init()
+ * gets its own one, and coroutines of different schedulers never
+ * meet, unless they are run by coro_sched_run(). Then the
+ * schedulers become workers of one runtime and steal runnable
+ * coroutines from each other.
+ */
+struct coro_worker {
+	/**
+	 * Scheduler is a main coroutine - it catches and returns
+	 * dead ones to a user.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish.
+	 */
+	bool is_sched_waiting;
+	/** True, if the worker is a part of coro_sched_run(). */
+	bool is_shared;
+	bool is_inited;
+	/**
+	 * Coroutines which can run, in the order they will run.
+	 * Protected by ready_lock while the worker is shared.
+	 */
+	struct coro_queue ready;
+	size_t ready_size;
+	int ready_lock;
+	/** Finished coroutines not yet returned by coro_sched_wait(). */
+	struct coro_queue finished;
+	/** Number of coroutines not yet returned by coro_sched_wait(). */
+	size_t count;
+	/** Number of coroutines not yet finished. */
+	size_t unfinished;
+	/**
+	 * A coroutine which has just switched out and has to be
+	 * put into the ready queue, or marked as suspended. It is
+	 * done by whoever is resumed next, when the context of the
+	 * previous one is saved, so another thread can not resume
+	 * a half-saved coroutine.
+	 */
+	struct coro *pending_ready;
+	struct coro *pending_park;
+	/** A coroutine which has just finished. */
+	struct coro *pending_finish;
+	/**
+	 * A coroutine which is switching out. The switch can push
+	 * onto its stack when this already points at the next one.
+	 */
+	struct coro *switch_from;
+	/** Alternate signal stack for coro_stack_fault(), or NULL. */
+	void *fault_stack;
+	/** Default quantum of new coroutines, in clock ticks. */
+	uint64_t default_quantum;
+	/** Descriptor to dump the stats to, -1 if not collected. */
+	int stats_fd;
+	/** Stats of the finished coroutines, for the dump. */
+	struct coro_stats_log stats_log;
+	/** Random state to pick steal victims. */
+	uint32_t steal_seed;
+	struct coro_reactor io;
+	struct coro_wheel wheel;
+	struct coro_stack_pool stack_pool;
+#ifdef CORO_BACKEND_SIGNAL
+	/**
+	 * Buffer, used by the coroutine constructor to escape from
+	 * the signal handler back into the constructor to rollback
+	 * sigaltstack etc.
+	 */
+	sigjmp_buf start_point;
+#endif
+};
+
+enum {
+	/** Max threads of coro_sched_run(). */
+	CORO_WORKERS_MAX = 256,
+	/** Idle rounds of a worker spinning before it sleeps. */
+	CORO_WORKER_SPIN_COUNT = 64,
+	/** Sleep of an idle worker, and its max I/O poll timeout. */
+	CORO_WORKER_IDLE_NS = 100 * 1000,
+};
+
+/** State of the running coro_sched_run(). */
+static struct {
+	/** Workers, the first one is the caller's scheduler. */
+	struct coro_worker *workers[CORO_WORKERS_MAX];
+	int worker_count;
+	/** Coroutines not finished yet, in all workers. */
+	size_t unfinished;
+	/** Workers meet here before and after the run. */
+	pthread_barrier_t barrier;
+	/** Protects the fields below. */
+	pthread_mutex_t lock;
+	/** Finished coroutines of the worker threads. */
+	struct coro_queue finished;
+	/** Coroutines created in the worker threads. */
+	size_t count;
+	/** Default quantum of the workers, in clock ticks. */
+	uint64_t default_quantum;
+	/** Stats dump descriptor of the workers. */
+	int stats_fd;
+	/** Stack pool configuration of the workers. */
+	size_t stack_max_cached;
+	bool stack_release_on_put;
+	/** Stats of the coroutines finished in the worker threads. */
+	struct coro_stats_log stats_log;
+	/**
+	 * Stack pool stats of the worker threads. Their cached stacks
+	 * are unmapped when the threads end, so cached stays 0.
+	 */
+	struct coro_stack_pool_stats stack_stats;
+} coro_runtime = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** Scheduler of the current thread. */
+static __thread struct coro_worker coro_worker_local;
+
+/**
+ * Get the scheduler of the current thread. Coroutines can move
+ * between threads on any switch, and compilers are allowed to
+ * cache a thread-local address for the whole function. So the
+ * address is taken in a non-inlined function the compiler can't
+ * reason about, and has to be taken again after any switch.
+ */
+static __attribute__((noinline)) struct coro_worker *
+coro_worker(void)
+{
+	struct coro_worker *w = &coro_worker_local;
+	__asm__ volatile("" : "+r"(w));
+	return w;
+}
+
+static void
+coro_io_poll(struct coro_worker *w, int64_t timeout_ns);
+
+#ifdef CORO_BACKEND_ASM
+
+/**
+ * Save callee-saved registers on the current stack, store the
+ * stack pointer into @a from_sp, load @a to_sp and restore the
+ * registers saved there. Returns into the resumed context.
+ */
+void
+coro_ctx_switch(void **from_sp, void *to_sp);
+
+/**
+ * The first return address of a new coroutine. Calls the entry
+ * function, which never returns, with the coroutine argument.
+ * Both are passed in callee-saved registers of the initial frame.
+ */
+void
+coro_ctx_start(void);
+
+#if defined(__x86_64__)
+
+/*
+ * Frame layout, from the saved stack pointer upwards: MXCSR and
+ * x87 control word, r15, r14, r13, r12, rbx, rbp, return address.
+ */
+enum {
+	CORO_CTX_FRAME_SIZE = 8 * 8,
+	CORO_CTX_SLOT_ARG = 4,
+	CORO_CTX_SLOT_ENTRY = 3,
+	CORO_CTX_SLOT_RET = 7,
+};
+
+__asm__(
+	"	.text\n"
+	"	.p2align 4\n"
+	"	.globl coro_ctx_switch\n"
+	"	.hidden coro_ctx_switch\n"
+	"	.type coro_ctx_switch, @function\n"
+	"coro_ctx_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size coro_ctx_switch, .-coro_ctx_switch\n"
+	"	.p2align 4\n"
+	"	.globl coro_ctx_start\n"
+	"	.hidden coro_ctx_start\n"
+	"	.type coro_ctx_start, @function\n"
+	"coro_ctx_start:\n"
+	"	movq %r12, %rdi\n"
+	"	callq *%r13\n"
+	"	ud2\n"
+	"	.size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+#elif defined(__aarch64__)
+
+/*
+ * Frame layout, from the saved stack pointer upwards: d8-d15,
+ * x19-x28, x29 (frame pointer), x30 (return address).
+ */
+enum {
+	CORO_CTX_FRAME_SIZE = 22 * 8,
+	CORO_CTX_SLOT_ARG = 8,
+	CORO_CTX_SLOT_ENTRY = 9,
+	CORO_CTX_SLOT_RET = 19,
+};
+
+__asm__(
+	"	.text\n"
+	"	.p2align 4\n"
+	"	.globl coro_ctx_switch\n"
+	"	.hidden coro_ctx_switch\n"
+	"	.type coro_ctx_switch, %function\n"
+	"coro_ctx_switch:\n"
+	"	sub sp, sp, #176\n"
+	"	stp d8, d9, [sp, #0]\n"
+	"	stp d10, d11, [sp, #16]\n"
+	"	stp d12, d13, [sp, #32]\n"
+	"	stp d14, d15, [sp, #48]\n"
+	"	stp x19, x20, [sp, #64]\n"
+	"	stp x21, x22, [sp, #80]\n"
+	"	stp x23, x24, [sp, #96]\n"
+	"	stp x25, x26, [sp, #112]\n"
+	"	stp x27, x28, [sp, #128]\n"
+	"	stp x29, x30, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp d8, d9, [sp, #0]\n"
+	"	ldp d10, d11, [sp, #16]\n"
+	"	ldp d12, d13, [sp, #32]\n"
+	"	ldp d14, d15, [sp, #48]\n"
+	"	ldp x19, x20, [sp, #64]\n"
+	"	ldp x21, x22, [sp, #80]\n"
+	"	ldp x23, x24, [sp, #96]\n"
+	"	ldp x25, x26, [sp, #112]\n"
+	"	ldp x27, x28, [sp, #128]\n"
+	"	ldp x29, x30, [sp, #144]\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	"	.size coro_ctx_switch, .-coro_ctx_switch\n"
+	"	.p2align 4\n"
+	"	.globl coro_ctx_start\n"
+	"	.hidden coro_ctx_start\n"
+	"	.type coro_ctx_start, %function\n"
+	"coro_ctx_start:\n"
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+	"	.size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+#endif
+
+#else /* CORO_BACKEND_SIGNAL */
+
+/**
+ * Signal disposition and the alternative stack are per-process
+ * and per-thread respectively, so coroutines are created one at
+ * a time even by different workers.
+ */
+static pthread_mutex_t coro_signal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#endif
+
+/** Append a coroutine to the end of a queue. */
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+}
+
+/** Remove and return the first coroutine of a queue, or NULL. */
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c == NULL)
+		return NULL;
+	q->first = c->next;
+	if (q->first == NULL)
+		q->last = NULL;
+	c->next = NULL;
+	return c;
+}
+
+/** Move all coroutines of @a src to the end of @a dst. */
+static inline void
+coro_queue_splice(struct coro_queue *dst, struct coro_queue *src)
+{
+	if (src->first == NULL)
+		return;
+	if (dst->last != NULL)
+		dst->last->next = src->first;
+	else
+		dst->first = src->first;
+	dst->last = src->last;
+	src->first = NULL;
+	src->last = NULL;
+}
+
+/** Hint the CPU that this is a spin-wait loop. */
+static inline void
+coro_cpu_relax(void)
+{
+#if defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+/**
+ * Lock the ready queue of a worker. The critical sections are a
+ * few pointer moves, so a spinlock is cheaper than a mutex.
+ */
+static inline void
+coro_ready_lock(struct coro_worker *w)
+{
+	while (__atomic_exchange_n(&w->ready_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(&w->ready_lock, __ATOMIC_RELAXED) != 0)
+			coro_cpu_relax();
+	}
+}
+
+static inline void
+coro_ready_unlock(struct coro_worker *w)
+{
+	__atomic_store_n(&w->ready_lock, 0, __ATOMIC_RELEASE);
+}
+
+/** Put a coroutine into the ready queue of a worker. */
+static inline void
+coro_ready_push(struct coro_worker *w, struct coro *c)
+{
+	if (! w->is_shared) {
+		coro_queue_push(&w->ready, c);
+		++w->ready_size;
+		return;
+	}
+	coro_ready_lock(w);
+	coro_queue_push(&w->ready, c);
+	__atomic_store_n(&w->ready_size, w->ready_size + 1, __ATOMIC_RELAXED);
+	coro_ready_unlock(w);
+}
+
+/** Take the next coroutine to run from a worker, or NULL. */
+static inline struct coro *
+coro_ready_pop(struct coro_worker *w)
+{
+	struct coro *c;
+	if (! w->is_shared) {
+		c = coro_queue_pop(&w->ready);
+		if (c != NULL)
+			--w->ready_size;
+		return c;
+	}
+	if (__atomic_load_n(&w->ready_size, __ATOMIC_RELAXED) == 0)
+		return NULL;
+	coro_ready_lock(w);
+	c = coro_queue_pop(&w->ready);
+	if (c != NULL)
+		__atomic_store_n(&w->ready_size, w->ready_size - 1,
+				 __ATOMIC_RELAXED);
+	coro_ready_unlock(w);
+	return c;
+}
+
+static inline uint64_t
+coro_clock_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Current time in clock ticks. */
+static inline uint64_t
+coro_clock(void)
+{
+	if (! coro_clock_cfg.is_counter)
+		return coro_clock_monotonic_ns();
+#if defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	return coro_clock_monotonic_ns();
+#endif
+}
+
+static inline uint64_t
+coro_clock_to_ns(uint64_t ticks)
+{
+	return (unsigned __int128)ticks * coro_clock_cfg.mult >> 32;
+}
+
+static inline uint64_t
+coro_clock_from_ns(uint64_t ns)
+{
+	return ((unsigned __int128)ns << 32) / coro_clock_cfg.mult;
+}
+
+/** Pick the clock source and find its frequency. */
+static void
+coro_clock_init(void)
+{
+	coro_clock_cfg.mult = (uint64_t)1 << 32;
+	coro_clock_cfg.is_counter = false;
+#if defined(__x86_64__)
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (edx & (1 << 8)) == 0)
+		return;
+	/*
+	 * The TSC frequency is not exposed to the user space, so
+	 * measure it against CLOCK_MONOTONIC on a short interval.
+	 */
+	uint64_t ns0 = coro_clock_monotonic_ns();
+	uint64_t tsc0 = __builtin_ia32_rdtsc();
+	uint64_t ns1;
+	while ((ns1 = coro_clock_monotonic_ns()) - ns0 < 200000)
+		;
+	uint64_t tsc1 = __builtin_ia32_rdtsc();
+	if (tsc1 <= tsc0)
+		return;
+	coro_clock_cfg.mult = ((unsigned __int128)(ns1 - ns0) << 32) /
+			      (tsc1 - tsc0);
+	coro_clock_cfg.is_counter = coro_clock_cfg.mult != 0;
+	if (! coro_clock_cfg.is_counter)
+		coro_clock_cfg.mult = (uint64_t)1 << 32;
+#elif defined(__aarch64__)
+	uint64_t freq;
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	if (freq == 0)
+		return;
+	coro_clock_cfg.mult = ((uint64_t)1000000000 << 32) / freq;
+	coro_clock_cfg.is_counter = true;
+#endif
+}
+
+static pthread_once_t coro_global_once = PTHREAD_ONCE_INIT;
+
+/** SIGSEGV handler of the process before coro_global_init(). */
+static struct sigaction coro_fault_old;
+
+static void
+coro_stack_fault(int signum, siginfo_t *info, void *ucontext);
+
+/** Process-wide part of the initialization, done once. */
+static void
+coro_global_init(void)
+{
+	coro_page_size = sysconf(_SC_PAGESIZE);
+	coro_clock_init();
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = coro_stack_fault;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGSEGV, &sa, &coro_fault_old) != 0)
+		handle_error();
+}
+
+/**
+ * Current timer wheel tick. Sleeps use CLOCK_MONOTONIC directly:
+ * the calibrated counter is precise enough for accounting, but
+ * could wake sleepers a bit too early on long intervals.
+ */
+static inline uint64_t
+coro_wheel_now(void)
+{
+	return coro_clock_monotonic_ns() / 1000;
+}
+
+/** Put a sleeping coroutine into a slot matching its wake tick. */
+static void
+coro_wheel_insert(struct coro_wheel *wh, struct coro *c)
+{
+	uint64_t tick = c->wake_tick;
+	if (tick < wh->tick)
+		tick = wh->tick;
+	uint64_t delta = tick - wh->tick;
+	int level = 0;
+	while (level < CORO_WHEEL_LEVELS - 1 &&
+	       delta >> (CORO_WHEEL_BITS * (level + 1)) != 0)
+		++level;
+	/* Too far ones are put at the farthest slot and re-armed. */
+	if (delta >> (CORO_WHEEL_BITS * CORO_WHEEL_LEVELS) != 0)
+		tick = wh->tick - 1;
+	int slot = (tick >> (CORO_WHEEL_BITS * level)) &
+		   (CORO_WHEEL_SLOTS - 1);
+	c->timer_next = wh->slots[level][slot];
+	wh->slots[level][slot] = c;
+	wh->bitmap[level] |= (uint64_t)1 << slot;
+}
+
+/**
+ * The nearest tick, not earlier than the current one, when some
+ * slot has to be cascaded or expired. UINT64_MAX if the wheel is
+ * empty.
+ */
+static uint64_t
+coro_wheel_next_tick(const struct coro_wheel *wh)
+{
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < CORO_WHEEL_LEVELS; ++level) {
+		uint64_t bitmap = wh->bitmap[level];
+		if (bitmap == 0)
+			continue;
+		int shift = CORO_WHEEL_BITS * level;
+		/* First period of the level starting not before now. */
+		uint64_t period = (wh->tick +
+				   ((uint64_t)1 << shift) - 1) >> shift;
+		int idx = period & (CORO_WHEEL_SLOTS - 1);
+		uint64_t rotated = idx == 0 ? bitmap :
+				   (bitmap >> idx) | (bitmap << (64 - idx));
+		uint64_t tick = (period + __builtin_ctzll(rotated)) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+static void
+coro_worker_wakeup(struct coro_worker *w, struct coro *c);
+
+/** Wake up all coroutines with wake tick not after @a now. */
+static void
+coro_wheel_advance(struct coro_worker *w, uint64_t now)
+{
+	struct coro_wheel *wh = &w->wheel;
+	uint64_t tick;
+	while ((tick = coro_wheel_next_tick(wh)) <= now) {
+		wh->tick = tick;
+		/* Higher levels first, they refill the lower ones. */
+		for (int level = CORO_WHEEL_LEVELS - 1; level >= 0; --level) {
+			int shift = CORO_WHEEL_BITS * level;
+			if ((tick & (((uint64_t)1 << shift) - 1)) != 0)
+				continue;
+			int slot = (tick >> shift) & (CORO_WHEEL_SLOTS - 1);
+			struct coro *c = wh->slots[level][slot];
+			wh->slots[level][slot] = NULL;
+			wh->bitmap[level] &= ~((uint64_t)1 << slot);
+			while (c != NULL) {
+				struct coro *next = c->timer_next;
+				if (level == 0 && c->wake_tick <= tick) {
+					--wh->count;
+					__atomic_store_n(&c->is_sleeping, false,
+							 __ATOMIC_RELEASE);
+					coro_worker_wakeup(w, c);
+				} else {
+					coro_wheel_insert(wh, c);
+				}
+				c = next;
+			}
+		}
+		wh->tick = tick + 1;
+	}
+	if (wh->tick <= now)
+		wh->tick = now + 1;
+}
+
+/**
+ * Round @a size up to a stack size class. Returns the class
+ * index, the rounded size is stored in @a class_size.
+ */
+static int
+coro_stack_class(size_t size, size_t *class_size)
+{
+	if (size < CORO_STACK_SIZE_MIN)
+		size = CORO_STACK_SIZE_MIN;
+	if (size < (size_t)SIGSTKSZ)
+		size = SIGSTKSZ;
+	int cls = 64 - __builtin_clzll(size - 1);
+	if (cls >= CORO_STACK_CLASS_COUNT) {
+		errno = ENOMEM;
+		handle_error();
+	}
+	*class_size = (size_t)1 << cls;
+	return cls;
+}
+
+/** Free stack descriptor of a stack of size @a size. */
+static inline struct coro_stack *
+coro_stack_desc(void *stack, size_t size)
+{
+	return (struct coro_stack *)((char *)stack + size) - 1;
+}
+
+/**
+ * Forget the sanitizer marks left by frames of a previous stack
+ * owner, which could be at the same address even after unmap.
+ */
+static inline void *
+coro_stack_unpoison(void *stack, size_t size)
+{
+#if defined(__SANITIZE_ADDRESS__)
+	ASAN_UNPOISON_MEMORY_REGION(stack, size);
+#else
+	(void)size;
+#endif
+	return stack;
+}
+
+/** Start of the part of a stack accessible from the beginning. */
+static inline char *
+coro_stack_initial_low(void *stack, size_t size)
+{
+	size_t initial = size < CORO_STACK_SIZE_INITIAL ?
+			 size : CORO_STACK_SIZE_INITIAL;
+	return (char *)stack + size - initial;
+}
+
+/**
+ * Take a stack of at least @a size bytes from the pool or map a
+ * new one. The real size is stored in @a real_size.
+ */
+static void *
+coro_stack_get(struct coro_stack_pool *pool, size_t size, size_t *real_size)
+{
+	int cls = coro_stack_class(size, &size);
+	*real_size = size;
+	struct coro_stack *s = pool->free[cls];
+	if (s != NULL) {
+		pool->free[cls] = s->next;
+		--pool->stats.cached;
+		++pool->stats.hits;
+		return coro_stack_unpoison((char *)(s + 1) - size, size);
+	}
+	++pool->stats.misses;
+	size_t guard = coro_page_size;
+	char *base = mmap(NULL, size + guard, PROT_NONE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		handle_error();
+	char *stack = base + guard;
+	char *low = coro_stack_initial_low(stack, size);
+	if (mprotect(low, stack + size - low, PROT_READ | PROT_WRITE) != 0)
+		handle_error();
+	coro_stack_desc(stack, size)->low = low;
+	return coro_stack_unpoison(stack, size);
+}
+
+/** Unmap a stack together with its guard page. */
+static void
+coro_stack_unmap(void *stack, size_t size)
+{
+	size_t guard = coro_page_size;
+	if (munmap((char *)stack - guard, size + guard) != 0)
+		handle_error();
+}
+
+/** Return a stack to the pool, or unmap it when the pool is full. */
+static void
+coro_stack_put(struct coro_stack_pool *pool, void *stack, size_t size)
+{
+	if (pool->stats.cached >= pool->max_cached) {
+		coro_stack_unmap(stack, size);
+		return;
+	}
+	struct coro_stack *s = coro_stack_desc(stack, size);
+	if (pool->release_on_put) {
+		/* Shrink the stack back, its memory is dropped anyway. */
+		char *low = coro_stack_initial_low(stack, size);
+		if (s->low < low && mprotect(s->low, low - s->low,
+					     PROT_NONE) != 0)
+			handle_error();
+		madvise(low, (char *)stack + size - low, MADV_DONTNEED);
+		s->low = low;
+	}
+	size_t tmp;
+	int cls = coro_stack_class(size, &tmp);
+	s->next = pool->free[cls];
+	pool->free[cls] = s;
+	++pool->stats.cached;
+}
+
+void
+coro_stack_pool_configure(size_t max_cached, bool release_on_put)
+{
+	struct coro_stack_pool *pool = &coro_worker()->stack_pool;
+	pool->max_cached = max_cached;
+	pool->release_on_put = release_on_put;
+	while (pool->stats.cached > max_cached) {
+		for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+			struct coro_stack *s = pool->free[i];
+			if (s == NULL)
+				continue;
+			pool->free[i] = s->next;
+			--pool->stats.cached;
+			size_t size = (size_t)1 << i;
+			coro_stack_unmap((char *)(s + 1) - size, size);
+			break;
+		}
+	}
+}
+
+void
+coro_stack_pool_stats(struct coro_stack_pool_stats *stats)
+{
+	*stats = coro_worker()->stack_pool.stats;
+}
+
+/**
+ * Make the stack of @a c accessible down to @a addr, if it is in
+ * the inaccessible part of it. The accessible part is at least
+ * doubled, so a deep recursion takes a few faults, not one per
+ * page. Is called in a signal handler.
+ */
+static bool
+coro_stack_grow(struct coro *c, char *addr)
+{
+	if (c == NULL || c->stack == NULL)
+		return false;
+	char *stack = c->stack;
+	struct coro_stack *desc = coro_stack_desc(stack, c->stack_size);
+	if (addr < stack || addr >= desc->low)
+		return false;
+	size_t used = stack + c->stack_size - desc->low;
+	char *low = (size_t)(desc->low - stack) > used ? desc->low - used :
+							stack;
+	char *page = (char *)((uintptr_t)addr &
+			      ~(uintptr_t)(coro_page_size - 1));
+	if (page < low)
+		low = page;
+	if (mprotect(low, desc->low - low, PROT_READ | PROT_WRITE) != 0)
+		return false;
+	desc->low = low;
+	return true;
+}
+
+/**
+ * SIGSEGV handler, which runs on the alternate signal stack of
+ * the thread, because the faulting stack has no room. If the
+ * fault is a stack growth of the running coroutine, or of the one
+ * switching out, the stack is grown and the instruction is
+ * retried. Otherwise the old handler is put back, and the retry
+ * crashes as it would without libcoro.
+ */
+static void
+coro_stack_fault(int signum, siginfo_t *info, void *ucontext)
+{
+	(void)signum;
+	(void)ucontext;
+	int saved_errno = errno;
+	struct coro_worker *w = coro_worker();
+	char *addr = info->si_addr;
+	if (coro_stack_grow(w->this, addr) ||
+	    coro_stack_grow(w->switch_from, addr))
+		++w->stack_pool.stats.grows;
+	else
+		sigaction(SIGSEGV, &coro_fault_old, NULL);
+	errno = saved_errno;
+}
+
+/** Give the thread a signal stack for coro_stack_fault(). */
+static void
+coro_fault_stack_create(struct coro_worker *w)
+{
+	stack_t st;
+	/* The thread may have one already. */
+	if (w->fault_stack != NULL ||
+	    (sigaltstack(NULL, &st) == 0 && (st.ss_flags & SS_DISABLE) == 0))
+		return;
+	void *stack = mmap(NULL, CORO_FAULT_STACK_SIZE,
+			   PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (stack == MAP_FAILED)
+		handle_error();
+	st.ss_sp = stack;
+	st.ss_size = CORO_FAULT_STACK_SIZE;
+	st.ss_flags = 0;
+	if (sigaltstack(&st, NULL) != 0)
+		handle_error();
+	w->fault_stack = stack;
+}
+
+static void
+coro_fault_stack_destroy(struct coro_worker *w)
+{
+	if (w->fault_stack == NULL)
+		return;
+	stack_t st;
+	memset(&st, 0, sizeof(st));
+	st.ss_flags = SS_DISABLE;
+	if (sigaltstack(&st, NULL) != 0 ||
+	    munmap(w->fault_stack, CORO_FAULT_STACK_SIZE) != 0)
+		handle_error();
+	w->fault_stack = NULL;
+}
+
+void *
+coro_result(const struct coro *c)
+{
+	return c->result;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->is_finished;
+}
+
+void
+coro_delete(struct coro *c)
+{
+	if (c->stack != NULL)
+		coro_stack_put(&coro_worker()->stack_pool, c->stack,
+			       c->stack_size);
+	free(c);
+}
+
+/**
+ * Remember the current context in @a from and continue @a to
+ * from where it has stopped.
+ */
+static inline void
+coro_ctx_swap(struct coro *from, struct coro *to)
+{
+#ifdef CORO_BACKEND_ASM
+	coro_ctx_switch(&from->ctx, to->ctx);
+#else
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+#endif
+}
+
+/** Histogram bucket of a time slice of @a ticks. */
+static inline int
+coro_stats_bucket(uint64_t ticks)
+{
+	int bucket = 63 - __builtin_clzll(coro_clock_to_ns(ticks) | 1);
+	return bucket < CORO_STATS_HIST_SIZE ? bucket :
+	       CORO_STATS_HIST_SIZE - 1;
+}
+
+/**
+ * Account the time of a switch from @a from to @a to. One clock
+ * read per switch, the rest is a few additions.
+ */
+static inline void
+coro_account_switch(struct coro *from, struct coro *to)
+{
+	uint64_t now = coro_clock();
+	uint64_t slice = now - from->switch_time;
+	from->cpu_time += slice;
+	++from->slice_hist[coro_stats_bucket(slice)];
+	from->switch_time = now;
+	from->ready_time = now;
+	to->wait_time += now - to->switch_time;
+	to->ready_wait_time += now - to->ready_time;
+	to->switch_time = now;
+}
+
+static void
+coro_stats_log_push(struct coro_stats_log *log,
+		    const struct coro_stats *stats)
+{
+	if (log->count == log->capacity) {
+		log->capacity = log->capacity == 0 ? 64 : log->capacity * 2;
+		log->entries = realloc(log->entries,
+				       log->capacity * sizeof(log->entries[0]));
+		if (log->entries == NULL)
+			handle_error();
+	}
+	log->entries[log->count++] = *stats;
+}
+
+static void
+coro_stats_log_add(struct coro_stats_log *log, const struct coro *c)
+{
+	struct coro_stats stats;
+	coro_stats(c, &stats);
+	coro_stats_log_push(log, &stats);
+}
+
+/** Move all entries of @a src to the end of @a dst. */
+static void
+coro_stats_log_splice(struct coro_stats_log *dst, struct coro_stats_log *src)
+{
+	for (size_t i = 0; i < src->count; ++i)
+		coro_stats_log_push(dst, &src->entries[i]);
+	free(src->entries);
+	memset(src, 0, sizeof(*src));
+}
+
+/**
+ * Finish a switch on the side of the resumed coroutine. The
+ * previous one has its context saved now, so it is safe to let
+ * other workers see it.
+ */
+static inline void
+coro_worker_after_switch(struct coro_worker *w)
+{
+	w->switch_from = NULL;
+	struct coro *c = w->pending_ready;
+	if (c != NULL) {
+		w->pending_ready = NULL;
+		coro_ready_push(w, c);
+	}
+	c = w->pending_park;
+	if (c != NULL) {
+		w->pending_park = NULL;
+		int state = CORO_STATE_PARKING;
+		/* Woken up while switching out - run it again. */
+		if (! __atomic_compare_exchange_n(&c->state, &state,
+						  CORO_STATE_SUSPENDED, false,
+						  __ATOMIC_ACQ_REL,
+						  __ATOMIC_ACQUIRE))
+			coro_ready_push(w, c);
+	}
+	c = w->pending_finish;
+	if (c != NULL) {
+		w->pending_finish = NULL;
+		/* Nothing runs on the stack anymore. */
+		coro_stack_put(&w->stack_pool, c->stack, c->stack_size);
+		c->stack = NULL;
+		if (w->stats_fd >= 0)
+			coro_stats_log_add(&w->stats_log, c);
+		coro_queue_push(&w->finished, c);
+		if (w->is_shared)
+			__atomic_sub_fetch(&coro_runtime.unfinished, 1,
+					   __ATOMIC_RELEASE);
+		else
+			--w->unfinished;
+	}
+}
+
+static void
+coro_start(struct coro_worker *w, struct coro *c);
+
+/** Switch the current coroutine to an arbitrary one. */
+static void
+coro_yield_to(struct coro_worker *w, struct coro *to)
+{
+	struct coro *from = w->this;
+	if (! to->is_started)
+		coro_start(w, to);
+	++from->switch_count;
+	coro_account_switch(from, to);
+	w->switch_from = from;
+	w->this = to;
+	coro_ctx_swap(from, to);
+	/* Could be resumed by another thread. */
+	coro_worker_after_switch(coro_worker());
+}
+
+void
+coro_yield(void)
+{
+	struct coro_worker *w = coro_worker();
+	struct coro *from = w->this;
+	struct coro_reactor *io = &w->io;
+	/*
+	 * The scheduler is not a part of the ready queue, it
+	 * gets control back only when a coroutine finishes.
+	 */
+	if (io->epoll_waiting + io->uring.inflight > 0 &&
+	    ++io->yields_since_poll >= CORO_IO_POLL_INTERVAL) {
+		io->yields_since_poll = 0;
+		coro_io_poll(w, 0);
+	}
+	if (w->wheel.count > 0)
+		coro_wheel_advance(w, coro_wheel_now());
+	if (from == &w->sched)
+		return;
+	struct coro *next = coro_ready_pop(w);
+	if (next == NULL)
+		return;
+	w->pending_ready = from;
+	coro_yield_to(w, next);
+}
+
+void
+coro_sched_init(void)
+{
+	pthread_once(&coro_global_once, coro_global_init);
+	struct coro_worker *w = coro_worker();
+	if (! w->is_inited) {
+		w->is_inited = true;
+		w->io.epoll_fd = -1;
+		w->io.uring.fd = -1;
+		w->stack_pool.max_cached = CORO_STACK_POOL_MAX_DEFAULT;
+		w->stats_fd = -1;
+	}
+	coro_fault_stack_create(w);
+	memset(&w->sched, 0, sizeof(w->sched));
+	w->sched.is_started = true;
+	memset(&w->ready, 0, sizeof(w->ready));
+	w->ready_size = 0;
+	memset(&w->finished, 0, sizeof(w->finished));
+	w->count = 0;
+	w->unfinished = 0;
+	w->default_quantum = 0;
+	memset(&w->wheel, 0, sizeof(w->wheel));
+	w->sched.switch_time = coro_clock();
+	w->wheel.tick = coro_wheel_now();
+	w->this = &w->sched;
+}
+
+void
+coro_sched_set_quantum(uint64_t usec)
+{
+	coro_worker()->default_quantum = coro_clock_from_ns(usec * 1000);
+}
+
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
- */
-static struct coro coro_sched;
-/**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
- */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
-/**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Run the next ready coroutine until it switches back to the
+ * scheduler, or wait for I/O and timers if nothing is ready.
  */
-static sigjmp_buf start_point;
-
-/** Add a new coroutine to the beginning of the list. */
 static void
-coro_list_add(struct coro *c)
+coro_sched_step(struct coro_worker *w)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	struct coro *next = coro_ready_pop(w);
+	if (next == NULL) {
+		if (w->io.epoll_waiting + w->io.uring.inflight +
+		    w->wheel.count == 0) {
+			printf("Critical error - all coroutines are "
+			       "suspended forever!\n");
+			exit(-1);
+		}
+		int64_t timeout = -1;
+		if (w->wheel.count > 0) {
+			uint64_t now = coro_wheel_now();
+			uint64_t wake = coro_wheel_next_tick(&w->wheel);
+			timeout = wake > now ? (wake - now) * 1000 : 0;
+		}
+		coro_io_poll(w, timeout);
+		if (w->wheel.count > 0)
+			coro_wheel_advance(w, coro_wheel_now());
+		return;
+	}
+	bool is_sched_waiting = w->is_sched_waiting;
+	w->is_sched_waiting = true;
+	coro_yield_to(w, next);
+	w->is_sched_waiting = is_sched_waiting;
 }
 
-/** Remove a coroutine from the list. */
-static void
-coro_list_delete(struct coro *c)
+struct coro *
+coro_sched_wait(void)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	struct coro_worker *w = coro_worker();
+	while (w->count > 0) {
+		struct coro *c = coro_queue_pop(&w->finished);
+		if (c != NULL) {
+			--w->count;
+			return c;
+		}
+		coro_sched_step(w);
+	}
+	return NULL;
 }
 
-int
-coro_status(const struct coro *c)
+void
+coro_suspend(void)
 {
-	return c->ret;
+	struct coro_worker *w = coro_worker();
+	struct coro *c = w->this;
+	if (c == &w->sched) {
+		/*
+		 * The scheduler can't park. It runs the coroutines
+		 * instead, one of them can be the waker.
+		 */
+		coro_sched_step(w);
+		return;
+	}
+	int state = CORO_STATE_RUNNING;
+	if (! __atomic_compare_exchange_n(&c->state, &state,
+					  CORO_STATE_PARKING, false,
+					  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* A wakeup has come already, consume it. */
+		__atomic_store_n(&c->state, CORO_STATE_RUNNING,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+	struct coro *next = coro_ready_pop(w);
+	w->pending_park = c;
+	coro_yield_to(w, next != NULL ? next : &w->sched);
 }
 
-long long
-coro_switch_count(const struct coro *c)
+void
+coro_sleep(uint64_t usec)
 {
-	return c->switch_count;
+	struct coro_worker *w = coro_worker();
+	struct coro *c = w->this;
+	if (c == &w->sched) {
+		struct timespec ts;
+		ts.tv_sec = usec / 1000000;
+		ts.tv_nsec = usec % 1000000 * 1000;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+		return;
+	}
+	uint64_t now = coro_wheel_now();
+	/* Catch up, the wheel is not advanced while nobody sleeps. */
+	if (w->wheel.count == 0)
+		w->wheel.tick = now;
+	else
+		coro_wheel_advance(w, now);
+	c->wake_tick = now + usec;
+	__atomic_store_n(&c->is_sleeping, true, __ATOMIC_RELAXED);
+	coro_wheel_insert(&w->wheel, c);
+	++w->wheel.count;
+	while (__atomic_load_n(&c->is_sleeping, __ATOMIC_ACQUIRE))
+		coro_suspend();
 }
 
 bool
-coro_is_finished(const struct coro *c)
+coro_yield_if_quantum_expired(void)
 {
-	return c->is_finished;
+	struct coro *c = coro_worker()->this;
+	if (coro_clock() - c->switch_time < c->quantum)
+		return false;
+	coro_yield();
+	return true;
 }
 
 void
-coro_delete(struct coro *c)
+coro_set_quantum(struct coro *c, uint64_t usec)
 {
-	free(c->stack);
-	free(c);
+	c->quantum = coro_clock_from_ns(usec * 1000);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
-static void
-coro_yield_to(struct coro *to)
+uint64_t
+coro_cpu_time(const struct coro *c)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	uint64_t ticks = c->cpu_time;
+	if (c == coro_worker()->this)
+		ticks += coro_clock() - c->switch_time;
+	return coro_clock_to_ns(ticks);
+}
+
+uint64_t
+coro_wait_time(const struct coro *c)
+{
+	uint64_t ticks = c->wait_time;
+	if (c != coro_worker()->this && ! c->is_finished)
+		ticks += coro_clock() - c->switch_time;
+	return coro_clock_to_ns(ticks);
 }
 
 void
-coro_yield(void)
+coro_stats(const struct coro *c, struct coro_stats *stats)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+	stats->id = c->id;
+	stats->run_time = coro_cpu_time(c);
+	stats->wait_time = coro_wait_time(c);
+	stats->ready_time = coro_clock_to_ns(c->ready_wait_time);
+	stats->switch_count = c->switch_count;
+	for (int i = 0; i < CORO_STATS_HIST_SIZE; ++i)
+		stats->slice_hist[i] = c->slice_hist[i];
 }
 
 void
-coro_sched_init(void)
+coro_sched_set_stats_dump(int fd)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	coro_worker()->stats_fd = fd;
 }
 
-struct coro *
-coro_sched_wait(void)
+/** Print the stats log as a table, with a total line. */
+static void
+coro_stats_dump(int fd, const struct coro_stats_log *log)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	struct coro_stats total;
+	memset(&total, 0, sizeof(total));
+	dprintf(fd, "%8s %10s %10s %10s %10s  %s\n", "coro", "run_ms",
+		"ready_ms", "wait_ms", "switches",
+		"slices: log2(ns)=count");
+	for (size_t i = 0; i <= log->count; ++i) {
+		const struct coro_stats *st = &total;
+		if (i < log->count) {
+			st = &log->entries[i];
+			total.run_time += st->run_time;
+			total.ready_time += st->ready_time;
+			total.wait_time += st->wait_time;
+			total.switch_count += st->switch_count;
+			for (int b = 0; b < CORO_STATS_HIST_SIZE; ++b)
+				total.slice_hist[b] += st->slice_hist[b];
+			dprintf(fd, "%8llu", (unsigned long long)st->id);
+		} else {
+			dprintf(fd, "%8s", "total");
+		}
+		dprintf(fd, " %10.3f %10.3f %10.3f %10lld ",
+			st->run_time / 1e6, st->ready_time / 1e6,
+			st->wait_time / 1e6, st->switch_count);
+		for (int b = 0; b < CORO_STATS_HIST_SIZE; ++b) {
+			if (st->slice_hist[b] != 0)
+				dprintf(fd, " %d=%llu", b,
+					(unsigned long long)st->slice_hist[b]);
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+		dprintf(fd, "\n");
 	}
-	return NULL;
+}
+
+/**
+ * Wake up a coroutine, a suspended one is queued into @a w. A
+ * coroutine can be woken up by another thread while it is still
+ * switching out, then the switch puts it back to the ready queue
+ * itself.
+ */
+static void
+coro_worker_wakeup(struct coro_worker *w, struct coro *c)
+{
+	int state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+	int new_state;
+	do {
+		if (state == CORO_STATE_NOTIFIED)
+			return;
+		new_state = state == CORO_STATE_RUNNING ?
+			    CORO_STATE_NOTIFIED : CORO_STATE_RUNNING;
+	} while (! __atomic_compare_exchange_n(&c->state, &state, new_state,
+					       false, __ATOMIC_ACQ_REL,
+					       __ATOMIC_ACQUIRE));
+	if (state == CORO_STATE_SUSPENDED) {
+		c->ready_time = coro_clock();
+		coro_ready_push(w, c);
+	}
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	coro_worker_wakeup(coro_worker(), c);
+}
+
+void *
+coro_join(struct coro *c)
+{
+	pthread_mutex_t *lock = coro_join_lock(c);
+	pthread_mutex_lock(lock);
+	if (c->is_finished) {
+		void *result = c->result;
+		pthread_mutex_unlock(lock);
+		return result;
+	}
+	struct coro_joiner j;
+	j.coro = coro_this();
+	j.next = c->joiners;
+	j.result = NULL;
+	j.is_done = false;
+	c->joiners = &j;
+	/* Suspend returns at once, if woken up after the unlock. */
+	do {
+		pthread_mutex_unlock(lock);
+		coro_suspend();
+		pthread_mutex_lock(lock);
+	} while (! j.is_done);
+	pthread_mutex_unlock(lock);
+	return j.result;
 }
 
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	return coro_worker()->this;
+}
+
+/**
+ * Run the coroutine function and hand the finished coroutine
+ * over to the scheduler. Never returns.
+ */
+static void
+coro_run(struct coro *c)
+{
+	coro_worker_after_switch(coro_worker());
+	void *result = c->func(c->func_arg);
+	/*
+	 * The joiners are woken up under the lock, so they can't
+	 * leave and free their coroutines before the wakeup.
+	 */
+	pthread_mutex_t *lock = coro_join_lock(c);
+	pthread_mutex_lock(lock);
+	c->result = result;
+	c->is_finished = true;
+	for (struct coro_joiner *j = c->joiners; j != NULL; j = j->next) {
+		j->result = result;
+		j->is_done = true;
+		coro_wakeup(j->coro);
+	}
+	c->joiners = NULL;
+	pthread_mutex_unlock(lock);
+	struct coro_worker *w = coro_worker();
+	/* Can not return - 'ret' address is invalid already! */
+	if (! w->is_sched_waiting && ! w->is_shared) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	/*
+	 * The scheduler takes it into the finished queue after the
+	 * switch, when nothing runs on this stack anymore.
+	 */
+	w->pending_finish = c;
+	coro_account_switch(c, &w->sched);
+	w->switch_from = c;
+	w->this = &w->sched;
+	coro_ctx_swap(c, &w->sched);
+	abort();
+}
+
+#ifdef CORO_BACKEND_ASM
+
+/**
+ * Entry of a new coroutine, called by coro_ctx_start on the
+ * coroutine's own stack when it is resumed for the first time.
+ */
+static void
+coro_body(void *arg)
+{
+	coro_run(arg);
+}
+
+/**
+ * Prepare an initial frame on the coroutine stack, which looks
+ * like the coroutine has just called coro_ctx_switch() from
+ * coro_ctx_start. The first switch to it "returns" there.
+ */
+static void
+coro_ctx_create(struct coro *c, size_t stack_size)
+{
+	uintptr_t top = ((uintptr_t)c->stack + stack_size) & ~(uintptr_t)15;
+	void **frame = (void **)(top - CORO_CTX_FRAME_SIZE);
+	memset(frame, 0, CORO_CTX_FRAME_SIZE);
+#if defined(__x86_64__)
+	/* Default MXCSR and x87 control word. */
+	uint32_t *fpu = (uint32_t *)frame;
+	fpu[0] = 0x1F80;
+	fpu[1] = 0x037F;
+#endif
+	frame[CORO_CTX_SLOT_ARG] = c;
+	frame[CORO_CTX_SLOT_ENTRY] = (void *)coro_body;
+	frame[CORO_CTX_SLOT_RET] = (void *)coro_ctx_start;
+	c->ctx = frame;
 }
 
+#else /* CORO_BACKEND_SIGNAL */
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -160,42 +1707,27 @@ static void
 coro_body(int signum)
 {
 	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	struct coro_worker *w = coro_worker();
+	struct coro *c = w->this;
+	w->this = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
 	 */
 	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
+		siglongjmp(w->start_point, 1);
 	/*
 	 * If the execution is here, then the coroutine should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_run(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+static void
+coro_ctx_create(struct coro *c, size_t stack_size)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
+	struct coro_worker *w = coro_worker();
+	pthread_mutex_lock(&coro_signal_lock);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -203,7 +1735,7 @@ coro_new(coro_f func, void *func_arg)
 	sigset_t news, olds, suss;
 	sigemptyset(&news);
 	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+	if (pthread_sigmask(SIG_BLOCK, &news, &olds) != 0)
 		handle_error();
 	/*
 	 * New handler should jump onto a new stack and remember
@@ -224,15 +1756,15 @@ coro_new(coro_f func, void *func_arg)
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	struct coro *old_this = w->this;
+	w->this = c;
 	sigemptyset(&suss);
-	if (sigsetjmp(start_point, 1) == 0) {
+	if (sigsetjmp(w->start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (w->this != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
+	w->this = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -249,10 +1781,625 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
 		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+	if (pthread_sigmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	pthread_mutex_unlock(&coro_signal_lock);
+}
+
+#endif
+
+/**
+ * Give a new coroutine its stack and initial context. It is done
+ * on the first switch to it, so the coroutines waiting for their
+ * turn cost only the struct coro, and the stacks of the finished
+ * ones are reused right away.
+ */
+static void
+coro_start(struct coro_worker *w, struct coro *c)
+{
+	c->stack = coro_stack_get(&w->stack_pool, c->stack_size,
+				  &c->stack_size);
+	/*
+	 * Keep the pool descriptor area free, it is overwritten
+	 * when the stack is returned to the pool.
+	 */
+	coro_ctx_create(c, c->stack_size - sizeof(struct coro_stack));
+	c->is_started = true;
+}
 
+/**
+ * Create a coroutine. With @a arg_size > 0 @a func_arg is copied
+ * into the coroutine, and the function gets the copy.
+ */
+static struct coro *
+coro_create(coro_f func, void *func_arg, size_t stack_size,
+	    size_t arg_size)
+{
+	struct coro_worker *w = coro_worker();
+	struct coro *c = (struct coro *)
+		malloc(arg_size > 0 ? CORO_ARG_OFFSET + arg_size : sizeof(*c));
+	if (c == NULL)
+		handle_error();
+	c->result = NULL;
+	c->joiners = NULL;
+	c->stack = NULL;
+	c->stack_size = stack_size;
+	c->func = func;
+	c->func_arg = func_arg;
+	if (arg_size > 0)
+		c->func_arg = memcpy((char *)c + CORO_ARG_OFFSET, func_arg,
+				     arg_size);
+	c->is_started = false;
+	c->is_finished = false;
+	c->state = CORO_STATE_RUNNING;
+	c->is_io_waiting = false;
+	c->is_io_pending = false;
+	c->is_sleeping = false;
+	c->io_result = 0;
+	c->switch_count = 0;
+	c->switch_time = coro_clock();
+	c->cpu_time = 0;
+	c->wait_time = 0;
+	c->ready_time = c->switch_time;
+	c->ready_wait_time = 0;
+	memset(c->slice_hist, 0, sizeof(c->slice_hist));
+	c->id = __atomic_add_fetch(&coro_next_id, 1, __ATOMIC_RELAXED);
+	c->quantum = w->default_quantum;
+	c->wake_tick = 0;
+	c->timer_next = NULL;
+	++w->count;
+	if (w->is_shared)
+		__atomic_add_fetch(&coro_runtime.unfinished, 1,
+				   __ATOMIC_RELAXED);
+	else
+		++w->unfinished;
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	coro_ready_push(w, c);
 	return c;
 }
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_create(func, func_arg, CORO_STACK_SIZE_DEFAULT, 0);
+}
+
+struct coro *
+coro_new_with_stack(coro_f func, void *func_arg, size_t stack_size)
+{
+	return coro_create(func, func_arg, stack_size, 0);
+}
+
+struct coro *
+coro_new_with_arg(coro_f func, const void *arg, size_t arg_size)
+{
+	return coro_create(func, (void *)arg, CORO_STACK_SIZE_DEFAULT,
+			   arg_size);
+}
+
+/** Create the io_uring instance. Returns -1 if not supported. */
+static int
+coro_uring_create(struct coro_uring *u)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, CORO_URING_ENTRIES, &p);
+	if (u->fd < 0)
+		return -1;
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0)
+		goto error;
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED)
+		goto error;
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		munmap(u->ring, u->ring_size);
+		goto error;
+	}
+	char *ring = u->ring;
+	u->sq_head = (unsigned *)(ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(ring + p.sq_off.array);
+	u->cq_head = (unsigned *)(ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	u->inflight = 0;
+	return 0;
+error:
+	close(u->fd);
+	u->fd = -1;
+	return -1;
+}
+
+static void
+coro_uring_destroy(struct coro_uring *u)
+{
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->ring, u->ring_size);
+	close(u->fd);
+	u->fd = -1;
+}
+
+/** Create the epoll descriptor if it does not exist yet. */
+static void
+coro_io_init_epoll(struct coro_reactor *io)
+{
+	if (io->epoll_fd >= 0)
+		return;
+	io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (io->epoll_fd < 0)
+		handle_error();
+}
+
+/**
+ * Get the io_uring instance, creating it on the first call. NULL
+ * if io_uring can not be used.
+ */
+static struct coro_uring *
+coro_io_uring(struct coro_reactor *io)
+{
+	if (! io->is_uring_inited) {
+		io->is_uring_inited = true;
+		coro_io_init_epoll(io);
+		struct coro_uring *u = &io->uring;
+		if (coro_uring_create(u) == 0) {
+			/*
+			 * The ring descriptor is readable when there
+			 * are completions, so the same epoll_wait()
+			 * sleeps on both sockets and files.
+			 */
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.ptr = u;
+			if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, u->fd,
+				      &ev) != 0)
+				coro_uring_destroy(u);
+			else
+				io->is_uring_available = true;
+		}
+	}
+	if (! io->is_uring_available ||
+	    io->uring.inflight >= CORO_URING_ENTRIES)
+		return NULL;
+	return &io->uring;
+}
+
+/** Wake up the coroutines whose io_uring requests are completed. */
+static void
+coro_uring_reap(struct coro_worker *w, struct coro_uring *u)
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		struct coro *c = (struct coro *)(uintptr_t)cqe->user_data;
+		c->io_result = cqe->res;
+		--u->inflight;
+		__atomic_store_n(&c->is_io_pending, false, __ATOMIC_RELEASE);
+		coro_worker_wakeup(w, c);
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submit one request to the ring and suspend the current
+ * coroutine until it is completed. The request is filled by the
+ * caller in @a sqe. Returns the request result, negative errno on
+ * failure.
+ */
+static int
+coro_uring_call(struct coro_worker *w, struct coro_uring *u,
+		const struct io_uring_sqe *sqe)
+{
+	struct coro *c = w->this;
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	u->sqes[idx] = *sqe;
+	u->sqes[idx].user_data = (uintptr_t)c;
+	u->sq_array[idx] = idx;
+	c->is_io_pending = true;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	/*
+	 * There is no SQPOLL thread, the kernel takes the request only
+	 * inside io_uring_enter(). Until it has, the request is taken
+	 * back on an error. After that its completion will come
+	 * whatever enter() returned, so it has to be waited for.
+	 */
+	while (__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == tail) {
+		if (syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) >= 0 ||
+		    errno == EINTR || errno == EAGAIN)
+			continue;
+		if (__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) != tail)
+			break;
+		int err = errno;
+		__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+		c->is_io_pending = false;
+		return -err;
+	}
+	++u->inflight;
+	/* Only the owner of the ring reaps it, even if we move. */
+	while (__atomic_load_n(&c->is_io_pending, __ATOMIC_ACQUIRE))
+		coro_suspend();
+	return c->io_result;
+}
+
+/**
+ * Wait until @a fd is ready for @a events. Coroutines are parked
+ * in the epoll, the scheduler itself just blocks in poll().
+ */
+static int
+coro_io_wait(struct coro_worker *w, int fd, uint32_t events)
+{
+	struct coro *c = w->this;
+	if (c == &w->sched) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = (events & EPOLLIN ? POLLIN : 0) |
+			     (events & EPOLLOUT ? POLLOUT : 0);
+		while (poll(&pfd, 1, -1) < 0) {
+			if (errno != EINTR)
+				return -1;
+		}
+		return 0;
+	}
+	struct coro_reactor *io = &w->io;
+	coro_io_init_epoll(io);
+	struct epoll_event ev;
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = c;
+	c->is_io_waiting = true;
+	/*
+	 * One-shot registrations stay in the epoll disarmed, so
+	 * the descriptor is usually known already.
+	 */
+	if (epoll_ctl(io->epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+	    (errno != ENOENT ||
+	     epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+		c->is_io_waiting = false;
+		return -1;
+	}
+	++io->epoll_waiting;
+	while (__atomic_load_n(&c->is_io_waiting, __ATOMIC_ACQUIRE))
+		coro_suspend();
+	return 0;
+}
+
+/**
+ * Wake up coroutines whose descriptors are ready or requests are
+ * completed. Sleep at most @a timeout_ns, -1 means infinitely.
+ */
+static void
+coro_io_poll(struct coro_worker *w, int64_t timeout_ns)
+{
+	struct coro_reactor *io = &w->io;
+	if (io->uring.inflight > 0)
+		coro_uring_reap(w, &io->uring);
+	if (__atomic_load_n(&w->ready_size, __ATOMIC_RELAXED) != 0)
+		timeout_ns = 0;
+	if (io->epoll_waiting + io->uring.inflight == 0) {
+		/* Nothing to wait for but timers. */
+		if (timeout_ns > 0) {
+			struct timespec ts;
+			ts.tv_sec = timeout_ns / 1000000000;
+			ts.tv_nsec = timeout_ns % 1000000000;
+			nanosleep(&ts, NULL);
+		}
+		return;
+	}
+	if (io->epoll_waiting == 0 && timeout_ns == 0)
+		return;
+	struct epoll_event events[CORO_IO_EVENT_BATCH];
+	int count;
+#ifdef SYS_epoll_pwait2
+	struct timespec ts;
+	ts.tv_sec = timeout_ns / 1000000000;
+	ts.tv_nsec = timeout_ns % 1000000000;
+	count = syscall(SYS_epoll_pwait2, io->epoll_fd, events,
+			CORO_IO_EVENT_BATCH, timeout_ns < 0 ? NULL : &ts,
+			NULL, 0);
+	if (count < 0 && errno == ENOSYS)
+#endif
+	count = epoll_wait(io->epoll_fd, events, CORO_IO_EVENT_BATCH,
+			   timeout_ns < 0 ? -1 :
+			   (int)((timeout_ns + 999999) / 1000000));
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	for (int i = 0; i < count; ++i) {
+		if (events[i].data.ptr == &io->uring) {
+			coro_uring_reap(w, &io->uring);
+			continue;
+		}
+		struct coro *c = events[i].data.ptr;
+		--io->epoll_waiting;
+		__atomic_store_n(&c->is_io_waiting, false, __ATOMIC_RELEASE);
+		coro_worker_wakeup(w, c);
+	}
+}
+
+int
+coro_open(const char *path, int flags, mode_t mode)
+{
+	struct coro_worker *w = coro_worker();
+	struct coro_uring *u;
+	if (w->this != &w->sched && (u = coro_io_uring(&w->io)) != NULL) {
+		struct io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_OPENAT;
+		sqe.fd = AT_FDCWD;
+		sqe.addr = (uintptr_t)path;
+		sqe.len = mode;
+		sqe.open_flags = flags | O_NONBLOCK;
+		int rc = coro_uring_call(w, u, &sqe);
+		if (rc >= 0)
+			return rc;
+		if (rc != -EINVAL) {
+			errno = -rc;
+			return -1;
+		}
+	}
+	return open(path, flags | O_NONBLOCK, mode);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	while (true) {
+		/*
+		 * RWF_NOWAIT makes even a regular file read fail
+		 * with EAGAIN instead of blocking on the disk.
+		 */
+		struct iovec iov;
+		iov.iov_base = buf;
+		iov.iov_len = size;
+		ssize_t rc = preadv2(fd, &iov, 1, -1, RWF_NOWAIT);
+		if (rc < 0 && errno == EOPNOTSUPP)
+			rc = read(fd, buf, size);
+		if (rc >= 0)
+			return rc;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return -1;
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+			return -1;
+		struct coro_worker *w = coro_worker();
+		if (! S_ISREG(st.st_mode)) {
+			if (coro_io_wait(w, fd, EPOLLIN) != 0)
+				return -1;
+			continue;
+		}
+		struct coro_uring *u;
+		if (w->this == &w->sched || (u = coro_io_uring(&w->io)) == NULL)
+			return read(fd, buf, size);
+		struct io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_READ;
+		sqe.fd = fd;
+		sqe.off = (uint64_t)-1;
+		sqe.addr = (uintptr_t)buf;
+		sqe.len = size;
+		int res = coro_uring_call(w, u, &sqe);
+		if (res >= 0)
+			return res;
+		errno = -res;
+		return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = write(fd, buf, size);
+		if (rc >= 0)
+			return rc;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return -1;
+		if (coro_io_wait(coro_worker(), fd, EPOLLOUT) != 0)
+			return -1;
+	}
+}
+
+/** Next pseudo-random number of a worker, xorshift32. */
+static inline uint32_t
+coro_worker_random(struct coro_worker *w)
+{
+	uint32_t x = w->steal_seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	w->steal_seed = x;
+	return x;
+}
+
+/**
+ * Steal a half of the ready queue of some other worker. Victims
+ * are tried starting from a random one, so the thieves don't
+ * all fight for the same queue. Returns a coroutine to run now,
+ * the rest of the loot is put into the own ready queue.
+ */
+static struct coro *
+coro_worker_steal(struct coro_worker *w)
+{
+	int count = coro_runtime.worker_count;
+	int start = coro_worker_random(w) % count;
+	for (int i = 0; i < count; ++i) {
+		struct coro_worker *v = coro_runtime.workers[(start + i) % count];
+		if (v == w || __atomic_load_n(&v->ready_size,
+					      __ATOMIC_RELAXED) == 0)
+			continue;
+		struct coro_queue loot = {NULL, NULL};
+		coro_ready_lock(v);
+		size_t take = (v->ready_size + 1) / 2;
+		for (size_t j = 0; j < take; ++j)
+			coro_queue_push(&loot, coro_queue_pop(&v->ready));
+		__atomic_store_n(&v->ready_size, v->ready_size - take,
+				 __ATOMIC_RELAXED);
+		coro_ready_unlock(v);
+		struct coro *c = coro_queue_pop(&loot);
+		if (c == NULL)
+			continue;
+		if (take > 1) {
+			coro_ready_lock(w);
+			coro_queue_splice(&w->ready, &loot);
+			__atomic_store_n(&w->ready_size,
+					 w->ready_size + take - 1,
+					 __ATOMIC_RELAXED);
+			coro_ready_unlock(w);
+		}
+		return c;
+	}
+	return NULL;
+}
+
+/**
+ * Scheduler loop of a worker in coro_sched_run(). Runs local
+ * coroutines, steals when out of them, and polls own I/O and
+ * timers when there is nothing to steal either. Returns when all
+ * coroutines of the runtime are finished.
+ */
+static void
+coro_worker_run(struct coro_worker *w, int id)
+{
+	w->is_shared = true;
+	w->steal_seed = (uint32_t)id * 2654435761u + 1;
+	w->default_quantum = coro_runtime.default_quantum;
+	w->stats_fd = coro_runtime.stats_fd;
+	w->stack_pool.max_cached = coro_runtime.stack_max_cached;
+	w->stack_pool.release_on_put = coro_runtime.stack_release_on_put;
+	coro_runtime.workers[id] = w;
+	pthread_barrier_wait(&coro_runtime.barrier);
+	int idle = 0;
+	while (__atomic_load_n(&coro_runtime.unfinished,
+			       __ATOMIC_ACQUIRE) > 0) {
+		struct coro *c = coro_ready_pop(w);
+		if (c == NULL)
+			c = coro_worker_steal(w);
+		if (c != NULL) {
+			idle = 0;
+			coro_yield_to(w, c);
+			continue;
+		}
+		int64_t timeout = 0;
+		if (++idle >= CORO_WORKER_SPIN_COUNT) {
+			timeout = CORO_WORKER_IDLE_NS;
+			if (w->wheel.count > 0) {
+				uint64_t now = coro_wheel_now();
+				uint64_t wake = coro_wheel_next_tick(&w->wheel);
+				uint64_t left = wake > now ?
+						(wake - now) * 1000 : 0;
+				if (left < (uint64_t)timeout)
+					timeout = left;
+			}
+		}
+		if (timeout == 0 &&
+		    w->io.epoll_waiting + w->io.uring.inflight == 0)
+			sched_yield();
+		else
+			coro_io_poll(w, timeout);
+		if (w->wheel.count > 0)
+			coro_wheel_advance(w, coro_wheel_now());
+	}
+	/* Nobody steals from the queues after this. */
+	pthread_barrier_wait(&coro_runtime.barrier);
+	w->is_shared = false;
+}
+
+static void *
+coro_worker_thread(void *arg)
+{
+	coro_sched_init();
+	struct coro_worker *w = coro_worker();
+	coro_worker_run(w, (int)(intptr_t)arg);
+	pthread_mutex_lock(&coro_runtime.lock);
+	coro_queue_splice(&coro_runtime.finished, &w->finished);
+	coro_runtime.count += w->count;
+	coro_stats_log_splice(&coro_runtime.stats_log, &w->stats_log);
+	struct coro_stack_pool_stats *stats = &coro_runtime.stack_stats;
+	stats->hits += w->stack_pool.stats.hits;
+	stats->misses += w->stack_pool.stats.misses;
+	stats->grows += w->stack_pool.stats.grows;
+	pthread_mutex_unlock(&coro_runtime.lock);
+	w->count = 0;
+	coro_sched_destroy();
+	return NULL;
+}
+
+int
+coro_sched_run(int thread_count)
+{
+	struct coro_worker *w = coro_worker();
+	if (thread_count < 1 || thread_count > CORO_WORKERS_MAX ||
+	    w->this != &w->sched) {
+		errno = EINVAL;
+		return -1;
+	}
+	coro_runtime.worker_count = thread_count;
+	coro_runtime.unfinished = w->unfinished;
+	coro_runtime.default_quantum = w->default_quantum;
+	coro_runtime.stats_fd = w->stats_fd;
+	coro_runtime.stack_max_cached = w->stack_pool.max_cached;
+	coro_runtime.stack_release_on_put = w->stack_pool.release_on_put;
+	memset(&coro_runtime.stack_stats, 0,
+	       sizeof(coro_runtime.stack_stats));
+	coro_runtime.count = 0;
+	w->unfinished = 0;
+	if (pthread_barrier_init(&coro_runtime.barrier, NULL,
+				 thread_count) != 0)
+		handle_error();
+	pthread_t threads[CORO_WORKERS_MAX];
+	for (int i = 1; i < thread_count; ++i) {
+		errno = pthread_create(&threads[i], NULL, coro_worker_thread,
+				       (void *)(intptr_t)i);
+		if (errno != 0)
+			handle_error();
+	}
+	coro_worker_run(w, 0);
+	for (int i = 1; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&coro_runtime.barrier);
+	coro_queue_splice(&w->finished, &coro_runtime.finished);
+	w->count += coro_runtime.count;
+	coro_stats_log_splice(&w->stats_log, &coro_runtime.stats_log);
+	w->stack_pool.stats.hits += coro_runtime.stack_stats.hits;
+	w->stack_pool.stats.misses += coro_runtime.stack_stats.misses;
+	w->stack_pool.stats.grows += coro_runtime.stack_stats.grows;
+	coro_runtime.worker_count = 0;
+	return 0;
+}
+
+void
+coro_sched_destroy(void)
+{
+	struct coro_worker *w = coro_worker();
+	struct coro_reactor *io = &w->io;
+	if (io->is_uring_available)
+		coro_uring_destroy(&io->uring);
+	io->is_uring_available = false;
+	io->is_uring_inited = false;
+	if (io->epoll_fd >= 0)
+		close(io->epoll_fd);
+	io->epoll_fd = -1;
+	coro_stack_pool_configure(0, w->stack_pool.release_on_put);
+	w->stack_pool.max_cached = CORO_STACK_POOL_MAX_DEFAULT;
+	if (w->stats_fd >= 0 && w->stats_log.count > 0)
+		coro_stats_dump(w->stats_fd, &w->stats_log);
+	free(w->stats_log.entries);
+	memset(&w->stats_log, 0, sizeof(w->stats_log));
+	coro_fault_stack_destroy(w);
+}
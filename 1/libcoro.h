@@ -1,14 +1,74 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 struct coro;
-typedef int (*coro_f)(void *);
+typedef void *(*coro_f)(void *);
 
-/** Make current context scheduler. */
+enum {
+	/**
+	 * Stack size of coroutines created by coro_new(). It is a
+	 * limit, a stack grows up to it when touched.
+	 */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Part of a stack accessible from the start. */
+	CORO_STACK_SIZE_INITIAL = 16 * 1024,
+	/**
+	 * Buckets of the slice histogram. Bucket i counts the slices
+	 * of [2^i, 2^(i+1)) ns, the last one all the longer ones.
+	 */
+	CORO_STATS_HIST_SIZE = 32,
+};
+
+/** Scheduling statistics of a coroutine, all times in ns. */
+struct coro_stats {
+	/** Unique id, in the order of creation, starting from 1. */
+	uint64_t id;
+	/** Time spent running. */
+	uint64_t run_time;
+	/** Time spent in the ready queue, woken up but not running. */
+	uint64_t ready_time;
+	/** Time spent not running, including ready_time. */
+	uint64_t wait_time;
+	long long switch_count;
+	/** How many times the coroutine ran for each slice length. */
+	uint64_t slice_hist[CORO_STATS_HIST_SIZE];
+};
+
+/**
+ * Make current context scheduler. Each thread has its own one,
+ * coroutines of different threads don't meet unless they are run
+ * by coro_sched_run().
+ */
 void
 coro_sched_init(void);
 
+/**
+ * Set the default time quantum of new coroutines, see
+ * coro_yield_if_quantum_expired(). 0 means no quantum, the
+ * default.
+ */
+void
+coro_sched_set_quantum(uint64_t usec);
+
+/**
+ * Free the scheduler resources: the I/O reactor and the cached
+ * coroutine stacks. All coroutines should be finished and deleted.
+ */
+void
+coro_sched_destroy(void);
+
+/**
+ * Dump the stats of all coroutines finished by the scheduler into
+ * @a fd on coro_sched_destroy(), as a table. -1 turns it off, the
+ * default.
+ */
+void
+coro_sched_set_stats_dump(int fd);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
  * if no coroutines.
@@ -16,32 +76,177 @@ coro_sched_init(void);
 struct coro *
 coro_sched_wait(void);
 
+/**
+ * Run all coroutines of this scheduler to the end on
+ * @a thread_count threads, including the calling one. Each
+ * thread has its own ready queue and steals from the others when
+ * it runs out of work. Coroutines may move between threads on
+ * any switch. Must be called by the scheduler, not by a
+ * coroutine. Afterwards all the coroutines, including the ones
+ * created during the run, are returned by coro_sched_wait()
+ * without blocking.
+ * @retval 0 Success.
+ * @retval -1 Invalid arguments, errno is set.
+ */
+int
+coro_sched_run(int thread_count);
+
 /** Currently working coroutine. */
 struct coro *
 coro_this(void);
 
 /**
  * Create a new coroutine. It is not started, just added to the
- * scheduler.
+ * scheduler. The stack is taken on the first switch to it, and
+ * is given back as soon as it finishes.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
-/** Return status of the coroutine. */
-int
-coro_status(const struct coro *c);
+/**
+ * Same as coro_new(), but with a custom stack size. It is rounded
+ * up to a power of two, at least 16KB.
+ */
+struct coro *
+coro_new_with_stack(coro_f func, void *func_arg, size_t stack_size);
+
+/**
+ * Same as coro_new(), but @a arg_size bytes of @a arg are copied
+ * into the coroutine itself, and the function gets the copy. It
+ * lives until coro_delete(). Saves a separate allocation of the
+ * argument, which also doesn't have to outlive the call.
+ */
+struct coro *
+coro_new_with_arg(coro_f func, const void *arg, size_t arg_size);
+
+/** Value returned by the function of a finished coroutine. */
+void *
+coro_result(const struct coro *c);
+
+/**
+ * Wait until @a c finishes and return its result. Any number of
+ * coroutines can wait for the same one, and the scheduler can too.
+ * The waiters are suspended, not polling. @a c must not be deleted
+ * before the call, it is still returned by coro_sched_wait() and
+ * has to be deleted as usual.
+ */
+void *
+coro_join(struct coro *c);
 
 long long
 coro_switch_count(const struct coro *c);
 
+/** Set the time quantum of a coroutine, in microseconds. */
+void
+coro_set_quantum(struct coro *c, uint64_t usec);
+
+/**
+ * Time the coroutine has been running, in nanoseconds. Accounted
+ * by the scheduler on each switch.
+ */
+uint64_t
+coro_cpu_time(const struct coro *c);
+
+/**
+ * Time the coroutine has spent not running (waiting for its turn,
+ * sleeping, or waiting for I/O), in nanoseconds.
+ */
+uint64_t
+coro_wait_time(const struct coro *c);
+
+/**
+ * Get the stats of the coroutine, finished or not. The stats are
+ * collected for all coroutines, this is only a copy.
+ */
+void
+coro_stats(const struct coro *c, struct coro_stats *stats);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/** Return coroutine stack to the pool and free the coroutine. */
 void
 coro_delete(struct coro *c);
 
 /** Switch to another not finished coroutine. */
 void
 coro_yield(void);
+
+/**
+ * Yield only if the current coroutine has been running for longer
+ * than its quantum since it got the CPU last time. Costs one clock
+ * read otherwise. Returns true, if yielded.
+ */
+bool
+coro_yield_if_quantum_expired(void);
+
+/**
+ * Suspend the current coroutine for at least @a usec
+ * microseconds. Other coroutines keep running meanwhile.
+ */
+void
+coro_sleep(uint64_t usec);
+
+/**
+ * Stop the current coroutine until somebody calls coro_wakeup()
+ * on it. Other coroutines keep running meanwhile. The scheduler
+ * can't be stopped, it runs a ready coroutine and returns.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Make a suspended coroutine runnable again. Can be called from
+ * any thread of coro_sched_run(). If the coroutine is not
+ * suspended, its next coro_suspend() returns immediately.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Coroutine-aware I/O. When the operation would block, the current
+ * coroutine is suspended until the descriptor is ready, and other
+ * coroutines keep working. Regular files, for which readiness has
+ * no meaning, are read via io_uring when the kernel supports it.
+ * The functions have the same semantics as open/read/write, the
+ * descriptors are opened with O_NONBLOCK. Only one coroutine at a
+ * time can wait for a descriptor.
+ */
+int
+coro_open(const char *path, int flags, mode_t mode);
+
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/** Statistics of the coroutine stack pool. */
+struct coro_stack_pool_stats {
+	/** Stacks taken from the pool. */
+	uint64_t hits;
+	/** Stacks which had to be mapped anew. */
+	uint64_t misses;
+	/** Free stacks currently kept in the pool. */
+	uint64_t cached;
+	/** Faults which made stacks grow. */
+	uint64_t grows;
+};
+
+/**
+ * Configure the stack pool. At most @a max_cached free stacks are
+ * kept, extra ones are unmapped right away. If @a release_on_put
+ * is true, memory of the cached stacks is given back to the
+ * kernel via MADV_DONTNEED, only the address range is kept. The
+ * threads of coro_sched_run() get the same configuration.
+ */
+void
+coro_stack_pool_configure(size_t max_cached, bool release_on_put);
+
+/**
+ * Get the stack pool statistics. The ones of the other threads of
+ * coro_sched_run() are added when it returns.
+ */
+void
+coro_stack_pool_stats(struct coro_stack_pool_stats *stats);
@@ -0,0 +1,315 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "numparse.h"
+
+/**
+ * Growable output array. It starts from a guess based on the text
+ * size and doubles when full, so each number is moved at most a
+ * couple of times in total.
+ */
+struct numparse_out {
+	int *data;
+	size_t count;
+	size_t capacity;
+};
+
+static bool
+numparse_out_create(struct numparse_out *out, size_t text_size)
+{
+	out->count = 0;
+	/* "2147483647 " is the longest typical number. */
+	out->capacity = text_size / 11 + 16;
+	out->data = malloc(out->capacity * sizeof(int));
+	return out->data != NULL;
+}
+
+static __attribute__((noinline)) bool
+numparse_out_grow(struct numparse_out *out)
+{
+	size_t capacity = out->capacity * 2;
+	int *data = realloc(out->data, capacity * sizeof(int));
+	if (data == NULL)
+		return false;
+	out->data = data;
+	out->capacity = capacity;
+	return true;
+}
+
+static inline bool
+numparse_out_push(struct numparse_out *out, uint64_t value, bool is_neg)
+{
+	if (out->count == out->capacity && ! numparse_out_grow(out))
+		return false;
+	out->data[out->count++] = (int)(is_neg ? -value : value);
+	return true;
+}
+
+static inline bool
+numparse_is_digit(char c)
+{
+	return (unsigned char)(c - '0') < 10;
+}
+
+/**
+ * Parse the numbers of [@a pos, @a size) one byte at a time. A
+ * number is negative, if it follows a '-', even the one before
+ * @a pos.
+ */
+static bool
+numparse_scalar(const char *text, size_t pos, size_t size,
+		struct numparse_out *out)
+{
+	while (pos < size) {
+		if (! numparse_is_digit(text[pos])) {
+			++pos;
+			continue;
+		}
+		bool is_neg = pos > 0 && text[pos - 1] == '-';
+		uint64_t value = 0;
+		for (; pos < size && numparse_is_digit(text[pos]); ++pos)
+			value = value * 10 + (text[pos] - '0');
+		if (! numparse_out_push(out, value, is_neg))
+			return false;
+	}
+	return true;
+}
+
+#if defined(__x86_64__)
+
+enum {
+	/** Bytes checked for digits at once, bits of a mask. */
+	NUMPARSE_BLOCK = 64,
+	/** Max digits converted with one vector. */
+	NUMPARSE_VECTOR_DIGITS = 16,
+};
+
+#define NUMPARSE_SHUFFLE(len, i) \
+	((i) >= 16 - (len) ? (i) - (16 - (len)) : 0x80)
+#define NUMPARSE_SHUFFLE_ROW(len) { \
+	NUMPARSE_SHUFFLE(len, 0), NUMPARSE_SHUFFLE(len, 1), \
+	NUMPARSE_SHUFFLE(len, 2), NUMPARSE_SHUFFLE(len, 3), \
+	NUMPARSE_SHUFFLE(len, 4), NUMPARSE_SHUFFLE(len, 5), \
+	NUMPARSE_SHUFFLE(len, 6), NUMPARSE_SHUFFLE(len, 7), \
+	NUMPARSE_SHUFFLE(len, 8), NUMPARSE_SHUFFLE(len, 9), \
+	NUMPARSE_SHUFFLE(len, 10), NUMPARSE_SHUFFLE(len, 11), \
+	NUMPARSE_SHUFFLE(len, 12), NUMPARSE_SHUFFLE(len, 13), \
+	NUMPARSE_SHUFFLE(len, 14), NUMPARSE_SHUFFLE(len, 15), \
+}
+
+/**
+ * Shuffles moving the first len digits of a vector to its end and
+ * zeroing the rest, indexed by len.
+ */
+static const uint8_t numparse_align[NUMPARSE_VECTOR_DIGITS + 1][16]
+__attribute__((aligned(16))) = {
+	NUMPARSE_SHUFFLE_ROW(0), NUMPARSE_SHUFFLE_ROW(1),
+	NUMPARSE_SHUFFLE_ROW(2), NUMPARSE_SHUFFLE_ROW(3),
+	NUMPARSE_SHUFFLE_ROW(4), NUMPARSE_SHUFFLE_ROW(5),
+	NUMPARSE_SHUFFLE_ROW(6), NUMPARSE_SHUFFLE_ROW(7),
+	NUMPARSE_SHUFFLE_ROW(8), NUMPARSE_SHUFFLE_ROW(9),
+	NUMPARSE_SHUFFLE_ROW(10), NUMPARSE_SHUFFLE_ROW(11),
+	NUMPARSE_SHUFFLE_ROW(12), NUMPARSE_SHUFFLE_ROW(13),
+	NUMPARSE_SHUFFLE_ROW(14), NUMPARSE_SHUFFLE_ROW(15),
+	NUMPARSE_SHUFFLE_ROW(16),
+};
+
+#undef NUMPARSE_SHUFFLE_ROW
+#undef NUMPARSE_SHUFFLE
+
+/**
+ * Convert @a len <= 16 digits at @a s without a loop: the digits
+ * are right-aligned in a vector, then neighbours are combined
+ * pairwise by multiply-adds: 1 -> 2 -> 4 -> 8 digit values.
+ */
+static inline __attribute__((target("sse4.2"))) uint64_t
+numparse_convert_sse(const char *s, size_t len)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)s);
+	v = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	v = _mm_shuffle_epi8(v, _mm_load_si128(
+		(const __m128i *)numparse_align[len]));
+	v = _mm_maddubs_epi16(v, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1,
+					       10, 1, 10, 1, 10, 1, 10, 1));
+	v = _mm_madd_epi16(v, _mm_setr_epi16(100, 1, 100, 1,
+					     100, 1, 100, 1));
+	v = _mm_packus_epi32(v, v);
+	v = _mm_madd_epi16(v, _mm_setr_epi16(10000, 1, 10000, 1,
+					     10000, 1, 10000, 1));
+	uint64_t hi = (uint32_t)_mm_cvtsi128_si32(v);
+	uint64_t lo = (uint32_t)_mm_extract_epi32(v, 1);
+	return hi * 100000000 + lo;
+}
+
+/** Bit mask of the digits among 64 bytes at @a s, SSE4.2 version. */
+static inline __attribute__((target("sse4.2"))) uint64_t
+numparse_digits_sse(const char *s)
+{
+	const __m128i lo = _mm_set1_epi8('0' - 1);
+	const __m128i hi = _mm_set1_epi8('9' + 1);
+	uint64_t mask = 0;
+	for (int i = 0; i < 4; ++i) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i * 16));
+		__m128i d = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+					  _mm_cmplt_epi8(v, hi));
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(d) << (i * 16);
+	}
+	return mask;
+}
+
+/** Bit mask of the digits among 64 bytes at @a s, AVX2 version. */
+static inline __attribute__((target("avx2"))) uint64_t
+numparse_digits_avx2(const char *s)
+{
+	const __m256i lo = _mm256_set1_epi8('0' - 1);
+	const __m256i hi = _mm256_set1_epi8('9' + 1);
+	__m256i v0 = _mm256_loadu_si256((const __m256i *)s);
+	__m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+	__m256i d0 = _mm256_and_si256(_mm256_cmpgt_epi8(v0, lo),
+				      _mm256_cmpgt_epi8(hi, v0));
+	__m256i d1 = _mm256_and_si256(_mm256_cmpgt_epi8(v1, lo),
+				      _mm256_cmpgt_epi8(hi, v1));
+	return (uint64_t)(uint32_t)_mm256_movemask_epi8(d0) |
+	       (uint64_t)(uint32_t)_mm256_movemask_epi8(d1) << 32;
+}
+
+/**
+ * Vector parser. Digit masks of 64-byte blocks give the number
+ * starts (a digit after a non-digit) and ends without a branch per
+ * byte. Each number is converted by one vector, only the numbers
+ * crossing a block border are measured byte by byte. Inlined into
+ * the callers with a specific instruction set.
+ */
+static inline __attribute__((always_inline)) bool
+numparse_blocks(const char *text, size_t size, struct numparse_out *out,
+		uint64_t (*digits_f)(const char *))
+{
+	/* 1, if the last byte of the previous block is a digit. */
+	uint64_t carry = 0;
+	/* Everything before it is parsed. */
+	size_t done = 0;
+	size_t block = 0;
+	for (; block + NUMPARSE_BLOCK <= size; block += NUMPARSE_BLOCK) {
+		uint64_t digits = digits_f(text + block);
+		uint64_t starts = digits & ~((digits << 1) | carry);
+		carry = digits >> 63;
+		while (starts != 0) {
+			int bit = __builtin_ctzll(starts);
+			starts &= starts - 1;
+			size_t pos = block + bit;
+			uint64_t rest = ~digits >> bit;
+			size_t end;
+			if (rest != 0) {
+				end = pos + __builtin_ctzll(rest);
+			} else {
+				end = block + NUMPARSE_BLOCK;
+				while (end < size && numparse_is_digit(text[end]))
+					++end;
+			}
+			uint64_t value;
+			if (end - pos <= NUMPARSE_VECTOR_DIGITS) {
+				value = numparse_convert_sse(text + pos, end - pos);
+			} else {
+				value = 0;
+				for (size_t i = pos; i < end; ++i)
+					value = value * 10 + (text[i] - '0');
+			}
+			bool is_neg = pos > 0 && text[pos - 1] == '-';
+			if (! numparse_out_push(out, value, is_neg))
+				return false;
+			done = end;
+		}
+	}
+	if (done < block)
+		done = block;
+	return numparse_scalar(text, done, size, out);
+}
+
+static __attribute__((target("sse4.2"))) bool
+numparse_sse(const char *text, size_t size, struct numparse_out *out)
+{
+	return numparse_blocks(text, size, out, numparse_digits_sse);
+}
+
+static __attribute__((target("avx2"))) bool
+numparse_avx2(const char *text, size_t size, struct numparse_out *out)
+{
+	return numparse_blocks(text, size, out, numparse_digits_avx2);
+}
+
+#endif
+
+bool
+numparse_isa_is_supported(enum numparse_isa isa)
+{
+	switch (isa) {
+	case NUMPARSE_ISA_SCALAR:
+		return true;
+#if defined(__x86_64__)
+	case NUMPARSE_ISA_SSE42:
+		return __builtin_cpu_supports("sse4.2");
+	case NUMPARSE_ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+const char *
+numparse_isa_name(enum numparse_isa isa)
+{
+	switch (isa) {
+	case NUMPARSE_ISA_SCALAR:
+		return "scalar";
+	case NUMPARSE_ISA_SSE42:
+		return "sse4.2";
+	case NUMPARSE_ISA_AVX2:
+		return "avx2";
+	default:
+		return "unknown";
+	}
+}
+
+int *
+numparse_with_isa(enum numparse_isa isa, const char *text, size_t size,
+		  size_t *count)
+{
+	struct numparse_out out;
+	if (! numparse_out_create(&out, size))
+		return NULL;
+	bool ok;
+	switch (isa) {
+#if defined(__x86_64__)
+	case NUMPARSE_ISA_SSE42:
+		ok = numparse_sse(text, size, &out);
+		break;
+	case NUMPARSE_ISA_AVX2:
+		ok = numparse_avx2(text, size, &out);
+		break;
+#endif
+	default:
+		ok = numparse_scalar(text, 0, size, &out);
+		break;
+	}
+	if (! ok) {
+		free(out.data);
+		return NULL;
+	}
+	*count = out.count;
+	return out.data;
+}
+
+int *
+numparse(const char *text, size_t size, size_t *count)
+{
+	enum numparse_isa isa = NUMPARSE_ISA_SCALAR;
+	if (numparse_isa_is_supported(NUMPARSE_ISA_AVX2))
+		isa = NUMPARSE_ISA_AVX2;
+	else if (numparse_isa_is_supported(NUMPARSE_ISA_SSE42))
+		isa = NUMPARSE_ISA_SSE42;
+	return numparse_with_isa(isa, text, size, count);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum {
+	/**
+	 * Readable bytes required after the end of a text passed to
+	 * numparse(). Vector loads may run over the end, the extra
+	 * bytes are never interpreted.
+	 */
+	NUMPARSE_PADDING = 64,
+};
+
+/** Instruction set used by the parser. */
+enum numparse_isa {
+	NUMPARSE_ISA_SCALAR,
+	NUMPARSE_ISA_SSE42,
+	NUMPARSE_ISA_AVX2,
+	NUMPARSE_ISA_COUNT,
+};
+
+/**
+ * Parse all decimal integers of @a text in one pass, with the
+ * best instruction set of the CPU. Numbers are separated by any
+ * non-digit characters, a '-' right before a number makes it
+ * negative. Numbers out of the int range are wrapped.
+ * @param text Text of @a size bytes, followed by at least
+ *        NUMPARSE_PADDING readable bytes.
+ * @param[out] count Number of parsed integers.
+ * @retval not NULL A malloc()ed array of the integers.
+ * @retval NULL Memory error.
+ */
+int *
+numparse(const char *text, size_t size, size_t *count);
+
+/** The same as numparse(), but with the given instruction set. */
+int *
+numparse_with_isa(enum numparse_isa isa, const char *text, size_t size,
+		  size_t *count);
+
+/** True, if the CPU supports the instruction set. */
+bool
+numparse_isa_is_supported(enum numparse_isa isa);
+
+/** Name of the instruction set, for logs. */
+const char *
+numparse_isa_name(enum numparse_isa isa);
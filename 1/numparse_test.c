@@ -0,0 +1,222 @@
+#include "numparse.h"
+#include "unit.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Tests of numparse() against strtol(), on each instruction set of
+ * the CPU. The text lies right before an inaccessible page, with
+ * exactly NUMPARSE_PADDING bytes of digits in between, so a read
+ * past the padding crashes and a digit taken from it is caught.
+ */
+
+enum {
+	TEXT_SIZE_MAX = 1024,
+	/* strtol() saturates on longer ones, numparse() wraps. */
+	DIGITS_MAX = 18,
+	FUZZ_ROUNDS = 20000,
+};
+
+static char *page_base;
+static size_t page_area;
+
+static void
+area_create(void)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = TEXT_SIZE_MAX + NUMPARSE_PADDING;
+	page_area = (size + page - 1) / page * page;
+	page_base = mmap(NULL, page_area + page, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	unit_fail_if(page_base == MAP_FAILED);
+	unit_fail_if(mprotect(page_base + page_area, page, PROT_NONE) != 0);
+}
+
+static void
+area_destroy(void)
+{
+	munmap(page_base, page_area + sysconf(_SC_PAGESIZE));
+}
+
+/** The numbers of a NUL-terminated text, by strtol(). */
+static size_t
+parse_strtol(const char *text, int *out)
+{
+	size_t count = 0;
+	const char *p = text;
+	while (*p != 0) {
+		if ((unsigned char)(*p - '0') >= 10) {
+			++p;
+			continue;
+		}
+		const char *start = p > text && p[-1] == '-' ? p - 1 : p;
+		char *end;
+		out[count++] = (int)strtol(start, &end, 10);
+		p = end;
+	}
+	return count;
+}
+
+/**
+ * Parse @a text of @a size bytes by @a isa and by strtol(). Returns
+ * true, if the numbers are the same.
+ */
+static bool
+check_text(enum numparse_isa isa, const char *text, size_t size)
+{
+	char *at = page_base + page_area - NUMPARSE_PADDING - size;
+	memcpy(at, text, size);
+	memset(at + size, '7', NUMPARSE_PADDING);
+
+	static int expected[TEXT_SIZE_MAX];
+	char copy[TEXT_SIZE_MAX + 1];
+	memcpy(copy, text, size);
+	copy[size] = 0;
+	size_t expected_count = parse_strtol(copy, expected);
+
+	size_t count;
+	int *numbers = numparse_with_isa(isa, at, size, &count);
+	unit_fail_if(numbers == NULL);
+	bool ok = count == expected_count &&
+		  memcmp(numbers, expected, count * sizeof(int)) == 0;
+	free(numbers);
+	if (! ok)
+		unit_msg("%s differs on \"%.*s\"", numparse_isa_name(isa),
+			 (int)size, text);
+	return ok;
+}
+
+static uint32_t rand_state = 1;
+
+static uint32_t
+rand_next(void)
+{
+	uint32_t x = rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rand_state = x;
+	return x;
+}
+
+/** Append a number of @a len digits, maybe negative, to @a text. */
+static size_t
+put_number(char *text, size_t size, int len, bool is_neg)
+{
+	if (is_neg)
+		text[size++] = '-';
+	for (int i = 0; i < len; ++i)
+		text[size++] = '0' + rand_next() % 10;
+	return size;
+}
+
+/**
+ * A number of each length from 1 to DIGITS_MAX, with and without a
+ * sign, at each offset around the border of the first two blocks,
+ * with and without a separator after it.
+ */
+static void
+test_block_borders(enum numparse_isa isa)
+{
+	unit_test_start();
+	unit_msg("%s", numparse_isa_name(isa));
+
+	bool ok = true;
+	char text[TEXT_SIZE_MAX];
+	for (int len = 1; len <= DIGITS_MAX; ++len) {
+		for (int offset = 64 - DIGITS_MAX - 2; offset <= 66; ++offset) {
+			for (int flags = 0; flags < 4; ++flags) {
+				size_t size = offset;
+				for (size_t i = 0; i < size; ++i)
+					text[i] = i % 5 == 0 ? '\n' : ' ';
+				size = put_number(text, size, len, flags & 1);
+				if (flags & 2) {
+					text[size++] = '\n';
+					size = put_number(text, size, 3, false);
+				}
+				ok = check_text(isa, text, size) && ok;
+			}
+		}
+	}
+	unit_check(ok, "numbers across the block border");
+
+	unit_test_finish();
+}
+
+/** Signs, separators and the ends of the text. */
+static void
+test_edges(enum numparse_isa isa)
+{
+	unit_test_start();
+	unit_msg("%s", numparse_isa_name(isa));
+
+	static const char *texts[] = {
+		"", "5", "-5", "-", "--5", "5-", "1-2", "a1b-2c", "0 -0 00",
+		"2147483647 -2147483648", "123456789012345678",
+		"-999999999999999999\n", "  \n\n 42", "42  \n\n",
+	};
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i)
+		ok = check_text(isa, texts[i], strlen(texts[i])) && ok;
+	unit_check(ok, "short texts, signs, no trailing newline");
+
+	unit_test_finish();
+}
+
+/**
+ * Random texts: numbers of 1 to DIGITS_MAX digits, separated by
+ * runs of spaces, newlines, letters and minuses. Half of them end
+ * with a number, without a newline.
+ */
+static void
+test_fuzz(enum numparse_isa isa)
+{
+	unit_test_start();
+	unit_msg("%s", numparse_isa_name(isa));
+
+	static const char separators[] = " \n\t-x";
+	char text[TEXT_SIZE_MAX];
+	bool ok = true;
+	for (int round = 0; round < FUZZ_ROUNDS && ok; ++round) {
+		size_t limit = 1 + rand_next() % (TEXT_SIZE_MAX - 64);
+		size_t size = 0;
+		while (size + DIGITS_MAX + 8 < limit) {
+			int seps = rand_next() % 4;
+			for (int i = 0; i < seps; ++i)
+				text[size++] = separators[rand_next() % 5];
+			int len = 1 + rand_next() % DIGITS_MAX;
+			size = put_number(text, size, len, rand_next() % 4 == 0);
+			text[size++] = rand_next() % 3 == 0 ? ' ' : '\n';
+		}
+		if (size > 0 && round % 2 == 0)
+			--size;
+		ok = check_text(isa, text, size);
+	}
+	unit_check(ok, "random texts");
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	area_create();
+	for (int isa = 0; isa < NUMPARSE_ISA_COUNT; ++isa) {
+		if (! numparse_isa_is_supported(isa)) {
+			unit_msg("%s is not supported, skipped",
+				 numparse_isa_name(isa));
+			continue;
+		}
+		test_edges(isa);
+		test_block_borders(isa);
+		test_fuzz(isa);
+	}
+	area_destroy();
+
+	unit_test_finish();
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "numwrite.h"
+
+/** "00" .. "99", to convert two digits at once. */
+static const char numwrite_pairs[201] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+static inline int
+numwrite_digit_count(uint32_t v)
+{
+	int count = 1;
+	for (;;) {
+		if (v < 10)
+			return count;
+		if (v < 100)
+			return count + 1;
+		if (v < 1000)
+			return count + 2;
+		if (v < 10000)
+			return count + 3;
+		v /= 10000;
+		count += 4;
+	}
+}
+
+size_t
+numwrite_format(char *out, int value)
+{
+	char *p = out;
+	uint32_t v = value;
+	if (value < 0) {
+		*p++ = '-';
+		v = -v;
+	}
+	int len = numwrite_digit_count(v);
+	char *end = p + len;
+	char *q = end;
+	while (v >= 100) {
+		uint32_t pair = (v % 100) * 2;
+		v /= 100;
+		q -= 2;
+		memcpy(q, numwrite_pairs + pair, 2);
+	}
+	if (v >= 10) {
+		q -= 2;
+		memcpy(q, numwrite_pairs + v * 2, 2);
+	} else {
+		*--q = '0' + v;
+	}
+	*end = ' ';
+	return end + 1 - out;
+}
+
+void
+numwriter_create(struct numwriter *w, int fd, size_t capacity)
+{
+	if (capacity < NUMWRITE_MAX_LEN)
+		capacity = NUMWRITE_MAX_LEN;
+	w->fd = fd;
+	w->buf = malloc(capacity);
+	w->size = 0;
+	w->capacity = capacity;
+	w->is_ok = true;
+}
+
+int
+numwriter_flush(struct numwriter *w)
+{
+	size_t done = 0;
+	while (w->is_ok && done < w->size) {
+		ssize_t rc = write(w->fd, w->buf + done, w->size - done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			w->is_ok = false;
+			break;
+		}
+		done += rc;
+	}
+	/* After an error the data is dropped, the error is kept. */
+	w->size = 0;
+	return w->is_ok ? 0 : -1;
+}
+
+int
+numwriter_destroy(struct numwriter *w)
+{
+	int rc = numwriter_flush(w);
+	free(w->buf);
+	w->buf = NULL;
+	return rc;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum {
+	/** Default buffer size of a writer. */
+	NUMWRITE_BUFFER_SIZE = 1 << 20,
+	/** Longest formatted int with a separator: "-2147483648 ". */
+	NUMWRITE_MAX_LEN = 12,
+};
+
+/**
+ * Buffered writer of decimal integers. Numbers are formatted
+ * right into a large buffer, which goes to the descriptor with
+ * one write() when full. No stdio and no per-number calls.
+ */
+struct numwriter {
+	int fd;
+	char *buf;
+	size_t size;
+	size_t capacity;
+	/** False after a write error, errno is kept. */
+	bool is_ok;
+};
+
+void
+numwriter_create(struct numwriter *w, int fd, size_t capacity);
+
+/**
+ * Write all buffered data and free the buffer.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int
+numwriter_destroy(struct numwriter *w);
+
+/** Write the buffered data to the descriptor. */
+int
+numwriter_flush(struct numwriter *w);
+
+/** Format @a value into @a out followed by a space. Returns length. */
+size_t
+numwrite_format(char *out, int value);
+
+/** Append @a value and a space, like printf("%d ", value). */
+static inline void
+numwriter_put(struct numwriter *w, int value)
+{
+	if (w->capacity - w->size < NUMWRITE_MAX_LEN)
+		numwriter_flush(w);
+	w->size += numwrite_format(w->buf + w->size, value);
+}
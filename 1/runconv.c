@@ -0,0 +1,131 @@
+/*
+ * Converter between the text and the binary formats of numbers,
+ * so that the binary output of the sorter can be checked by
+ * checker.py, and text inputs can be sorted without parsing:
+ *
+ *     runconv text|binary|delta <in> <out>
+ *
+ * The input format is detected by the file contents.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "numparse.h"
+#include "runfile.h"
+
+/** Read the whole file with NUMPARSE_PADDING spare bytes. */
+static char *
+runconv_read(int fd, size_t *size)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return NULL;
+	size_t capacity = st.st_size > 0 ? st.st_size : 64 * 1024;
+	char *buf = malloc(capacity + NUMPARSE_PADDING);
+	*size = 0;
+	while (true) {
+		if (*size == capacity) {
+			capacity *= 2;
+			buf = realloc(buf, capacity + NUMPARSE_PADDING);
+		}
+		ssize_t rc = read(fd, buf + *size, capacity - *size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return NULL;
+		}
+		if (rc == 0)
+			return buf;
+		*size += rc;
+	}
+}
+
+static int
+runconv_text(int in, struct run_output *out)
+{
+	size_t size;
+	char *text = runconv_read(in, &size);
+	if (text == NULL)
+		return -1;
+	size_t count;
+	int *numbers = numparse(text, size, &count);
+	free(text);
+	if (numbers == NULL)
+		return -1;
+	for (size_t i = 0; i < count; ++i)
+		run_output_put(out, numbers[i]);
+	free(numbers);
+	return 0;
+}
+
+static int
+runconv_binary(int in, struct run_output *out)
+{
+	struct runfile_reader reader;
+	if (runfile_reader_open(&reader, in) != 0)
+		return -1;
+	struct runfile_block block;
+	while (runfile_reader_next(&reader, &block)) {
+		for (size_t i = 0; i < block.count; ++i)
+			run_output_put(out, block.data[i]);
+	}
+	int rc = 0;
+	if (reader.is_error) {
+		errno = EINVAL;
+		rc = -1;
+	}
+	runfile_reader_destroy(&reader);
+	return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+	enum run_format format;
+	if (argc != 4) {
+		goto usage;
+	} else if (strcmp(argv[1], "text") == 0) {
+		format = RUN_FORMAT_TEXT;
+	} else if (strcmp(argv[1], "binary") == 0) {
+		format = RUN_FORMAT_BINARY;
+	} else if (strcmp(argv[1], "delta") == 0) {
+		format = RUN_FORMAT_DELTA;
+	} else {
+		goto usage;
+	}
+	int in = open(argv[2], O_RDONLY);
+	if (in < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	char header[RUNFILE_HEADER_SIZE];
+	ssize_t header_size = pread(in, header, sizeof(header), 0);
+	bool is_binary = header_size > 0 &&
+			 runfile_is_runfile(header, header_size);
+	int out = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		perror(argv[3]);
+		return 1;
+	}
+	struct run_output output;
+	run_output_create(&output, out, format, NUMWRITE_BUFFER_SIZE);
+	int rc = is_binary ? runconv_binary(in, &output) :
+			     runconv_text(in, &output);
+	if (rc != 0)
+		perror(argv[2]);
+	if (run_output_destroy(&output) != 0) {
+		perror(argv[3]);
+		rc = -1;
+	}
+	close(in);
+	close(out);
+	return rc == 0 ? 0 : 1;
+usage:
+	fprintf(stderr, "Usage: %s text|binary|delta <in> <out>\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,445 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "runfile.h"
+#include "kmerge.h"
+
+static const char runfile_magic[4] = {'S', 'R', 'U', 'N'};
+
+/** Longest zigzag varint of a 32 bit number. */
+enum { RUNFILE_VARINT_MAX = 5 };
+
+static inline void
+runfile_store_u16(char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void
+runfile_store_u32(char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = v >> (8 * i);
+}
+
+static inline void
+runfile_store_u64(char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; ++i)
+		p[i] = v >> (8 * i);
+}
+
+static inline uint16_t
+runfile_load_u16(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return u[0] | u[1] << 8;
+}
+
+static inline uint32_t
+runfile_load_u32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static inline uint64_t
+runfile_load_u64(const char *p)
+{
+	return runfile_load_u32(p) | (uint64_t)runfile_load_u32(p + 4) << 32;
+}
+
+static inline size_t
+runfile_align4(size_t size)
+{
+	return (size + 3) & ~(size_t)3;
+}
+
+static inline bool
+runfile_is_little_endian(void)
+{
+	return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+}
+
+static void
+runfile_encode_header(char *p, uint16_t flags, uint32_t block_count,
+		      uint64_t count)
+{
+	memcpy(p, runfile_magic, sizeof(runfile_magic));
+	runfile_store_u16(p + 4, RUNFILE_VERSION);
+	runfile_store_u16(p + 6, flags);
+	runfile_store_u32(p + 8, RUNFILE_BLOCK_SIZE);
+	runfile_store_u32(p + 12, block_count);
+	runfile_store_u64(p + 16, count);
+	runfile_store_u64(p + 24, 0);
+}
+
+/** Bytes of the output buffer enough for any one block. */
+static inline size_t
+runfile_block_max_size(void)
+{
+	return RUNFILE_BLOCK_HEADER_SIZE +
+	       runfile_align4(RUNFILE_BLOCK_SIZE * RUNFILE_VARINT_MAX);
+}
+
+void
+runfile_writer_create(struct runfile_writer *w, int fd, uint16_t flags,
+		      size_t capacity)
+{
+	if (capacity < RUNFILE_HEADER_SIZE + runfile_block_max_size())
+		capacity = RUNFILE_HEADER_SIZE + runfile_block_max_size();
+	w->fd = fd;
+	w->flags = flags;
+	w->start = lseek(fd, 0, SEEK_CUR);
+	w->block = malloc(RUNFILE_BLOCK_SIZE * sizeof(int));
+	w->block_size = 0;
+	w->buf = malloc(capacity);
+	w->capacity = capacity;
+	w->count = 0;
+	w->block_count = 0;
+	w->is_ok = true;
+	/* The counts are not known yet. */
+	runfile_encode_header(w->buf, flags, 0, UINT64_MAX);
+	w->size = RUNFILE_HEADER_SIZE;
+}
+
+static void
+runfile_writer_flush(struct runfile_writer *w)
+{
+	size_t done = 0;
+	while (w->is_ok && done < w->size) {
+		ssize_t rc = write(w->fd, w->buf + done, w->size - done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			w->is_ok = false;
+			break;
+		}
+		done += rc;
+	}
+	w->size = 0;
+}
+
+/** Encode the numbers as zigzag varints of their differences. */
+static size_t
+runfile_encode_delta(char *out, const int *data, int count, int min)
+{
+	unsigned char *p = (unsigned char *)out;
+	uint32_t prev = min;
+	for (int i = 0; i < count; ++i) {
+		int32_t delta = (uint32_t)data[i] - prev;
+		uint32_t zigzag = (uint32_t)delta << 1 ^ (uint32_t)(delta >> 31);
+		prev = data[i];
+		while (zigzag >= 0x80) {
+			*p++ = zigzag | 0x80;
+			zigzag >>= 7;
+		}
+		*p++ = zigzag;
+	}
+	return p - (unsigned char *)out;
+}
+
+void
+runfile_writer_end_block(struct runfile_writer *w)
+{
+	int count = w->block_size;
+	if (count == 0)
+		return;
+	if (w->capacity - w->size < runfile_block_max_size())
+		runfile_writer_flush(w);
+	int min = w->block[0];
+	int max = w->block[0];
+	for (int i = 1; i < count; ++i) {
+		min = w->block[i] < min ? w->block[i] : min;
+		max = w->block[i] > max ? w->block[i] : max;
+	}
+	char *header = w->buf + w->size;
+	char *payload = header + RUNFILE_BLOCK_HEADER_SIZE;
+	size_t size;
+	if (w->flags & RUNFILE_DELTA) {
+		size = runfile_encode_delta(payload, w->block, count, min);
+	} else if (runfile_is_little_endian()) {
+		size = count * sizeof(int);
+		memcpy(payload, w->block, size);
+	} else {
+		size = count * sizeof(int);
+		for (int i = 0; i < count; ++i)
+			runfile_store_u32(payload + 4 * i, w->block[i]);
+	}
+	runfile_store_u32(header, min);
+	runfile_store_u32(header + 4, max);
+	runfile_store_u32(header + 8, count);
+	runfile_store_u32(header + 12, size);
+	memset(payload + size, 0, runfile_align4(size) - size);
+	w->size += RUNFILE_BLOCK_HEADER_SIZE + runfile_align4(size);
+	w->count += count;
+	w->block_count++;
+	w->block_size = 0;
+}
+
+void
+runfile_writer_put_array(struct runfile_writer *w, const int *data,
+			 size_t count)
+{
+	while (count > 0) {
+		size_t n = RUNFILE_BLOCK_SIZE - w->block_size;
+		if (n > count)
+			n = count;
+		memcpy(w->block + w->block_size, data, n * sizeof(int));
+		w->block_size += n;
+		data += n;
+		count -= n;
+		if (w->block_size == RUNFILE_BLOCK_SIZE)
+			runfile_writer_end_block(w);
+	}
+}
+
+int
+runfile_writer_destroy(struct runfile_writer *w)
+{
+	runfile_writer_end_block(w);
+	runfile_writer_flush(w);
+	/* A pipe keeps the counts unknown, the reader does not need them. */
+	if (w->is_ok && w->start >= 0) {
+		char header[RUNFILE_HEADER_SIZE];
+		runfile_encode_header(header, w->flags, w->block_count,
+				      w->count);
+		if (pwrite(w->fd, header, sizeof(header), w->start) !=
+		    (ssize_t)sizeof(header))
+			w->is_ok = false;
+	}
+	free(w->block);
+	free(w->buf);
+	w->block = NULL;
+	w->buf = NULL;
+	return w->is_ok ? 0 : -1;
+}
+
+bool
+runfile_is_runfile(const void *data, size_t size)
+{
+	return size >= RUNFILE_HEADER_SIZE &&
+	       memcmp(data, runfile_magic, sizeof(runfile_magic)) == 0;
+}
+
+int
+runfile_reader_create(struct runfile_reader *r, const void *data,
+		      size_t size)
+{
+	const char *p = data;
+	if (! runfile_is_runfile(data, size) ||
+	    runfile_load_u16(p + 4) != RUNFILE_VERSION ||
+	    runfile_load_u32(p + 8) > RUNFILE_BLOCK_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	r->data = p;
+	r->size = size;
+	r->offset = RUNFILE_HEADER_SIZE;
+	r->flags = runfile_load_u16(p + 6);
+	r->count = runfile_load_u64(p + 16);
+	r->buf = NULL;
+	if ((r->flags & RUNFILE_DELTA) || ! runfile_is_little_endian())
+		r->buf = malloc(RUNFILE_BLOCK_SIZE * sizeof(int));
+	r->is_mapped = false;
+	r->released = 0;
+	r->is_error = false;
+	return 0;
+}
+
+int
+runfile_reader_open(struct runfile_reader *r, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return -1;
+	if ((size_t)st.st_size < RUNFILE_HEADER_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	if (runfile_reader_create(r, data, st.st_size) != 0) {
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+	r->is_mapped = true;
+	return 0;
+}
+
+void
+runfile_reader_destroy(struct runfile_reader *r)
+{
+	if (r->is_mapped)
+		munmap((void *)r->data, r->size);
+	free(r->buf);
+}
+
+/** Decode zigzag varint differences, false on broken data. */
+static bool
+runfile_decode_delta(const char *in, size_t size, int *out, size_t count,
+		     int min)
+{
+	const unsigned char *p = (const unsigned char *)in;
+	const unsigned char *end = p + size;
+	uint32_t prev = min;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t zigzag = 0;
+		for (int shift = 0;; shift += 7) {
+			if (p == end || shift >= 7 * RUNFILE_VARINT_MAX)
+				return false;
+			uint32_t byte = *p++;
+			zigzag |= (byte & 0x7f) << shift;
+			if (byte < 0x80)
+				break;
+		}
+		uint32_t delta = zigzag >> 1 ^ -(zigzag & 1);
+		prev += delta;
+		out[i] = prev;
+	}
+	return p == end;
+}
+
+/** Give the pages of the blocks before @a offset back to the OS. */
+static void
+runfile_reader_release(struct runfile_reader *r, size_t offset)
+{
+	static size_t page_size;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	offset &= ~(page_size - 1);
+	if (offset > r->released) {
+		madvise((char *)r->data + r->released, offset - r->released,
+			MADV_DONTNEED);
+		r->released = offset;
+	}
+}
+
+bool
+runfile_reader_next(struct runfile_reader *r, struct runfile_block *block)
+{
+	if (r->is_error || r->offset == r->size)
+		return false;
+	if (r->is_mapped)
+		runfile_reader_release(r, r->offset);
+	if (r->size - r->offset < RUNFILE_BLOCK_HEADER_SIZE)
+		goto error;
+	const char *header = r->data + r->offset;
+	const char *payload = header + RUNFILE_BLOCK_HEADER_SIZE;
+	uint32_t count = runfile_load_u32(header + 8);
+	uint32_t size = runfile_load_u32(header + 12);
+	size_t left = r->size - r->offset - RUNFILE_BLOCK_HEADER_SIZE;
+	if (count > RUNFILE_BLOCK_SIZE || size > left ||
+	    runfile_align4(size) > left)
+		goto error;
+	block->min = (int)runfile_load_u32(header);
+	block->max = (int)runfile_load_u32(header + 4);
+	block->count = count;
+	if (r->flags & RUNFILE_DELTA) {
+		if (! runfile_decode_delta(payload, size, r->buf, count,
+					   block->min))
+			goto error;
+		block->data = r->buf;
+	} else {
+		if (size != count * sizeof(int))
+			goto error;
+		if (runfile_is_little_endian()) {
+			/* Blocks are 4-aligned, so are the numbers. */
+			block->data = (const int *)payload;
+		} else {
+			for (uint32_t i = 0; i < count; ++i)
+				r->buf[i] = runfile_load_u32(payload + 4 * i);
+			block->data = r->buf;
+		}
+	}
+	r->offset += RUNFILE_BLOCK_HEADER_SIZE + runfile_align4(size);
+	return true;
+error:
+	r->is_error = true;
+	return false;
+}
+
+static bool
+runfile_source_refill(struct kmerge_source *src)
+{
+	struct runfile_block block;
+	if (! runfile_reader_next(src->ctx, &block))
+		return false;
+	src->pos = block.data;
+	src->end = block.data + block.count;
+	return true;
+}
+
+void
+runfile_reader_source(struct runfile_reader *r, struct kmerge_source *src)
+{
+	src->pos = NULL;
+	src->end = NULL;
+	src->refill = runfile_source_refill;
+	src->ctx = r;
+}
+
+int *
+runfile_load(const void *data, size_t size, size_t *count)
+{
+	struct runfile_reader r;
+	if (runfile_reader_create(&r, data, size) != 0)
+		return NULL;
+	/* The count in the header is only a hint, the file can lie. */
+	size_t capacity = RUNFILE_BLOCK_SIZE;
+	if (r.count <= size / 2)
+		capacity = r.count + 1;
+	int *res = malloc(capacity * sizeof(int));
+	size_t n = 0;
+	struct runfile_block block;
+	while (runfile_reader_next(&r, &block)) {
+		if (n + block.count > capacity) {
+			while (n + block.count > capacity)
+				capacity *= 2;
+			res = realloc(res, capacity * sizeof(int));
+		}
+		memcpy(res + n, block.data, block.count * sizeof(int));
+		n += block.count;
+	}
+	bool is_error = r.is_error;
+	runfile_reader_destroy(&r);
+	if (is_error) {
+		free(res);
+		return NULL;
+	}
+	*count = n;
+	return res;
+}
+
+void
+run_output_create(struct run_output *o, int fd, enum run_format format,
+		  size_t capacity)
+{
+	o->format = format;
+	switch (format) {
+	case RUN_FORMAT_BINARY:
+		runfile_writer_create(&o->binary, fd, 0, capacity);
+		break;
+	case RUN_FORMAT_DELTA:
+		runfile_writer_create(&o->binary, fd, RUNFILE_DELTA, capacity);
+		break;
+	default:
+		numwriter_create(&o->text, fd, capacity);
+		break;
+	}
+}
+
+int
+run_output_destroy(struct run_output *o)
+{
+	if (o->format == RUN_FORMAT_TEXT)
+		return numwriter_destroy(&o->text);
+	return runfile_writer_destroy(&o->binary);
+}
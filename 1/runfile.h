@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "numwrite.h"
+
+struct kmerge_source;
+
+/**
+ * Binary file of integers, usually a sorted run. All the fields
+ * are little-endian.
+ *
+ * Header, RUNFILE_HEADER_SIZE bytes:
+ *     char magic[4] = "SRUN";
+ *     uint16 version = 1;
+ *     uint16 flags, RUNFILE_DELTA or 0;
+ *     uint32 block_size, most numbers in a block;
+ *     uint32 block_count;
+ *     uint64 count, of all numbers, UINT64_MAX if unknown;
+ *     uint64 reserved = 0.
+ *
+ * Then block_count blocks, each of RUNFILE_BLOCK_HEADER_SIZE bytes
+ * of a header:
+ *     int32 min, int32 max, of the numbers in the block;
+ *     uint32 count, of the numbers;
+ *     uint32 size, of the payload in bytes;
+ * and a payload padded with zeros up to a multiple of 4 bytes.
+ * Without RUNFILE_DELTA the payload is count int32 numbers, which
+ * can be used right from a mapped file. With it, the payload is
+ * the differences of each number from the previous one, or from
+ * min for the first one, as zigzag varints: 1-2 bytes per number
+ * for dense sorted data instead of 4.
+ */
+enum {
+	RUNFILE_HEADER_SIZE = 32,
+	RUNFILE_BLOCK_HEADER_SIZE = 16,
+	RUNFILE_VERSION = 1,
+	/** Numbers in a block, except the last one. */
+	RUNFILE_BLOCK_SIZE = 4096,
+	/** Payload is delta+varint compressed. */
+	RUNFILE_DELTA = 1 << 0,
+};
+
+/** Format of a sequence of numbers in a file. */
+enum run_format {
+	/** Text like printf("%d ") of each number. */
+	RUN_FORMAT_TEXT,
+	/** Run file with plain int32 blocks. */
+	RUN_FORMAT_BINARY,
+	/** Run file with compressed blocks. */
+	RUN_FORMAT_DELTA,
+};
+
+/** Buffered writer of a run file. */
+struct runfile_writer {
+	int fd;
+	uint16_t flags;
+	/** File offset of the header, it is rewritten in the end. */
+	int64_t start;
+	/** Numbers of the current block. */
+	int *block;
+	int block_size;
+	/** Encoded blocks not written yet. */
+	char *buf;
+	size_t size;
+	size_t capacity;
+	uint64_t count;
+	uint32_t block_count;
+	/** False after a write error, errno is kept. */
+	bool is_ok;
+};
+
+/**
+ * Start a run file at the current offset of @a fd. The header is
+ * updated with the counts in the end, if the file is seekable.
+ * @param flags RUNFILE_DELTA or 0.
+ * @param capacity Output buffer size hint, bytes.
+ */
+void
+runfile_writer_create(struct runfile_writer *w, int fd, uint16_t flags,
+		      size_t capacity);
+
+/**
+ * Write the rest of the data and the final header, free the
+ * buffers.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int
+runfile_writer_destroy(struct runfile_writer *w);
+
+/** Encode the current block into the output buffer. */
+void
+runfile_writer_end_block(struct runfile_writer *w);
+
+static inline void
+runfile_writer_put(struct runfile_writer *w, int value)
+{
+	w->block[w->block_size++] = value;
+	if (w->block_size == RUNFILE_BLOCK_SIZE)
+		runfile_writer_end_block(w);
+}
+
+void
+runfile_writer_put_array(struct runfile_writer *w, const int *data,
+			 size_t count);
+
+/** A block of numbers given by a reader. */
+struct runfile_block {
+	int min;
+	int max;
+	/** Numbers of the block, valid until the next block is read. */
+	const int *data;
+	size_t count;
+};
+
+/** Reader of a run file in memory or in a mapped file. */
+struct runfile_reader {
+	const char *data;
+	size_t size;
+	/** Offset of the next block. */
+	size_t offset;
+	uint16_t flags;
+	/** Count from the header, UINT64_MAX if unknown. */
+	uint64_t count;
+	/** Decoded numbers of the current block, if needed. */
+	int *buf;
+	/** The data is mapped from a file and unmapped in the end. */
+	bool is_mapped;
+	/** Mapped pages before this offset are released. */
+	size_t released;
+	/** The file turned out to be broken. */
+	bool is_error;
+};
+
+/** True, if the data starts like a run file. */
+bool
+runfile_is_runfile(const void *data, size_t size);
+
+/**
+ * Read a run file which is in memory. The memory must live as
+ * long as the reader.
+ * @retval 0 Success.
+ * @retval -1 Not a valid run file.
+ */
+int
+runfile_reader_create(struct runfile_reader *r, const void *data,
+		      size_t size);
+
+/**
+ * Read a run file via mmap(). With plain blocks no data is copied.
+ * Pages of the blocks already read are released, so the memory
+ * use does not grow with the file size. The descriptor can be
+ * closed right after the call.
+ * @retval 0 Success.
+ * @retval -1 Not a valid run file, or mmap error, errno is set.
+ */
+int
+runfile_reader_open(struct runfile_reader *r, int fd);
+
+void
+runfile_reader_destroy(struct runfile_reader *r);
+
+/**
+ * Read the next block.
+ * @retval true The block is in @a block.
+ * @retval false The file is over, or is_error is set.
+ */
+bool
+runfile_reader_next(struct runfile_reader *r, struct runfile_block *block);
+
+/**
+ * Make @a src a k-way merge source reading the blocks of @a r.
+ * The reader must live as long as the source.
+ */
+void
+runfile_reader_source(struct runfile_reader *r, struct kmerge_source *src);
+
+/**
+ * Read all the numbers of a run file in memory into a malloc()ed
+ * array, their number is stored in @a count. NULL on error.
+ */
+int *
+runfile_load(const void *data, size_t size, size_t *count);
+
+/** Writer of numbers in any of the formats. */
+struct run_output {
+	enum run_format format;
+	union {
+		struct numwriter text;
+		struct runfile_writer binary;
+	};
+};
+
+void
+run_output_create(struct run_output *o, int fd, enum run_format format,
+		  size_t capacity);
+
+/**
+ * Flush and free the writer.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int
+run_output_destroy(struct run_output *o);
+
+static inline void
+run_output_put(struct run_output *o, int value)
+{
+	if (o->format == RUN_FORMAT_TEXT)
+		numwriter_put(&o->text, value);
+	else
+		runfile_writer_put(&o->binary, value);
+}
@@ -2,275 +2,1427 @@
 #include <stdlib.h>
 #include <string.h>
 #include "libcoro.h"
+#include "numparse.h"
+#include "kmerge.h"
+#include "numwrite.h"
+#include "extsort.h"
+#include "runfile.h"
+#include "thread_pool.h"
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 
+/** Sort engine, see --algo. */
+enum sort_algo {
+    SORT_MERGE,
+    SORT_RADIX,
+    /** Merge sort for small files, radix sort for the rest. */
+    SORT_HYBRID,
+};
+
+enum {
+    /** Radix digits are 8 bits for arrays less than this. */
+    RADIX_SMALL = 1 << 16,
+    /** Max bits in a radix digit. */
+    RADIX_BITS_MAX = 11,
+    /** Max passes of the radix sort: 32 bits / 8. */
+    RADIX_PASSES_MAX = 4,
+    /** Elements moved by the radix sort between two yields. */
+    RADIX_CHUNK = 1 << 16,
+    /** Elements merged by the merge sort between two yields. */
+    MERGE_CHUNK = 1 << 12,
+    /** Hybrid sort uses merge sort for arrays up to this size. */
+    HYBRID_MERGE_MAX = 1024,
+    /** Text read at once by the external sort, bytes. */
+    EXTERNAL_CHUNK_MIN = 4096,
+    EXTERNAL_CHUNK_MAX = 1 << 20,
+    /** Min numbers in a run of the external sort. */
+    EXTERNAL_RUN_MIN = 1024,
+    /** Elements merged by the pipeline between two yields. */
+    PIPELINE_CHUNK = 1 << 16,
+    /** Least elements merged or formatted by one thread task. */
+    THREAD_CHUNK_MIN = 1 << 16,
+    /** Tasks per thread in a parallel pass, to even the load. */
+    THREAD_CHUNKS_PER_THREAD = 4,
+};
+
+/** A sorted array. */
+struct sorted_piece {
+    int *data;
+    int size;
+};
+
+/**
+ * Merge of the sorted files while other files are still sorting.
+ * The sorting coroutines hand their arrays over to one merge
+ * coroutine. It keeps a stack of merged pieces, each at least
+ * twice smaller than the one below, like a binary counter: every
+ * number is merged about log2(file count) times, as in a balanced
+ * merge tree. The last few pieces are merged into out.txt.
+ */
+struct merge_pipeline {
+    pthread_mutex_t lock;
+    /** Sorted files not taken by the merger yet. */
+    struct sorted_piece *queue;
+    int queue_size;
+    /** Sorting coroutines still running. */
+    int sorters_left;
+    struct coro *merger;
+    /** Merged pieces, their sizes decrease to the top. */
+    struct sorted_piece *stack;
+    int stack_size;
+    bool use_quantum;
+    /** Pairwise merges done. */
+    int merge_count;
+};
+
+/**
+ * Decides when a sorting coroutine yields. The work is counted in
+ * elements, and the clock is read only when a budget of work is
+ * spent. The budget is tuned from the measured speed so that the
+ * slices are close to the target.
+ */
+struct yield_control {
+    /** Slice to aim at, ns. 0 if the slices are not timed. */
+    uint64_t target;
+    /** Work done in the current slice. */
+    long work;
+    /** Work after which to yield or to look at the clock. */
+    long budget;
+    /** Estimated work per ns. */
+    double rate;
+    /** coro_cpu_time() at the start of the current slice. */
+    uint64_t slice_start;
+    /** Longest slice so far, ns. */
+    uint64_t max_slice;
+};
+
+/**
+ * Sort state of a coroutine or a pool thread: the algorithm, the
+ * yields and the buffers reused for all the arrays it sorts.
+ */
+struct sort_state {
+    enum sort_algo algo;
+    /** Sorting on a pool thread, there is nobody to yield to. */
+    bool no_yield;
+    struct yield_control yield;
+    /** Sort buffer, reused for all files of the coroutine. */
+    int *scratch;
+    size_t scratch_size;
+    /** Radix sort digit counters, one row per pass, or NULL. */
+    int (*counts)[1 << RADIX_BITS_MAX];
+};
+
 struct
 my_context
 {
-    char *coro_name;
+    char coro_name[16];
     int f_count;
     char **file_names;
     int *f_index;
     int **data;
     int *array;
     int *array_size;
+    struct sort_state sort;
+    /** External sort, NULL if the files are sorted in memory. */
+    struct extsort *ext;
+    /** Memory of the coroutine in the external sort, bytes. */
+    size_t mem_budget;
+    /** Numbers in the external sort run buffer, which is array. */
+    int run_size;
+    int run_capacity;
+    /** Text buffer of the external sort. */
+    char *chunk;
+    size_t chunk_size;
+    /** Merge pipeline to hand the sorted files to, or NULL. */
+    struct merge_pipeline *pipeline;
+};
 
-    int sec_start;
-    int nsec_start;
-    int sec_finish;
-    int nsec_finish;
-    int sec_total;
-    int nsec_total;
+struct
+sort_options
+{
+    /** Target latency in microseconds, 0 if not given. */
+    long latency;
+    /** Elements to sort between yields, 0 if not given. */
+    long yield_work;
+    /** Threads to run the coroutines on, 0 if not given. */
+    int workers;
+    enum sort_algo algo;
+    /** Memory limit in bytes, 0 to sort all in memory. */
+    size_t mem_limit;
+    /** Merge the sorted files while others are sorting. */
+    bool pipeline;
+    /** Format of out.txt. */
+    enum run_format out_format;
+    /** Sort on a pool of this many threads, not coroutines. */
+    int threads;
+    /** Dump the coroutine stats to stderr in the end. */
+    bool stats;
 };
 
 
-int
-calc_nums_in_file(FILE *file)
+/**
+ * Read the whole file via the coroutine-aware I/O, so other
+ * coroutines keep sorting while this one waits for the disk.
+ * Pool threads have no coroutines, they use plain reads.
+ * Returns a buffer with NUMPARSE_PADDING spare bytes after the
+ * text, its size is stored in @a size. NULL on error.
+ */
+static char *
+read_file(const char *f_name, size_t *size, bool use_coro)
 {
-    int count = 0;
-    int numbers;
-
-    rewind(file);
-    while (fscanf(file, "%d", &numbers) == 1) {
-        count++;
+    int fd = use_coro ? coro_open(f_name, O_RDONLY, 0) :
+             open(f_name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    *size = 0;
+    size_t capacity = 64 * 1024;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        capacity = st.st_size + 1;
+    char *buf = malloc(capacity + NUMPARSE_PADDING);
+    while (true) {
+        if (*size == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity + NUMPARSE_PADDING);
+        }
+        ssize_t rc = use_coro ? coro_read(fd, buf + *size, capacity - *size) :
+                     read(fd, buf + *size, capacity - *size);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0) {
+            free(buf);
+            close(fd);
+            return NULL;
+        }
+        if (rc == 0)
+            break;
+        *size += rc;
     }
-
-    rewind(file);
-    return count;
+    close(fd);
+    return buf;
 }
 
-void fill_array(FILE *file, int *array) {
-    int i = 0;
-
-    rewind(file);
-    while (fscanf(file, "%d", &array[i]) == 1) {
-        i++;
-    }
-
-    rewind(file);
+/**
+ * Get the numbers of a file read by read_file(). One pass over
+ * the text, the array grows as it goes. A run file is just copied
+ * out, nothing to parse.
+ */
+static int *
+parse_numbers(const char *text, size_t size, size_t *count)
+{
+    if (runfile_is_runfile(text, size))
+        return runfile_load(text, size, count);
+    return numparse(text, size, count);
 }
 
-
-
-static struct my_context *
-my_context_new(char *coro_name, char **file_names, int f_count,
-               int *f_index, int **data, int *array_size)
+/**
+ * Fill a context of a sorting coroutine. It is copied into the
+ * coroutine by coro_new_with_arg(), so it is not allocated.
+ */
+static void
+my_context_create(struct my_context *ctx, int coro_index, char **file_names,
+                  int f_count, int *f_index, int **data, int *array_size,
+                  uint64_t yield_target, long yield_work,
+                  enum sort_algo algo, struct extsort *ext,
+                  size_t mem_budget, struct merge_pipeline *pipeline)
 {
-    struct my_context *ctx = malloc(sizeof(*ctx));
-    ctx->coro_name = strdup(coro_name);
+    memset(&ctx->sort, 0, sizeof(ctx->sort));
+    ctx->sort.algo = algo;
+    ctx->sort.yield.target = yield_target;
+    ctx->sort.yield.budget = yield_work;
+    snprintf(ctx->coro_name, sizeof(ctx->coro_name), "coro_%d", coro_index);
     ctx->file_names = file_names;
     ctx->f_index = f_index;
     ctx->f_count = f_count;
     ctx->data = data;
     ctx->array_size = array_size;
-    return ctx;
-
+    ctx->ext = ext;
+    ctx->mem_budget = mem_budget;
+    ctx->array = NULL;
+    ctx->run_size = 0;
+    ctx->run_capacity = 0;
+    ctx->chunk = NULL;
+    ctx->chunk_size = 0;
+    ctx->pipeline = pipeline;
 }
 
-static void my_context_delete(struct my_context *ctx) {
-    free(ctx->coro_name);
-    free(ctx);
+static void my_context_destroy(struct my_context *ctx) {
+    /* In memory, the arrays belong to data[]. */
+    if (ctx->ext)
+        free(ctx->array);
+    free(ctx->chunk);
+    free(ctx->sort.scratch);
+    free(ctx->sort.counts);
 }
 
-static void stop_time(struct my_context *ctx) {
-    struct timespec time;
-    clock_gettime(CLOCK_MONOTONIC, &time);
-    ctx->sec_finish = time.tv_sec;
-    ctx->nsec_finish = time.tv_nsec;
+/** Get a scratch buffer of at least n elements. */
+static int *
+sortScratch(struct sort_state *st, int n)
+{
+    if ((size_t)n > st->scratch_size) {
+        free(st->scratch);
+        st->scratch = malloc(n * sizeof(int));
+        st->scratch_size = n;
+    }
+    return st->scratch;
 }
 
+/** Runs of this size and less are sorted by insertions. */
+enum { SMALL_RUN = 16 };
 
-static void start_time(struct my_context *ctx) {
-    struct timespec time;
-    clock_gettime(CLOCK_MONOTONIC, &time);
-    ctx->sec_start = time.tv_sec;
-    ctx->nsec_start = time.tv_nsec;
+static void
+insertionSort(int *array, int n)
+{
+    for (int i = 1; i < n; ++i) {
+        int value = array[i];
+        int j = i - 1;
+        while (j >= 0 && array[j] > value) {
+            array[j + 1] = array[j];
+            --j;
+        }
+        array[j + 1] = value;
+    }
 }
 
-static void calculate_time(struct my_context *ctx) {
-
-    long long diff_sec = ctx->sec_finish - ctx->sec_start;
-    long long diff_nsec = ctx->nsec_finish - ctx->nsec_start;
+/**
+ * Merge sorted a[0, n1) and b[0, n2) into out. The choice of the
+ * next element is a conditional move, not a branch, because with
+ * random data the branch predictor misses half of the time.
+ */
+static void
+concat(const int *a, int n1, const int *b, int n2, int *out)
+{
+    int i = 0;
+    int j = 0;
+    while (i < n1 && j < n2) {
+        int x = a[i];
+        int y = b[j];
+        int take_b = y < x;
+        *out++ = take_b ? y : x;
+        j += take_b;
+        i += 1 - take_b;
+    }
+    memcpy(out, a + i, (n1 - i) * sizeof(int));
+    memcpy(out + n1 - i, b + j, (n2 - j) * sizeof(int));
+}
 
-    if (diff_sec > 0 && diff_nsec < 0) {
-        diff_sec--;
-        diff_nsec += 1000000000;
+/**
+ * Account @a work elements sorted and maybe yield. Without a
+ * target slice it yields every budget elements, 0 means on each
+ * call. With it, the clock is checked once the budget is spent:
+ * the coroutine yields if the slice is almost over, otherwise the
+ * next check is planned from the measured speed.
+ */
+static void
+sortYield(struct sort_state *st, long work)
+{
+    if (st->no_yield)
+        return;
+    struct yield_control *y = &st->yield;
+    y->work += work;
+    if (y->work < y->budget)
+        return;
+    if (y->target == 0) {
+        y->work = 0;
+        coro_yield();
+        return;
+    }
+    struct coro *this = coro_this();
+    uint64_t elapsed = coro_cpu_time(this) - y->slice_start;
+    if (elapsed > 0) {
+        double rate = (double)y->work / elapsed;
+        y->rate = y->rate == 0 ? rate : (3 * y->rate + rate) / 4;
     }
+    if (elapsed >= y->target - y->target / 8) {
+        if (elapsed > y->max_slice)
+            y->max_slice = elapsed;
+        coro_yield();
+        y->work = 0;
+        y->slice_start = coro_cpu_time(this);
+        elapsed = 0;
+    }
+    /*
+     * Check again in a half of the time left: a step slower than
+     * the estimate can't overrun the slice by much then.
+     */
+    double left = y->rate * (y->target - elapsed) / 2;
+    y->budget = y->work + (left < 1 ? 1 : left > INT_MAX ? INT_MAX :
+                           (long)left);
+}
 
-    ctx->sec_total = diff_sec;
-    ctx->nsec_total += diff_nsec;
+/**
+ * Number of elements of a among the first k elements of the merge
+ * of a and b. Ties go to a, as in concat().
+ */
+static int
+mergePathSplit(const int *a, int n1, const int *b, int n2, int k)
+{
+    int lo = k > n2 ? k - n2 : 0;
+    int hi = k < n1 ? k : n1;
+    while (lo < hi) {
+        int i = lo + (hi - lo) / 2;
+        if (a[i] <= b[k - i - 1])
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return lo;
 }
 
-void concat(int *arr, int l, int m, int r) {
-    int i, j, k;
-    int n1 = m - l + 1;
-    int n2 = r - m;
+/**
+ * Merge a and b into out, yielding every MERGE_CHUNK elements, so
+ * that the long merges of the last passes do not break the slice.
+ * The chunk ends are found by mergePathSplit().
+ */
+static void
+mergeYielding(const int *a, int n1, const int *b, int n2, int *out,
+              struct sort_state *st)
+{
+    int n = n1 + n2;
+    if (n <= MERGE_CHUNK || st->no_yield) {
+        concat(a, n1, b, n2, out);
+        sortYield(st, n);
+        return;
+    }
+    int i0 = 0;
+    for (int k0 = 0; k0 < n; k0 += MERGE_CHUNK) {
+        int k1 = n - k0 < MERGE_CHUNK ? n : k0 + MERGE_CHUNK;
+        int i1 = mergePathSplit(a, n1, b, n2, k1);
+        concat(a + i0, i1 - i0, b + k0 - i0, (k1 - i1) - (k0 - i0),
+               out + k0);
+        i0 = i1;
+        sortYield(st, k1 - k0);
+    }
+}
 
-    int *L = malloc(sizeof(int) * n1);
-    int *R = malloc(sizeof(int) * n2);
+/**
+ * Bottom-up merge sort. Runs of SMALL_RUN are sorted in place,
+ * then each pass merges pairs of runs from one buffer into the
+ * other: the array and the coroutine's scratch buffer take turns,
+ * so nothing is allocated per merge. Long merges are split to
+ * yield in between, see mergeYielding().
+ */
+void mergeSort(int *array, int n, struct sort_state *st) {
+    for (int l = 0; l < n; l += SMALL_RUN) {
+        insertionSort(array + l, n - l < SMALL_RUN ? n - l : SMALL_RUN);
+        sortYield(st, SMALL_RUN);
+    }
 
-    for (i = 0; i < n1; i++)
-        L[i] = arr[l + i];
-    for (j = 0; j < n2; j++)
-        R[j] = arr[m + 1 + j];
+    int *src = array;
+    int *dst = sortScratch(st, n);
+    for (int width = SMALL_RUN; width < n; width *= 2) {
+        for (int l = 0; l < n; l += 2 * width) {
+            int m = n - l < width ? n : l + width;
+            int r = n - m < width ? n : m + width;
+            mergeYielding(src + l, m - l, src + m, r - m, dst + l, st);
+        }
+        int *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != array)
+        memcpy(array, src, n * sizeof(int));
+}
 
-    i = 0;
-    j = 0;
-    k = l;
+/** Radix sort key: the sign bit flipped, so negatives go first. */
+static inline unsigned
+radixKey(int value)
+{
+    return (unsigned)value ^ 0x80000000u;
+}
 
-    while (i < n1 && j < n2) {
-        if (L[i] <= R[j]) {
-            arr[k] = L[i];
-            i++;
-        } else {
-            arr[k] = R[j];
-            j++;
+/**
+ * LSD radix sort. Counters of all digits are collected in one
+ * pass, then each pass scatters the elements by one digit between
+ * the array and the scratch buffer. A pass is skipped when all
+ * elements have the same digit, so narrow value ranges take fewer
+ * passes. Yields between passes and every RADIX_CHUNK elements
+ * within one.
+ */
+static void
+radixSort(int *array, int n, struct sort_state *st)
+{
+    if (n < 2)
+        return;
+    int bits = n < RADIX_SMALL ? 8 : RADIX_BITS_MAX;
+    int passes = (32 + bits - 1) / bits;
+    int radix = 1 << bits;
+    unsigned mask = radix - 1;
+    if (st->counts == NULL)
+        st->counts = malloc(RADIX_PASSES_MAX * sizeof(st->counts[0]));
+    int (*counts)[1 << RADIX_BITS_MAX] = st->counts;
+    memset(counts, 0, passes * sizeof(counts[0]));
+
+    for (int i = 0; i < n; ++i) {
+        unsigned key = radixKey(array[i]);
+        for (int p = 0; p < passes; ++p)
+            counts[p][(key >> (p * bits)) & mask]++;
+    }
+    sortYield(st, n);
+
+    int *src = array;
+    int *dst = sortScratch(st, n);
+    for (int p = 0; p < passes; ++p) {
+        int shift = p * bits;
+        int *count = counts[p];
+        if (count[(radixKey(src[0]) >> shift) & mask] == n)
+            continue;
+        int offset = 0;
+        for (int d = 0; d < radix; ++d) {
+            int c = count[d];
+            count[d] = offset;
+            offset += c;
         }
-        k++;
+        for (int l = 0; l < n; l += RADIX_CHUNK) {
+            int r = n - l < RADIX_CHUNK ? n : l + RADIX_CHUNK;
+            for (int i = l; i < r; ++i) {
+                int value = src[i];
+                dst[count[(radixKey(value) >> shift) & mask]++] = value;
+            }
+            sortYield(st, r - l);
+        }
+        int *tmp = src;
+        src = dst;
+        dst = tmp;
     }
+    if (src != array)
+        memcpy(array, src, n * sizeof(int));
+}
 
-    while (i < n1) {
-        arr[k] = L[i];
-        i++;
-        k++;
+static void
+sortArray(int *array, int n, struct sort_state *st)
+{
+    switch (st->algo) {
+    case SORT_RADIX:
+        radixSort(array, n, st);
+        break;
+    case SORT_HYBRID:
+        if (n <= HYBRID_MERGE_MAX)
+            mergeSort(array, n, st);
+        else
+            radixSort(array, n, st);
+        break;
+    default:
+        mergeSort(array, n, st);
+        break;
     }
+}
 
-    while (j < n2) {
-        arr[k] = R[j];
-        j++;
-        k++;
+/**
+ * Give the coroutine its external sort buffers within its memory
+ * budget. Parsing a text chunk takes up to 6 chunk sizes: the
+ * text and the growing array of numbers. The rest is the run
+ * buffer and the sort scratch buffer of the same size.
+ */
+static void
+externalInit(struct my_context *ctx)
+{
+    size_t chunk = ctx->mem_budget / 16;
+    if (chunk > EXTERNAL_CHUNK_MAX)
+        chunk = EXTERNAL_CHUNK_MAX;
+    if (chunk < EXTERNAL_CHUNK_MIN)
+        chunk = EXTERNAL_CHUNK_MIN;
+    size_t run = 0;
+    if (ctx->mem_budget > 6 * chunk)
+        run = (ctx->mem_budget - 6 * chunk) / (2 * sizeof(int));
+    if (run < EXTERNAL_RUN_MIN)
+        run = EXTERNAL_RUN_MIN;
+    if (run > INT_MAX / 2)
+        run = INT_MAX / 2;
+    ctx->chunk = malloc(chunk + NUMPARSE_PADDING);
+    ctx->chunk_size = chunk;
+    ctx->array = malloc(run * sizeof(int));
+    ctx->run_capacity = (int)run;
+    ctx->run_size = 0;
+}
+
+/** Sort the run buffer and spill it to a temporary file. */
+static int
+spillRun(struct my_context *ctx)
+{
+    if (ctx->run_size == 0)
+        return 0;
+    sortArray(ctx->array, ctx->run_size, &ctx->sort);
+    int rc = extsort_spill(ctx->ext, ctx->array, ctx->run_size);
+    ctx->run_size = 0;
+    return rc;
+}
+
+static int
+appendToRun(struct my_context *ctx, const int *numbers, size_t count)
+{
+    while (count > 0) {
+        size_t n = ctx->run_capacity - ctx->run_size;
+        if (n > count)
+            n = count;
+        memcpy(ctx->array + ctx->run_size, numbers, n * sizeof(int));
+        ctx->run_size += n;
+        numbers += n;
+        count -= n;
+        if (ctx->run_size == ctx->run_capacity && spillRun(ctx) != 0)
+            return -1;
     }
+    return 0;
+}
 
-    free(L);
-    free(R);
+static inline bool
+isNumberChar(char c)
+{
+    return (unsigned char)(c - '0') < 10 || c == '-';
 }
 
-void mergeSort(int *array, int l, int r, struct my_context *ctx) {
-    if (l < r) {
-        int m = l + (r - l) / 2;
+/**
+ * Put the numbers of a run file into the run buffer, block by
+ * block right from the mapped file.
+ */
+static int
+sortRunFileExternal(struct my_context *ctx, int fd)
+{
+    struct runfile_reader reader;
+    if (runfile_reader_open(&reader, fd) != 0)
+        return -1;
+    int rc = 0;
+    struct runfile_block block;
+    while (rc == 0 && runfile_reader_next(&reader, &block)) {
+        rc = appendToRun(ctx, block.data, block.count);
+        sortYield(&ctx->sort, block.count);
+    }
+    if (reader.is_error) {
+        errno = EINVAL;
+        rc = -1;
+    }
+    runfile_reader_destroy(&reader);
+    return rc;
+}
 
-        mergeSort(array, l, m, ctx);
-        mergeSort(array, m + 1, r, ctx);
+/**
+ * Read the file chunk by chunk into the run buffer, which is
+ * sorted and spilled whenever full. The runs are not per file:
+ * small files of the coroutine share one. A number cut by the end
+ * of a chunk is moved to the start of the next one.
+ */
+static int
+sortFileExternal(struct my_context *ctx, const char *f_name)
+{
+    int fd = coro_open(f_name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    char header[RUNFILE_HEADER_SIZE];
+    ssize_t header_size = pread(fd, header, sizeof(header), 0);
+    if (header_size > 0 && runfile_is_runfile(header, header_size)) {
+        int rc = sortRunFileExternal(ctx, fd);
+        close(fd);
+        return rc;
+    }
 
-        concat(array, l, m, r);
+    size_t tail = 0;
+    int rc = 0;
+    while (rc == 0) {
+        ssize_t size = coro_read(fd, ctx->chunk + tail,
+                                 ctx->chunk_size - tail);
+        if (size < 0) {
+            rc = -1;
+            break;
+        }
+        size_t end = tail + size;
+        size_t cut = end;
+        if (size > 0) {
+            while (cut > 0 && isNumberChar(ctx->chunk[cut - 1]))
+                --cut;
+            /* No separators at all, it can't be one number. */
+            if (cut == 0 && end == ctx->chunk_size)
+                cut = end;
+        }
+        size_t count;
+        int *numbers = numparse(ctx->chunk, cut, &count);
+        if (!numbers) {
+            rc = -1;
+            break;
+        }
+        rc = appendToRun(ctx, numbers, count);
+        free(numbers);
+        memmove(ctx->chunk, ctx->chunk + cut, end - cut);
+        tail = end - cut;
+        if (size == 0)
+            break;
+        sortYield(&ctx->sort, count);
+    }
+    close(fd);
+    return rc;
+}
 
-        stop_time(ctx);
-        calculate_time(ctx);
+static void
+pipelineYield(struct merge_pipeline *p)
+{
+    if (p->use_quantum)
+        coro_yield_if_quantum_expired();
+    else
         coro_yield();
-        start_time(ctx);
+}
+
+/**
+ * Merge two pieces into a new one, yielding every PIPELINE_CHUNK
+ * elements. Each chunk is an independent concat() of the parts of
+ * a and b found by a binary search.
+ */
+static struct sorted_piece
+pipelineMerge(struct merge_pipeline *p, struct sorted_piece a,
+              struct sorted_piece b)
+{
+    struct sorted_piece res;
+    res.size = a.size + b.size;
+    res.data = malloc(res.size * sizeof(int));
+    int i = 0;
+    for (int k = 0; k < res.size; k += PIPELINE_CHUNK) {
+        int k_end = res.size - k < PIPELINE_CHUNK ?
+                    res.size : k + PIPELINE_CHUNK;
+        int i_end = mergePathSplit(a.data, a.size, b.data, b.size, k_end);
+        concat(a.data + i, i_end - i, b.data + k - i,
+               (k_end - i_end) - (k - i), res.data + k);
+        i = i_end;
+        pipelineYield(p);
     }
+    free(a.data);
+    free(b.data);
+    ++p->merge_count;
+    return res;
 }
 
-static int coro_func(void *context)
+/** Put a sorted file on the stack, merge the pieces of close sizes. */
+static void
+pipelinePush(struct merge_pipeline *p, struct sorted_piece piece)
 {
-    struct coro *this = coro_this();
-    struct my_context *ctx = context;
+    p->stack[p->stack_size++] = piece;
+    while (p->stack_size >= 2 &&
+           p->stack[p->stack_size - 1].size * 2 >=
+           p->stack[p->stack_size - 2].size) {
+        struct sorted_piece b = p->stack[--p->stack_size];
+        struct sorted_piece a = p->stack[--p->stack_size];
+        p->stack[p->stack_size++] = pipelineMerge(p, a, b);
+    }
+}
 
-    start_time(ctx);
-    while (*(ctx->f_index) != ctx->f_count) {
+/**
+ * Hand a sorted file over to the merger. The wakeup is done under
+ * the lock, so the merger can't see the last sorter gone and
+ * finish before it.
+ */
+static void
+pipelineSubmit(struct merge_pipeline *p, int *data, int size, bool is_last)
+{
+    pthread_mutex_lock(&p->lock);
+    if (data) {
+        p->queue[p->queue_size].data = data;
+        p->queue[p->queue_size].size = size;
+        ++p->queue_size;
+    }
+    if (is_last)
+        --p->sorters_left;
+    coro_wakeup(p->merger);
+    pthread_mutex_unlock(&p->lock);
+}
 
-        int i = *ctx->f_index;
+static void *
+merge_func(void *context)
+{
+    struct merge_pipeline *p = context;
+    while (true) {
+        pthread_mutex_lock(&p->lock);
+        struct sorted_piece piece = {NULL, 0};
+        bool is_done = false;
+        if (p->queue_size > 0)
+            piece = p->queue[--p->queue_size];
+        else
+            is_done = p->sorters_left == 0;
+        pthread_mutex_unlock(&p->lock);
+        if (piece.data) {
+            pipelinePush(p, piece);
+            continue;
+        }
+        if (is_done)
+            break;
+        coro_suspend();
+    }
+    return NULL;
+}
+
+static void *coro_func(void *context)
+{
+    struct coro *this = coro_this();
+    struct my_context *ctx = context;
+    if (ctx->ext)
+        externalInit(ctx);
+
+    while (true) {
+
+        /*
+         * Claim the file before reading it: the read can switch
+         * to other coroutines, which must not pick the same one.
+         * With --workers they run in parallel, so it is atomic.
+         */
+        int i = __atomic_fetch_add(ctx->f_index, 1, __ATOMIC_RELAXED);
+        if (i >= ctx->f_count)
+            break;
         char *f_name = ctx->file_names[i];
+        ctx->data[i] = NULL;
+        ctx->array_size[i] = 0;
 
         printf("Coroutine %s sorting file %s...\n", ctx->coro_name, f_name);
 
-        FILE* file = fopen(f_name, "r");
-        if (!file) {
-            my_context_delete(ctx);
-            return 0;
+        if (ctx->ext) {
+            if (sortFileExternal(ctx, f_name) != 0) {
+                perror(f_name);
+                break;
+            }
+            continue;
         }
 
-        int count_of_numbers = calc_nums_in_file(file);
+        size_t text_size;
+        char *text = read_file(f_name, &text_size, true);
+        if (!text)
+            break;
+
+        size_t count;
+        ctx->array = parse_numbers(text, text_size, &count);
+        free(text);
+        if (!ctx->array)
+            break;
+        int count_of_numbers = (int)count;
+
+        /*
+         * Reading and parsing can't yield, their time is not
+         * counted into the slices of the sort.
+         */
+        ctx->sort.yield.slice_start = coro_cpu_time(this);
+        sortArray(ctx->array, count_of_numbers, &ctx->sort);
+
+        if (ctx->pipeline) {
+            pipelineSubmit(ctx->pipeline, ctx->array, count_of_numbers, false);
+        } else {
+            ctx->data[i] = ctx->array;
+            ctx->array_size[i] = count_of_numbers;
+        }
+    }
+
+    /* Even on an error, or the merger would wait forever. */
+    if (ctx->pipeline)
+        pipelineSubmit(ctx->pipeline, NULL, 0, true);
 
-        ctx->array = (int *) malloc(count_of_numbers * sizeof(int ));
-        fill_array(file, ctx->array);
+    if (ctx->ext && spillRun(ctx) != 0)
+        perror("spill");
 
-        fclose(file);
-        ctx->data[*(ctx->f_index)] = ctx->array;
-        ctx->array_size[*(ctx->f_index)] = count_of_numbers;
+    printf("%s: количество переключений - %lld, время выполнения: %lld\n", ctx->coro_name, coro_switch_count(this),
+           (long long)(coro_cpu_time(this) / 1000));
+    if (ctx->sort.yield.target > 0)
+        printf("%s: цель кванта - %lld, максимальный квант сортировки: %lld\n",
+               ctx->coro_name, (long long)(ctx->sort.yield.target / 1000),
+               (long long)(ctx->sort.yield.max_slice / 1000));
+
+    my_context_destroy(ctx);
+    return NULL;
+}
 
-        (*(ctx->f_index))++;
-        mergeSort(ctx->array, 0, count_of_numbers - 1, ctx);
 
+/** Merge the sorted arrays in one pass, log(k) per number. */
+static int
+mergeArrays(int **data, const int *sizes, int count, int out,
+            enum run_format format)
+{
+    struct kmerge_source sources[count];
+    for (int i = 0; i < count; ++i) {
+        sources[i].pos = data[i];
+        sources[i].end = data[i] + sizes[i];
+        sources[i].refill = NULL;
+        sources[i].ctx = NULL;
     }
+    struct kmerge merge;
+    kmerge_create(&merge, sources, count);
+
+    struct run_output output;
+    run_output_create(&output, out, format, NUMWRITE_BUFFER_SIZE);
+    int value;
+    while (kmerge_next(&merge, &value))
+        run_output_put(&output, value);
+    kmerge_destroy(&merge);
+    return run_output_destroy(&output);
+}
 
-    stop_time(ctx);
-    calculate_time(ctx);
-    printf("%s: количество переключений - %lld, время выполнения: %d\n", ctx->coro_name, coro_switch_count(this),
-           ctx->sec_total * 1000000  + ctx->nsec_total / 1000);
+/** A file read and parsed by a pool thread. */
+struct thread_file {
+    const char *f_name;
+    int *data;
+    int size;
+};
 
-    my_context_delete(ctx);
-    return 0;
+/** A part of a file, sorted by a pool thread. */
+struct thread_piece {
+    const int *src;
+    /** Place of the piece in the common array. */
+    int *dst;
+    /** The same place in the other array, free for now. */
+    int *scratch;
+    int size;
+    enum sort_algo algo;
+};
+
+/**
+ * One task of a parallel pass: the output range [k0, k1) of the
+ * merge of a and b, or formatting of data[0, size) into text.
+ */
+struct thread_chunk {
+    const int *a;
+    int n1;
+    const int *b;
+    int n2;
+    int *out;
+    int k0;
+    int k1;
+    const int *data;
+    int size;
+    char *text;
+    size_t text_size;
+};
+
+static void *
+threadReadFile(void *arg)
+{
+    struct thread_file *file = arg;
+    size_t text_size;
+    char *text = read_file(file->f_name, &text_size, false);
+    if (!text)
+        return NULL;
+    size_t count;
+    file->data = parse_numbers(text, text_size, &count);
+    free(text);
+    file->size = file->data ? (int)count : 0;
+    return NULL;
+}
+
+static void *
+threadSortPiece(void *arg)
+{
+    struct thread_piece *piece = arg;
+    memcpy(piece->dst, piece->src, piece->size * sizeof(int));
+    /* The scratch is borrowed, only the counters are our own. */
+    struct sort_state st;
+    memset(&st, 0, sizeof(st));
+    st.algo = piece->algo;
+    st.no_yield = true;
+    st.scratch = piece->scratch;
+    st.scratch_size = piece->size;
+    sortArray(piece->dst, piece->size, &st);
+    free(st.counts);
+    return NULL;
+}
+
+/**
+ * Merge path: both ends of the output range are found by a binary
+ * search, so each chunk is merged independently of the others.
+ */
+static void *
+threadMergeChunk(void *arg)
+{
+    struct thread_chunk *c = arg;
+    int i0 = mergePathSplit(c->a, c->n1, c->b, c->n2, c->k0);
+    int i1 = mergePathSplit(c->a, c->n1, c->b, c->n2, c->k1);
+    concat(c->a + i0, i1 - i0, c->b + c->k0 - i0,
+           (c->k1 - i1) - (c->k0 - i0), c->out + c->k0);
+    return NULL;
+}
+
+static void *
+threadFormatChunk(void *arg)
+{
+    struct thread_chunk *c = arg;
+    c->text = malloc((size_t)c->size * NUMWRITE_MAX_LEN);
+    char *pos = c->text;
+    for (int i = 0; i < c->size; ++i)
+        pos += numwrite_format(pos, c->data[i]);
+    c->text_size = pos - c->text;
+    return NULL;
+}
+
+/**
+ * Run @a func on each of @a count arguments of @a arg_size bytes
+ * on the pool. Then @a done, if given, is called for each of them
+ * in order, as soon as it is finished. A task the pool can't take
+ * is run right here.
+ */
+static void
+threadRunAll(struct thread_pool *pool, thread_task_f func, void *args,
+             size_t arg_size, int count, void (*done)(void *arg, void *ctx),
+             void *done_ctx)
+{
+    struct thread_task **tasks = malloc(count * sizeof(tasks[0]));
+    for (int i = 0; i < count; ++i) {
+        void *arg = (char *)args + i * arg_size;
+        thread_task_new(&tasks[i], func, arg);
+        if (thread_pool_push_task(pool, tasks[i]) != 0) {
+            thread_task_delete(tasks[i]);
+            tasks[i] = NULL;
+            func(arg);
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        if (tasks[i]) {
+            thread_task_join(tasks[i], NULL);
+            thread_task_delete(tasks[i]);
+        }
+        if (done)
+            done((char *)args + i * arg_size, done_ctx);
+    }
+    free(tasks);
+}
+
+/** Part of the common array, a sorted piece or a merge of them. */
+struct thread_segment {
+    int offset;
+    int size;
+};
+
+/**
+ * Merge adjacent pairs of segments from src into the same places
+ * of dst, each merge cut into chunks by the merge path. Returns
+ * the new number of segments.
+ */
+static int
+threadMergeRound(struct thread_pool *pool, const int *src, int *dst,
+                 struct thread_segment *segments, int count, int chunk_size)
+{
+    int chunk_count = 0;
+    for (int i = 0; i < count; i += 2) {
+        int size = segments[i].size;
+        if (i + 1 < count)
+            size += segments[i + 1].size;
+        chunk_count += size / chunk_size + 1;
+    }
+    struct thread_chunk *chunks = calloc(chunk_count, sizeof(chunks[0]));
+    struct thread_chunk *c = chunks;
+    int new_count = 0;
+    for (int i = 0; i < count; i += 2) {
+        struct thread_segment a = segments[i];
+        struct thread_segment b = {a.offset + a.size, 0};
+        if (i + 1 < count)
+            b = segments[i + 1];
+        int size = a.size + b.size;
+        int parts = size / chunk_size + 1;
+        for (int p = 0; p < parts; ++p, ++c) {
+            c->a = src + a.offset;
+            c->n1 = a.size;
+            c->b = src + b.offset;
+            c->n2 = b.size;
+            c->out = dst + a.offset;
+            c->k0 = (long)size * p / parts;
+            c->k1 = (long)size * (p + 1) / parts;
+        }
+        segments[new_count].offset = a.offset;
+        segments[new_count].size = size;
+        ++new_count;
+    }
+    threadRunAll(pool, threadMergeChunk, chunks, sizeof(chunks[0]),
+                 chunk_count, NULL, NULL);
+    free(chunks);
+    return new_count;
+}
+
+/** Output of the formatted chunks, in order. */
+struct thread_output {
+    int fd;
+    /** False after a write error, errno is kept. */
+    bool is_ok;
+};
+
+static void
+threadWriteChunk(void *arg, void *ctx)
+{
+    struct thread_chunk *c = arg;
+    struct thread_output *output = ctx;
+    size_t done = 0;
+    while (output->is_ok && done < c->text_size) {
+        ssize_t rc = write(output->fd, c->text + done, c->text_size - done);
+        if (rc < 0 && errno != EINTR)
+            output->is_ok = false;
+        else if (rc > 0)
+            done += rc;
+    }
+    free(c->text);
 }
 
+/**
+ * Sort the files on a pool of threads. Each file is read and
+ * parsed by a task, then the files are cut into pieces of about
+ * total / threads numbers, so that a big file is sorted by several
+ * threads, and each piece is sorted by a task. The pieces are
+ * merged in pairs, round by round, every merge split between
+ * tasks by the merge path. The text is formatted in parallel
+ * too, and written in order.
+ */
+static int
+sortWithThreads(char **file_names, int count_files,
+                const struct sort_options *opts, int out)
+{
+    struct thread_pool *pool;
+    if (thread_pool_new(opts->threads, &pool) != 0) {
+        fprintf(stderr, "Invalid thread count %d\n", opts->threads);
+        return -1;
+    }
+    int threads = opts->threads;
+
+    struct thread_file *files = calloc(count_files, sizeof(files[0]));
+    for (int i = 0; i < count_files; ++i)
+        files[i].f_name = file_names[i];
+    threadRunAll(pool, threadReadFile, files, sizeof(files[0]), count_files,
+                 NULL, NULL);
+    long total = 0;
+    for (int i = 0; i < count_files; ++i) {
+        if (!files[i].data)
+            perror(files[i].f_name);
+        total += files[i].size;
+    }
+    if (total > INT_MAX) {
+        fprintf(stderr, "Too many numbers for --threads\n");
+        total = 0;
+        for (int i = 0; i < count_files; ++i)
+            files[i].size = 0;
+    }
+
+    int piece_max = (total + threads - 1) / threads;
+    if (piece_max < THREAD_CHUNK_MIN)
+        piece_max = THREAD_CHUNK_MIN;
+    int piece_count = 0;
+    for (int i = 0; i < count_files; ++i)
+        piece_count += (files[i].size + piece_max - 1) / piece_max;
+
+    int *all = malloc((total + 1) * sizeof(int));
+    int *tmp = malloc((total + 1) * sizeof(int));
+    struct thread_piece *pieces = malloc((piece_count + 1) * sizeof(pieces[0]));
+    struct thread_segment *segments =
+        malloc((piece_count + 1) * sizeof(segments[0]));
+    int offset = 0;
+    int p = 0;
+    for (int i = 0; i < count_files; ++i) {
+        int parts = (files[i].size + piece_max - 1) / piece_max;
+        for (int j = 0; j < parts; ++j, ++p) {
+            int begin = (long)files[i].size * j / parts;
+            int end = (long)files[i].size * (j + 1) / parts;
+            pieces[p].src = files[i].data + begin;
+            pieces[p].dst = all + offset;
+            pieces[p].scratch = tmp + offset;
+            pieces[p].size = end - begin;
+            pieces[p].algo = opts->algo;
+            segments[p].offset = offset;
+            segments[p].size = end - begin;
+            offset += end - begin;
+        }
+    }
+    threadRunAll(pool, threadSortPiece, pieces, sizeof(pieces[0]),
+                 piece_count, NULL, NULL);
+    for (int i = 0; i < count_files; ++i)
+        free(files[i].data);
+    free(files);
+    free(pieces);
+
+    int chunk_size = total / (threads * THREAD_CHUNKS_PER_THREAD);
+    if (chunk_size < THREAD_CHUNK_MIN)
+        chunk_size = THREAD_CHUNK_MIN;
+    int *src = all;
+    int *dst = tmp;
+    int segment_count = piece_count;
+    while (segment_count > 1) {
+        segment_count = threadMergeRound(pool, src, dst, segments,
+                                         segment_count, chunk_size);
+        int *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    free(segments);
+
+    int rc;
+    if (opts->out_format == RUN_FORMAT_TEXT) {
+        int chunk_count = total / chunk_size + 1;
+        struct thread_chunk *chunks = calloc(chunk_count, sizeof(chunks[0]));
+        for (int i = 0; i < chunk_count; ++i) {
+            int k0 = total * i / chunk_count;
+            int k1 = total * (i + 1) / chunk_count;
+            chunks[i].data = src + k0;
+            chunks[i].size = k1 - k0;
+        }
+        struct thread_output output = {out, true};
+        threadRunAll(pool, threadFormatChunk, chunks, sizeof(chunks[0]),
+                     chunk_count, threadWriteChunk, &output);
+        rc = output.is_ok ? 0 : -1;
+        free(chunks);
+    } else {
+        struct run_output output;
+        run_output_create(&output, out, opts->out_format,
+                          NUMWRITE_BUFFER_SIZE);
+        for (long i = 0; i < total; ++i)
+            run_output_put(&output, src[i]);
+        rc = run_output_destroy(&output);
+    }
+    if (rc != 0)
+        perror("out.txt");
+    free(all);
+    free(tmp);
+    thread_pool_delete(pool);
+    return rc;
+}
+
+/** Parse a size like "512K", "64M" or "2G", 0 on error. */
+static size_t
+parse_size(const char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        /* fallthrough */
+    case 'M':
+    case 'm':
+        size <<= 10;
+        /* fallthrough */
+    case 'K':
+    case 'k':
+        size <<= 10;
+        ++end;
+        break;
+    }
+    return *end == 0 ? size : 0;
+}
+
+/**
+ * Parse "--name=value" options preceding the positional
+ * arguments. Returns the index of the first positional one, or -1
+ * on an unknown option.
+ */
+static int
+parse_options(int argc, char **argv, struct sort_options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; ++i) {
+        if (strncmp(argv[i], "--latency=", 10) == 0) {
+            opts->latency = atol(argv[i] + 10);
+        } else if (strncmp(argv[i], "--yield-work=", 13) == 0) {
+            opts->yield_work = atol(argv[i] + 13);
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            opts->workers = atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--algo=merge") == 0) {
+            opts->algo = SORT_MERGE;
+        } else if (strcmp(argv[i], "--algo=radix") == 0) {
+            opts->algo = SORT_RADIX;
+        } else if (strcmp(argv[i], "--algo=hybrid") == 0) {
+            opts->algo = SORT_HYBRID;
+        } else if (strcmp(argv[i], "--out-format=text") == 0) {
+            opts->out_format = RUN_FORMAT_TEXT;
+        } else if (strcmp(argv[i], "--out-format=binary") == 0) {
+            opts->out_format = RUN_FORMAT_BINARY;
+        } else if (strcmp(argv[i], "--out-format=delta") == 0) {
+            opts->out_format = RUN_FORMAT_DELTA;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            opts->threads = atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            opts->pipeline = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            opts->stats = true;
+        } else if (strncmp(argv[i], "--mem-limit=", 12) == 0) {
+            opts->mem_limit = parse_size(argv[i] + 12);
+            if (opts->mem_limit == 0) {
+                fprintf(stderr, "Invalid memory limit %s\n", argv[i] + 12);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    return i;
+}
+
+static void
+printProgramTime(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int time = (end.tv_sec - start->tv_sec) * 1000000 +
+               (end.tv_nsec - start->tv_nsec) / 1000;
+    printf("Время выполнения программы: %d\n", time);
+}
 
 int
 main(int argc, char **argv)
 {
     struct timespec start, end;
-    int time;
     clock_gettime(CLOCK_MONOTONIC, &start);
 
+    struct sort_options opts;
+    int first_arg = parse_options(argc, argv, &opts);
+    if (first_arg < 0 || first_arg >= argc) {
+        fprintf(stderr, "Usage: %s [--latency=usec] [--yield-work=N] "
+                "[--workers=N] "
+                "[--algo=merge|radix|hybrid] [--mem-limit=size[K|M|G]] "
+                "[--pipeline] [--out-format=text|binary|delta] "
+                "[--threads=N] [--stats] coro_count file...\n", argv[0]);
+        return 1;
+    }
+    if (opts.pipeline && opts.mem_limit > 0) {
+        fprintf(stderr, "--pipeline works only in memory\n");
+        return 1;
+    }
+    if (opts.threads > 0 && (opts.pipeline || opts.mem_limit > 0)) {
+        fprintf(stderr, "--threads works only in memory without "
+                "--pipeline\n");
+        return 1;
+    }
+    argv += first_arg - 1;
+    argc -= first_arg - 1;
+
     int count_files = argc - 2;
     int N = atoi(argv[1]);
     int f_indx = 0;
 
+    /* The pool does the work of the coroutines, coro_count is unused. */
+    if (opts.threads > 0) {
+        int out = open("out.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            perror("out.txt");
+            return 1;
+        }
+        int rc = sortWithThreads(argv + 2, count_files, &opts, out);
+        close(out);
+        if (rc != 0)
+            return 1;
+        printf("Потоков: %d\n", opts.threads);
+        printProgramTime(&start);
+        return 0;
+    }
+
     int *data[count_files];
     int sizes[count_files];
 
+    /*
+     * With a memory limit the coroutines spill sorted runs to
+     * temporary files, and they share the limit equally.
+     */
+    struct extsort ext;
+    struct extsort *ext_ptr = NULL;
+    size_t mem_budget = 0;
+    if (opts.mem_limit > 0) {
+        extsort_create(&ext, opts.mem_limit);
+        ext_ptr = &ext;
+        if (N > 0)
+            mem_budget = opts.mem_limit / N;
+    }
+
     coro_sched_init();
+    if (opts.stats)
+        coro_sched_set_stats_dump(STDERR_FILENO);
+    /* Each of N coroutines is given T / N microseconds. */
+    if (opts.latency > 0 && N > 0)
+        coro_sched_set_quantum(opts.latency / N);
+
+    /* The merger is created first, the sorters wake it up. */
+    struct merge_pipeline pipeline;
+    struct merge_pipeline *pipeline_ptr = NULL;
+    if (opts.pipeline) {
+        pthread_mutex_init(&pipeline.lock, NULL);
+        pipeline.queue = malloc(count_files * sizeof(pipeline.queue[0]));
+        pipeline.queue_size = 0;
+        pipeline.sorters_left = N;
+        pipeline.stack = malloc(count_files * sizeof(pipeline.stack[0]));
+        pipeline.stack_size = 0;
+        pipeline.use_quantum = opts.latency > 0;
+        pipeline.merge_count = 0;
+        pipeline.merger = coro_new(merge_func, &pipeline);
+        pipeline_ptr = &pipeline;
+    }
 
+    /*
+     * The sorters time their slices to fit into the same T / N. A
+     * fixed --yield-work is used as is, and without both options
+     * they yield at every step.
+     */
+    uint64_t yield_target = 0;
+    if (opts.latency > 0 && N > 0 && opts.yield_work == 0)
+        yield_target = (uint64_t)opts.latency * 1000 / N;
     for (int i = 0; i < N; i++) {
-        char name[16];
-        sprintf(name, "coro_%d", i);
-
-        coro_new(coro_func,
-                 my_context_new(name, argv + 2, count_files, &f_indx, data, sizes));
+        struct my_context ctx;
+        my_context_create(&ctx, i, argv + 2, count_files, &f_indx, data,
+                          sizes, yield_target, opts.yield_work, opts.algo,
+                          ext_ptr, mem_budget, pipeline_ptr);
+        coro_new_with_arg(coro_func, &ctx, sizeof(ctx));
+    }
 
+    /* Sort on several threads, then collect the results as usual. */
+    if (opts.workers > 1 && coro_sched_run(opts.workers) != 0) {
+        fprintf(stderr, "Invalid worker count %d\n", opts.workers);
+        return 1;
     }
 
     struct coro *c;
     while ((c = coro_sched_wait()) != NULL) {
         if (c != NULL){
-            printf("Finished with status %d\n", coro_status(c));
+            printf("Finished with result %p\n", coro_result(c));
             coro_delete(c);
         }
     }
 
-    int *indx = (int *) calloc(count_files, sizeof(int ));
-
-    FILE *out = fopen("out.txt", "w");
+    struct timespec merge_start;
+    clock_gettime(CLOCK_MONOTONIC, &merge_start);
 
-    int min_idx = 0;
-    while (min_idx != -1) {
-
-        int curr_min = INT_MAX;
-        min_idx = -1;
-        for (int i = 0; i < count_files; ++i) {
-            if (sizes[i] > indx[i] && data[i][indx[i]] < curr_min) {
-                curr_min = data[i][indx[i]];
-                min_idx = i;
-            }
-        }
-        if (min_idx != -1) {
-            fprintf(out, "%d ", data[min_idx][indx[min_idx]]);
-            indx[min_idx] += 1;
+    int out = open("out.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("out.txt");
+        return 1;
+    }
+    if (pipeline_ptr) {
+        /* What is left is a few pieces to merge into out.txt. */
+        int count = pipeline.stack_size;
+        for (int i = 0; i < count; ++i) {
+            data[i] = pipeline.stack[i].data;
+            sizes[i] = pipeline.stack[i].size;
         }
+        for (int i = count; i < count_files; ++i)
+            data[i] = NULL;
+        if (mergeArrays(data, sizes, count, out, opts.out_format) != 0)
+            perror("out.txt");
+        printf("Слияний в конвейере: %d\n", pipeline.merge_count);
+        free(pipeline.queue);
+        free(pipeline.stack);
+        pthread_mutex_destroy(&pipeline.lock);
+    } else if (ext_ptr) {
+        int run_count = ext.run_count;
+        if (extsort_merge(&ext, out, opts.out_format) != 0)
+            perror("out.txt");
+        printf("Серий: %d, слияний: %d\n", run_count, ext.merge_count);
+        extsort_destroy(&ext);
+    } else if (mergeArrays(data, sizes, count_files, out,
+                           opts.out_format) != 0) {
+        perror("out.txt");
     }
-
-    fclose(out);
+    close(out);
 
     for (int i = 0; i < count_files; ++i) {
         free(data[i]);
     }
 
-    free(indx);
-
     clock_gettime(CLOCK_MONOTONIC, &end);
-    time = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("Время слияния: %ld\n",
+           (end.tv_sec - merge_start.tv_sec) * 1000000 +
+           (end.tv_nsec - merge_start.tv_nsec) / 1000);
 
-    printf("Время выполнения программы: %d\n", time);
+    coro_sched_destroy();
+
+    printProgramTime(&start);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,24 @@
+/*
+ * Preloaded into the shell to make it big, as a shell with a long
+ * history and large job tables would be: BALLAST_MB megabytes
+ * (1024 by default) are mapped and touched before main(). The
+ * variable LD_PRELOAD is removed then, so the commands started by
+ * the shell are not inflated too.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+__attribute__((constructor)) static void
+ballast_init(void)
+{
+	const char *mb = getenv("BALLAST_MB");
+	size_t size = (size_t)(mb != NULL ? atol(mb) : 1024) << 20;
+	unsetenv("LD_PRELOAD");
+	if (size == 0)
+		return;
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED)
+		memset(p, 1, size);
+}
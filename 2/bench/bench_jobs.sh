@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Background jobs at scale: the shell starts N `true &` jobs, checks
+# for zombies among its children while more jobs are started, and
+# waits for all of them with `wait`. /bin/sh running the same lines
+# is a reference. Printed are the jobs per second and the zombies
+# seen after the launches, which the shell should have reaped by
+# then. Usage:
+#
+#     bench/bench_jobs.sh [count]
+#
+# Must be run from the directory with the built main.
+
+set -e
+
+COUNT=${1:-5000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+TRUE=$(command -v true)
+[ -x "$TRUE" ] || TRUE=/bin/true
+
+# The zombies are counted by sh, a child of the shell. The sleep
+# gives the last jobs time to exit and the shell to reap them.
+ZOMBIES="sh -c 'ps --ppid \$PPID -o stat= | grep -c Z || true'"
+for I in $(seq "$COUNT"); do
+	echo "$TRUE &"
+done > "$DIR/jobs.txt"
+echo "sleep 0.2" >> "$DIR/jobs.txt"
+echo "$ZOMBIES" >> "$DIR/jobs.txt"
+echo "wait" >> "$DIR/jobs.txt"
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+echo "$COUNT background jobs"
+printf "%8s %10s %12s %8s\n" shell time_ms jobs_per_s zombies
+for SHELL_NAME in main sh; do
+	START=$(now_ms)
+	if [ $SHELL_NAME = main ]; then
+		Z=$(./main < "$DIR/jobs.txt")
+	else
+		Z=$(sh < "$DIR/jobs.txt")
+	fi
+	MS=$(($(now_ms) - START - 200))
+	printf "%8s %10d %12d %8d\n" $SHELL_NAME "$MS" \
+	       $((COUNT * 1000 / MS)) "$Z"
+done
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Launch latency of fork+exec against posix_spawn as the shell
+# grows. The shell runs `true` N times with each launcher, first
+# as is and then with bench/ballast.so preloaded, which makes its
+# RSS the given size. fork() copies the page tables of all that
+# memory, posix_spawn() does not. Printed are the shell's RSS and
+# the time per command. The time of the shell's start, with the
+# ballast touched, is measured apart and subtracted. Usage:
+#
+#     bench/bench_launch.sh [count] [ballast_mb]
+#
+# Must be run from the directory with the built main and
+# bench/ballast.so (make bench).
+
+set -e
+
+COUNT=${1:-2000}
+BALLAST=${2:-1024}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# The last command reports the RSS of the shell: the shell does
+# not expand variables, so sh looks up its parent.
+RSS_CMD="sh -c 'grep VmRSS /proc/\$PPID/status'"
+echo "$RSS_CMD" > "$DIR/empty.txt"
+for I in $(seq "$COUNT"); do
+	echo "true"
+done > "$DIR/cmds.txt"
+echo "$RSS_CMD" >> "$DIR/cmds.txt"
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+# Run the shell on a file of commands, print its RSS and time, us.
+run_shell() {
+	START=$(now_us)
+	OUT=$(LD_PRELOAD=./bench/ballast.so BALLAST_MB=$1 \
+	      ./main $2 < "$3")
+	echo "$(echo "$OUT" | grep -o '[0-9]*') $(($(now_us) - START))"
+}
+
+echo "$COUNT commands"
+printf "%8s %8s %10s %10s\n" launcher rss_mb time_ms us_per_cmd
+for MB in 0 "$BALLAST"; do
+	for MODE in spawn fork; do
+		FLAG=""
+		[ $MODE = fork ] && FLAG="--fork"
+		set -- $(run_shell "$MB" "$FLAG" "$DIR/empty.txt")
+		BASE=$2
+		set -- $(run_shell "$MB" "$FLAG" "$DIR/cmds.txt")
+		RSS=$1
+		US=$(($2 - BASE))
+		printf "%8s %8d %10d %10d\n" $MODE $((RSS / 1024)) \
+		       $((US / 1000)) $((US / COUNT))
+	done
+done
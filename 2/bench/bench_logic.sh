@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Cost of && and || chains: the shell runs N lines of each chain
+# below. In the chains with 1 process the right side can't change
+# the code and is never started, so they take half the time of the
+# ones with 2. With `sleep 1` on the right, a line which started it
+# would take a second. /bin/sh running the same lines, with the
+# paths of true and false so they are not its built-ins, is a
+# reference. Usage:
+#
+#     bench/bench_logic.sh [count]
+#
+# Must be run from the directory with the built main.
+
+set -e
+
+COUNT=${1:-2000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+TRUE=$(command -v true)
+[ -x "$TRUE" ] || TRUE=/bin/true
+FALSE=$(command -v false)
+[ -x "$FALSE" ] || FALSE=/bin/false
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+echo "$COUNT lines"
+printf "%-22s %6s %10s %10s %10s\n" line procs main_ms us_per_line sh_ms
+bench() {
+	for I in $(seq "$COUNT"); do
+		echo "$1"
+	done > "$DIR/lines.txt"
+	sed -e "s|true|$TRUE|g" -e "s|false|$FALSE|g" "$DIR/lines.txt" \
+	    > "$DIR/sh.txt"
+	START=$(now_ms)
+	./main < "$DIR/lines.txt" || true
+	MS=$(($(now_ms) - START))
+	START=$(now_ms)
+	sh < "$DIR/sh.txt" || true
+	SH_MS=$(($(now_ms) - START))
+	printf "%-22s %6d %10d %10d %10d\n" "$1" "$2" "$MS" \
+	       $((MS * 1000 / COUNT)) "$SH_MS"
+}
+
+bench "true && true" 2
+bench "false || true" 2
+bench "false && true" 1
+bench "true || true" 1
+bench "false && sleep 1" 1
+bench "true || sleep 1" 1
+bench "true || false && true" 2
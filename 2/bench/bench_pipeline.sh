@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Throughput of long pipelines: head -c from /dev/zero, 8 cats
+# and wc -c, 10 stages in total, move the given number of
+# gigabytes through the shell. The same line is run by /bin/sh
+# for a reference. Printed are the time and the rate of the data
+# through the pipeline. Usage:
+#
+#     bench/bench_pipeline.sh [gigabytes] [runs]
+#
+# Must be run from the directory with the built main.
+
+set -e
+
+GB=${1:-1}
+RUNS=${2:-3}
+LINE="head -c ${GB}G /dev/zero"
+for I in $(seq 8); do
+	LINE="$LINE | cat"
+done
+LINE="$LINE | wc -c"
+echo "10 stages, $GB GiB, $RUNS runs"
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+printf "%8s %10s %10s\n" shell time_ms mib_per_s
+for SHELL_NAME in main sh; do
+	for I in $(seq "$RUNS"); do
+		START=$(now_ms)
+		if [ $SHELL_NAME = main ]; then
+			OUT=$(echo "$LINE" | ./main)
+		else
+			OUT=$(sh -c "$LINE")
+		fi
+		MS=$(($(now_ms) - START))
+		if [ "$OUT" -ne $((GB * 1024 * 1024 * 1024)) ]; then
+			echo "wrong byte count $OUT"
+			exit 1
+		fi
+		printf "%8s %10d %10d\n" $SHELL_NAME "$MS" \
+		       $((GB * 1024 * 1000 / MS))
+	done
+done
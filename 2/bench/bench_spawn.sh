@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Commands per second: the shell runs `true` in a loop, fed as N
+# lines. The commands are started by posix_spawnp(), and with
+# --fork by fork() and exec. /bin/sh running /bin/true is a
+# reference.
+# Usage:
+#
+#     bench/bench_spawn.sh [count]
+#
+# Must be run from the directory with the built main.
+
+set -e
+
+COUNT=${1:-5000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+TRUE=$(command -v true)
+[ -x "$TRUE" ] || TRUE=/bin/true
+
+for I in $(seq "$COUNT"); do
+	echo "true"
+done > "$DIR/spawn.txt"
+for I in $(seq "$COUNT"); do
+	echo "$TRUE"
+done > "$DIR/sh.txt"
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+echo "$COUNT commands"
+printf "%8s %10s %12s\n" mode time_ms cmds_per_s
+for MODE in spawn fork sh; do
+	START=$(now_ms)
+	if [ $MODE = sh ]; then
+		sh < "$DIR/sh.txt"
+	elif [ $MODE = fork ]; then
+		./main --fork < "$DIR/spawn.txt"
+	else
+		./main < "$DIR/spawn.txt"
+	fi
+	MS=$(($(now_ms) - START))
+	printf "%8s %10d %12d\n" $MODE "$MS" $((COUNT * 1000 / MS))
+done
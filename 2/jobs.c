@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include "jobs.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum {
+	JOB_HASH_SIZE_MIN = 64,
+};
+
+static struct job_table {
+	/** Jobs by id - 1, NULL for the free ids. */
+	struct job **jobs;
+	/** One more than the highest id in use. */
+	int end;
+	int capacity;
+	/** Processes not reaped yet by pid, a power of 2 buckets. */
+	struct job_proc **buckets;
+	int bucket_count;
+	int proc_count;
+	/** Done background jobs, not taken yet. */
+	struct job *done_first;
+	struct job *done_last;
+	int sig_fd;
+	sigset_t old_mask;
+} table = {
+	.sig_fd = -1,
+};
+
+/** Exit code of a process by its waitpid() status, as in sh. */
+static int
+status_to_code(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return EXIT_FAILURE;
+}
+
+static struct job_proc **
+proc_bucket(struct job_proc **buckets, int bucket_count, pid_t pid)
+{
+	return &buckets[(uint32_t)pid & (bucket_count - 1)];
+}
+
+static void
+proc_hash_grow(void)
+{
+	int count = table.bucket_count * 2;
+	struct job_proc **buckets = calloc(count, sizeof(buckets[0]));
+	for (int i = 0; i < table.bucket_count; ++i) {
+		struct job_proc *p = table.buckets[i];
+		while (p != NULL) {
+			struct job_proc *next = p->hash_next;
+			struct job_proc **b = proc_bucket(buckets, count, p->pid);
+			p->hash_next = *b;
+			*b = p;
+			p = next;
+		}
+	}
+	free(table.buckets);
+	table.buckets = buckets;
+	table.bucket_count = count;
+}
+
+static void
+proc_hash_insert(struct job_proc *p)
+{
+	if (table.proc_count >= table.bucket_count)
+		proc_hash_grow();
+	struct job_proc **b = proc_bucket(table.buckets, table.bucket_count,
+					  p->pid);
+	p->hash_next = *b;
+	*b = p;
+	++table.proc_count;
+}
+
+static struct job_proc *
+proc_hash_find(pid_t pid)
+{
+	struct job_proc *p = *proc_bucket(table.buckets, table.bucket_count,
+					  pid);
+	while (p != NULL && p->pid != pid)
+		p = p->hash_next;
+	return p;
+}
+
+static void
+proc_hash_remove(struct job_proc *p)
+{
+	struct job_proc **link = proc_bucket(table.buckets, table.bucket_count,
+					     p->pid);
+	while (*link != p)
+		link = &(*link)->hash_next;
+	*link = p->hash_next;
+	--table.proc_count;
+}
+
+static void
+done_list_push(struct job *job)
+{
+	job->done_prev = table.done_last;
+	job->done_next = NULL;
+	if (table.done_last == NULL)
+		table.done_first = job;
+	else
+		table.done_last->done_next = job;
+	table.done_last = job;
+	job->is_in_done_list = true;
+}
+
+static void
+done_list_remove(struct job *job)
+{
+	if (job->done_prev == NULL)
+		table.done_first = job->done_next;
+	else
+		job->done_prev->done_next = job->done_next;
+	if (job->done_next == NULL)
+		table.done_last = job->done_prev;
+	else
+		job->done_next->done_prev = job->done_prev;
+	job->is_in_done_list = false;
+}
+
+/** The last process of the job is reaped. */
+static void
+job_set_done(struct job *job)
+{
+	job->state = JOB_DONE;
+	if (job->is_background)
+		done_list_push(job);
+}
+
+static void
+job_free(struct job *job)
+{
+	free(job->procs);
+	free(job->text);
+	free(job);
+}
+
+int
+job_table_create(void)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, &table.old_mask) != 0)
+		return -1;
+	table.sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (table.sig_fd < 0) {
+		sigprocmask(SIG_SETMASK, &table.old_mask, NULL);
+		return -1;
+	}
+	table.jobs = NULL;
+	table.end = 0;
+	table.capacity = 0;
+	table.bucket_count = JOB_HASH_SIZE_MIN;
+	table.buckets = calloc(table.bucket_count, sizeof(table.buckets[0]));
+	table.proc_count = 0;
+	table.done_first = NULL;
+	table.done_last = NULL;
+	return 0;
+}
+
+void
+job_table_clear(void)
+{
+	for (int i = 0; i < table.end; ++i) {
+		if (table.jobs[i] != NULL)
+			job_free(table.jobs[i]);
+		table.jobs[i] = NULL;
+	}
+	table.end = 0;
+	memset(table.buckets, 0, table.bucket_count * sizeof(table.buckets[0]));
+	table.proc_count = 0;
+	table.done_first = NULL;
+	table.done_last = NULL;
+}
+
+void
+job_table_destroy(void)
+{
+	job_table_clear();
+	free(table.jobs);
+	free(table.buckets);
+	close(table.sig_fd);
+	table.sig_fd = -1;
+	sigprocmask(SIG_SETMASK, &table.old_mask, NULL);
+}
+
+int
+job_table_fd(void)
+{
+	return table.sig_fd;
+}
+
+void
+job_table_reap(void)
+{
+	/* The signals only say to look, waitpid() tells who. */
+	struct signalfd_siginfo info;
+	while (read(table.sig_fd, &info, sizeof(info)) == sizeof(info))
+		;
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status,
+			      WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+		struct job_proc *p = proc_hash_find(pid);
+		if (p == NULL)
+			continue;
+		struct job *job = p->job;
+		if (WIFSTOPPED(status)) {
+			job->state = JOB_STOPPED;
+			job->code = 128 + WSTOPSIG(status);
+			continue;
+		}
+		if (WIFCONTINUED(status)) {
+			job->state = JOB_RUNNING;
+			continue;
+		}
+		proc_hash_remove(p);
+		p->is_done = true;
+		if (pid == job->last_pid)
+			job->code = status_to_code(status);
+		if (--job->alive_count == 0)
+			job_set_done(job);
+	}
+}
+
+int
+job_table_end(void)
+{
+	return table.end + 1;
+}
+
+struct job *
+job_table_pop_done(void)
+{
+	struct job *job = table.done_first;
+	if (job != NULL)
+		done_list_remove(job);
+	return job;
+}
+
+struct job *
+job_new(const char *text, int proc_capacity, bool is_background)
+{
+	if (table.end == table.capacity) {
+		table.capacity = (table.capacity + 1) * 2;
+		table.jobs = realloc(table.jobs,
+				     table.capacity * sizeof(table.jobs[0]));
+	}
+	struct job *job = malloc(sizeof(*job));
+	job->id = table.end + 1;
+	job->pgid = 0;
+	job->procs = malloc(proc_capacity * sizeof(job->procs[0]));
+	job->proc_count = 0;
+	job->proc_capacity = proc_capacity;
+	/* Is not done before job_finish(), even with no processes. */
+	job->alive_count = 1;
+	job->last_pid = -1;
+	job->code = 0;
+	job->state = JOB_RUNNING;
+	job->is_background = is_background;
+	job->text = strdup(text);
+	job->done_prev = NULL;
+	job->done_next = NULL;
+	job->is_in_done_list = false;
+	table.jobs[table.end++] = job;
+	return job;
+}
+
+void
+job_delete(struct job *job)
+{
+	for (int i = 0; i < job->proc_count; ++i) {
+		if (! job->procs[i].is_done)
+			proc_hash_remove(&job->procs[i]);
+	}
+	if (job->is_in_done_list)
+		done_list_remove(job);
+	table.jobs[job->id - 1] = NULL;
+	while (table.end > 0 && table.jobs[table.end - 1] == NULL)
+		--table.end;
+	job_free(job);
+}
+
+void
+job_add_proc(struct job *job, pid_t pid, bool is_last)
+{
+	assert(job->proc_count < job->proc_capacity);
+	struct job_proc *p = &job->procs[job->proc_count++];
+	p->pid = pid;
+	p->job = job;
+	p->is_done = false;
+	proc_hash_insert(p);
+	++job->alive_count;
+	if (job->pgid == 0)
+		job->pgid = pid;
+	if (is_last)
+		job->last_pid = pid;
+}
+
+void
+job_finish(struct job *job, int code)
+{
+	if (job->last_pid == -1)
+		job->code = code;
+	if (--job->alive_count == 0)
+		job_set_done(job);
+}
+
+struct job *
+job_by_id(int id)
+{
+	if (id < 1 || id > table.end)
+		return NULL;
+	return table.jobs[id - 1];
+}
+
+struct job *
+job_by_pid(pid_t pid)
+{
+	struct job_proc *p = proc_hash_find(pid);
+	return p != NULL ? p->job : NULL;
+}
+
+int
+job_wait(struct job *job)
+{
+	struct pollfd pfd;
+	pfd.fd = table.sig_fd;
+	pfd.events = POLLIN;
+	while (true) {
+		job_table_reap();
+		if (job->state != JOB_RUNNING)
+			break;
+		/* SIGCHLD is blocked, so an exit before poll() is not lost. */
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+	}
+	return job->code;
+}
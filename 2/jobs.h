@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Table of the shell's jobs: each running pipeline, or subshell,
+ * with its process group and processes. Children are reaped from a
+ * signalfd of SIGCHLD, which is blocked in the shell for that, with
+ * waitpid(-1, WNOHANG). A reaped pid is found by a hash, so there is
+ * no scan over the jobs or their processes. The table is one per
+ * process.
+ */
+
+enum job_state {
+	JOB_RUNNING,
+	JOB_STOPPED,
+	/** All the processes are reaped. */
+	JOB_DONE,
+};
+
+struct job;
+
+struct job_proc {
+	pid_t pid;
+	struct job *job;
+	/** Next process in the same hash bucket. */
+	struct job_proc *hash_next;
+	bool is_done;
+};
+
+struct job {
+	/** Number of the job, shown by jobs and taken by fg and wait. */
+	int id;
+	/** Process group, 0 until the first process is added. */
+	pid_t pgid;
+	struct job_proc *procs;
+	int proc_count;
+	int proc_capacity;
+	/** Processes not reaped yet, plus 1 until job_finish(). */
+	int alive_count;
+	/** The exit code of the job is the one of this process. */
+	pid_t last_pid;
+	/**
+	 * Exit code when the job is done, 128 + the signal when it is
+	 * stopped.
+	 */
+	int code;
+	enum job_state state;
+	bool is_background;
+	/** Command line, for jobs and fg. */
+	char *text;
+	/** Links in the list of done background jobs. */
+	struct job *done_prev;
+	struct job *done_next;
+	bool is_in_done_list;
+};
+
+/**
+ * Block SIGCHLD and open the signalfd to reap by.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+job_table_create(void);
+
+/** Delete all the jobs and close the signalfd. */
+void
+job_table_destroy(void);
+
+/**
+ * Forget all the jobs, without reaping them. For a forked
+ * subshell, whose table is a copy of the parent's one.
+ */
+void
+job_table_clear(void);
+
+/** The signalfd, readable when some children may be reaped. */
+int
+job_table_fd(void);
+
+/**
+ * Reap all the children which have exited or stopped, without
+ * blocking, and update their jobs.
+ */
+void
+job_table_reap(void);
+
+/** One more than the highest job id in use. */
+int
+job_table_end(void);
+
+/**
+ * Take the next background job which is done, in the order they
+ * finished, or NULL. The job stays in the table.
+ */
+struct job *
+job_table_pop_done(void);
+
+/**
+ * Create a job for up to @a proc_capacity processes. It is given the
+ * id after the highest one in use, and is running until its
+ * processes are reaped and job_finish() is called.
+ */
+struct job *
+job_new(const char *text, int proc_capacity, bool is_background);
+
+/**
+ * Remove the job from the table and free it. Its processes which are
+ * still alive are not reaped after that.
+ */
+void
+job_delete(struct job *job);
+
+/**
+ * Add a started process to the job. The first one is the leader of
+ * the process group of the job.
+ */
+void
+job_add_proc(struct job *job, pid_t pid, bool is_last);
+
+/**
+ * Call when all the processes are added. @a code is the exit code of
+ * the job if its last stage has no process. A job without processes
+ * is done right away.
+ */
+void
+job_finish(struct job *job, int code);
+
+/** Job by its id, or NULL. */
+struct job *
+job_by_id(int id);
+
+/** Job which has a process @a pid not reaped yet, or NULL. */
+struct job *
+job_by_pid(pid_t pid);
+
+/** Block until the job is done or stopped. Returns its code. */
+int
+job_wait(struct job *job);
@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+# Tests of && and || in the shell, in the style of section 5 of
+# tests.txt: the output of each line, the exit code of the shell,
+# and that the commands which can't change the result are never
+# started. Usage:
+#
+#     ./logic_test.sh [shell]
+#
+# The shell is ./main by default.
+
+SHELL_BIN=$(realpath "${1:-./main}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+FAILED=0
+NL='
+'
+
+# check "lines" "expected stdout" [expected exit code]
+check() {
+	OUT=$(printf '%s\n' "$1" | (cd "$DIR" && "$SHELL_BIN" 2>/dev/null))
+	CODE=$?
+	if [ "$OUT" != "$2" ] || [ "$CODE" != "${3:-0}" ]; then
+		echo "FAIL: $1"
+		echo "  expected code ${3:-0}, output: $2"
+		echo "  got code $CODE, output: $OUT"
+		FAILED=$((FAILED + 1))
+	fi
+}
+
+# check_error "lines" "expected stderr"
+check_error() {
+	ERR=$(printf '%s\n' "$1" | (cd "$DIR" && "$SHELL_BIN" 2>&1 >/dev/null))
+	if [ "$ERR" != "$2" ]; then
+		echo "FAIL: $1"
+		echo "  expected stderr: $2"
+		echo "  got stderr: $ERR"
+		FAILED=$((FAILED + 1))
+	fi
+}
+
+# check_file "lines" "file" yes|no
+check_file() {
+	rm -f "$DIR/$2"
+	printf '%s\n' "$1" | (cd "$DIR" && "$SHELL_BIN" >/dev/null 2>&1)
+	if [ -e "$DIR/$2" ]; then IS=yes; else IS=no; fi
+	if [ $IS != "$3" ]; then
+		echo "FAIL: $1"
+		echo "  $2 expected to exist: $3"
+		FAILED=$((FAILED + 1))
+	fi
+}
+
+# The cases of tests.txt.
+check "false && echo 123" "" 1
+check "true && echo 123" "123"
+check "true || false && echo 123" "123"
+check "true || false || true && echo 123" "123"
+check "false || echo 123" "123"
+check "echo 100 || echo 200" "100"
+check "echo 100 && echo 200" "100${NL}200"
+check "echo 100 | grep 1 || echo 200 | grep 2" "100"
+check "echo 100 | grep 1 && echo 200 | grep 2" "100${NL}200"
+
+# Left to right, a skipped pipeline keeps the code.
+check "false && echo a || echo b" "b"
+check "true || echo a && echo b" "b"
+check "false && echo a && echo b || echo c" "c"
+check "echo 1 | grep 2 || echo none" "none"
+check "false || false" "" 1
+check "false && true" "" 1
+check "true || false" "" 0
+check "true && false" "" 1
+check "echo x | exit 3" "" 3
+check "exit 3 | echo x" "x" 0
+
+# The shell exits with the code of the last line, exit without a
+# code too.
+check "false${NL}true" "" 0
+check "true${NL}false" "" 1
+check "false${NL}exit" "" 1
+check "exit 7 || echo no" "" 7
+check "false || exit 5${NL}echo no" "" 5
+check "true || exit 5${NL}echo yes" "yes" 0
+check "cd /nonexistent || echo failed" "failed"
+check "cd / && pwd" "/"
+
+# A missing command fails with 127 and is named, whatever the
+# launcher.
+check "no_such_command || echo failed" "failed"
+check "no_such_command" "" 127
+check "echo a | no_such_command" "" 127
+check_error "no_such_command" "no_such_command: command not found"
+check_error "echo a | no_such_command && echo b" \
+	"no_such_command: command not found"
+
+# The output file is of the last command of the line.
+check "false || echo x > out.txt${NL}cat out.txt" "x"
+
+# What can't change the result is not started.
+check_file "true || touch skipped" skipped no
+check_file "false && touch skipped" skipped no
+check_file "false && touch skipped | cat" skipped no
+check_file "true || false || touch skipped && true" skipped no
+check_file "false || touch made" made yes
+check_file "false && true || touch made" made yes
+check_file "false && touch skipped &${NL}wait" skipped no
+check_file "false || touch made &${NL}wait" made yes
+
+if [ $FAILED -ne 0 ]; then
+	echo "$FAILED failed"
+	exit 1
+fi
+echo "The tests passed"
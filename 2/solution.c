@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include "jobs.h"
 #include "parser.h"
 
 #include <assert.h>
@@ -9,182 +11,709 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
 
-struct pipes {
-    bool is_input_pipe;
-    bool is_output_pipe;
-    int input_fd;
-    int output_fd;
+extern char **environ;
+
+/** How the processes of the commands are started. */
+enum launcher {
+    /**
+     * posix_spawnp() with the pipes and the redirection as file
+     * actions. The shell's address space is never copied.
+     */
+    LAUNCHER_SPAWN,
+    /** fork() and exec, the child wires its descriptors itself. */
+    LAUNCHER_FORK,
 };
 
-char** add_cmd_name_to_args(const struct command *cmd) {
+static enum launcher launcher = LAUNCHER_SPAWN;
+
+/**
+ * The shell reads a terminal: it controls the terminal's foreground
+ * process group and reports the state of the jobs.
+ */
+static bool is_interactive = false;
+static pid_t shell_pgid;
+/** A forked copy of the shell running a background line. */
+static bool is_subshell = false;
+/** Exit code of the last command line, the shell's own in the end. */
+static int last_code = EXIT_SUCCESS;
+/** exit was run, the shell stops after the current pipeline. */
+static bool is_exiting = false;
+
+/**
+ * argv for exec of the command. The strings are the command's own,
+ * only the array has to be freed.
+ */
+static char** add_cmd_name_to_args(const struct command *cmd) {
     char **temp = malloc(sizeof(char*) * (cmd->arg_count + 2));
-    temp[0] = strdup(cmd->exe);
+    temp[0] = cmd->exe;
 
     for (uint32_t i = 0; i < cmd->arg_count; ++i)
     {
-        temp[i + 1] = strdup(cmd->args[i]);
+        temp[i + 1] = cmd->args[i];
     }
     temp[cmd->arg_count + 1] = NULL;
 
     return temp;
 }
 
-static void execute_cd(const struct command *cmd) {
+static bool is_builtin(const struct command *cmd) {
+    return strcmp(cmd->exe, "cd") == 0 || strcmp(cmd->exe, "exit") == 0 ||
+           strcmp(cmd->exe, "jobs") == 0 || strcmp(cmd->exe, "wait") == 0 ||
+           strcmp(cmd->exe, "fg") == 0;
+}
+
+/**
+ * Exit code of a built-in run as a pipeline stage. It acts on the
+ * stage only: exit gives its code, the others do nothing.
+ */
+static int builtin_stage_code(const struct command *cmd) {
+    if (strcmp(cmd->exe, "exit") == 0 && cmd->arg_count > 0) {
+        return atoi(cmd->args[0]);
+    }
+    return EXIT_SUCCESS;
+}
+
+static int execute_cd(const struct command *cmd) {
     assert(cmd != NULL);
     assert(cmd->exe != NULL);
 
-    if (strcmp(cmd->exe, "cd") == 0) {
-        if (cmd->arg_count == 1) {
-            if (chdir(cmd->args[0]) == 0) {
-                printf("Changed directory to: %s\n", cmd->args[0]);
-            } else {
-                perror("chdir");
-                exit(EXIT_FAILURE);
-            }
-        } else if (cmd->arg_count > 1) {
-            fprintf(stderr, "cd: too many arguments\n");
-        } else {
-            if (chdir(getenv("HOME")) == 0) {
-                printf("Changed directory to home\n");
-            } else {
-                perror("chdir");
-                exit(EXIT_FAILURE);
-            }
-        }
+    if (cmd->arg_count > 1) {
+        fprintf(stderr, "cd: too many arguments\n");
+        return EXIT_FAILURE;
+    }
+    const char *dir = cmd->arg_count == 1 ? cmd->args[0] : getenv("HOME");
+    if (dir == NULL || chdir(dir) != 0) {
+        perror("chdir");
+        return EXIT_FAILURE;
     }
+    return EXIT_SUCCESS;
 }
 
-static void execute_exit(const struct command *cmd) {
+/**
+ * Leave the shell with the given code, or with the code of the last
+ * command line if there is none. The shell stops after this pipeline
+ * and frees everything on the way out, a subshell leaves right away.
+ */
+static int execute_exit(const struct command *cmd) {
     assert(cmd != NULL);
     assert(cmd->exe != NULL);
 
-    if (strcmp(cmd->exe, "exit") == 0) {
-        if (cmd->arg_count > 1) {
-            fprintf(stderr, "exit: too many arguments\n");
+    if (cmd->arg_count > 1) {
+        fprintf(stderr, "exit: too many arguments\n");
+        return EXIT_FAILURE;
+    }
+    int code = cmd->arg_count == 1 ? atoi(cmd->args[0]) : last_code;
+    if (is_subshell) {
+        _exit(code);
+    }
+    is_exiting = true;
+    return code;
+}
+
+/**
+ * Report that the command could not be run, exec or spawn failed
+ * with err. Returns the code of the stage, the same for both
+ * launchers: 127 if there is no such command, 126 otherwise.
+ */
+static int exec_error(const char *exe, int err) {
+    if (err == ENOENT) {
+        fprintf(stderr, "%s: command not found\n", exe);
+        return 127;
+    }
+    fprintf(stderr, "%s: %s\n", exe, strerror(err));
+    return 126;
+}
+
+/**
+ * Replace the current process with the command. A built-in just
+ * leaves with its code. Does not return.
+ */
+static void exec_command(const struct command *cmd) {
+    if (is_builtin(cmd)) {
+        _exit(builtin_stage_code(cmd));
+    }
+    char** args = add_cmd_name_to_args(cmd);
+    execvp(cmd->exe, args);
+    _exit(exec_error(cmd->exe, errno));
+}
+
+/**
+ * Signals which an interactive shell ignores. The children get the
+ * default handlers back.
+ */
+static const int job_control_signals[] = {
+    SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU,
+};
+
+static void set_job_control_signals(void (*handler)(int)) {
+    size_t count = sizeof(job_control_signals) / sizeof(job_control_signals[0]);
+    for (size_t i = 0; i < count; ++i) {
+        signal(job_control_signals[i], handler);
+    }
+}
+
+/**
+ * Process group for the next process of the job: -1 to stay in the
+ * shell's one, 0 to make a new one. Background jobs have their own
+ * groups, foreground ones too if the shell controls the terminal.
+ */
+static pid_t job_next_pgid(const struct job *job) {
+    if (!job->is_background && !is_interactive) {
+        return -1;
+    }
+    return job->pgid;
+}
+
+/**
+ * Body of a forked pipeline stage: take stdin from lastfd, send
+ * stdout to outfd, or to the output file of the line if the stage
+ * is the last command of the line. Does not return.
+ */
+static void execute_stage(const struct expr *e, int lastfd, int outfd,
+                          const struct command_line *line) {
+    if (lastfd != -1) {
+        dup2(lastfd, STDIN_FILENO);
+        close(lastfd);
+    }
+    if (outfd == -1 && e->next == NULL) {
+        if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
+            outfd = open(line->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        } else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
+            outfd = open(line->out_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
         } else {
-            printf("Exiting the program\n");
-            exit(EXIT_SUCCESS);
+            outfd = STDOUT_FILENO;
         }
+        if (outfd == -1) {
+            perror("open");
+            _exit(EXIT_FAILURE);
+        }
+    }
+    if (outfd != -1 && outfd != STDOUT_FILENO) {
+        dup2(outfd, STDOUT_FILENO);
+        close(outfd);
     }
+    exec_command(&e->cmd);
 }
 
-static void execute_command(const struct command *cmd) {
-    pid_t pid = fork();
+/**
+ * Start a pipeline stage with posix_spawnp(). The descriptors are
+ * wired as in execute_stage(), but by file actions, which run in
+ * the new process between its vfork-like clone and the exec. The
+ * pipes are close-on-exec, so only their dup2() copies are left.
+ * Returns the pid, or -1 with errno set, nothing is reported.
+ */
+static pid_t spawn_stage(const struct expr *e, int lastfd, int outfd,
+                         const struct command_line *line, pid_t pgid,
+                         bool take_terminal) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (take_terminal) {
+        /*
+         * Before stdin is replaced. The child runs it with all the
+         * signals blocked, so SIGTTOU does not stop it.
+         */
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+    if (lastfd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, lastfd, STDIN_FILENO);
+    }
+    if (outfd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    } else if (e->next == NULL && line->out_type != OUTPUT_TYPE_STDOUT) {
+        int flags = O_WRONLY | O_CREAT;
+        flags |= line->out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+                                         line->out_file, flags, 0644);
+    }
+    /*
+     * The child gets no signals blocked, whatever the shell blocks,
+     * and the default handlers of the ones it ignores.
+     */
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    size_t count = sizeof(job_control_signals) / sizeof(job_control_signals[0]);
+    for (size_t i = 0; i < count; ++i) {
+        sigaddset(&mask, job_control_signals[i]);
+    }
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (pgid != -1) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
 
+    char** args = add_cmd_name_to_args(&e->cmd);
+    pid_t pid;
+    int rc = posix_spawnp(&pid, e->cmd.exe, &actions, &attr, args, environ);
+    free(args);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return pid;
+}
+
+static pid_t fork_stage(const struct expr *e, int lastfd, int outfd,
+                        const struct command_line *line, pid_t pgid,
+                        bool take_terminal) {
+    pid_t pid = fork();
     if (pid == -1) {
         perror("fork");
-        exit(EXIT_FAILURE);
     } else if (pid == 0) {
-        if (cmd->exe == NULL) {
-            fprintf(stderr, "execute_command_updated: missing executable name\n");
-            exit(EXIT_FAILURE);
+        if (pgid != -1) {
+            setpgid(0, pgid);
         }
-
-        char** args = add_cmd_name_to_args(cmd);
-
-        if (execvp(cmd->exe, args) == -1) {
-            perror("execvp");
-            exit(EXIT_FAILURE);
+        /* While SIGTTOU is still ignored. */
+        if (take_terminal) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
         }
-        exit(EXIT_SUCCESS);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        set_job_control_signals(SIG_DFL);
+        execute_stage(e, lastfd, outfd, line);
+    } else if (pgid != -1) {
+        /* Both sides, to be in the group whoever runs first. */
+        setpgid(pid, pgid == 0 ? pid : pgid);
+    }
+    return pid;
+}
+
+/**
+ * Start a pipeline stage of the job by the current launcher. Returns
+ * its pid, or -1 if there is no process, with *code set to the exit
+ * code of the stage. The spawn launcher runs no process for a
+ * built-in. A stage of a foreground job takes the terminal itself,
+ * as wait_foreground() hands it over only after the last stage is
+ * started, and the stages may read it before.
+ */
+static pid_t launch_stage(const struct expr *e, int lastfd, int outfd,
+                          const struct command_line *line,
+                          const struct job *job, int *code) {
+    pid_t pid;
+    bool take_terminal = is_interactive && !job->is_background;
+    if (launcher == LAUNCHER_FORK) {
+        pid = fork_stage(e, lastfd, outfd, line, job_next_pgid(job),
+                         take_terminal);
+    } else if (is_builtin(&e->cmd)) {
+        *code = builtin_stage_code(&e->cmd);
+        return -1;
     } else {
-        int status;
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid");
-            exit(EXIT_FAILURE);
+        pid = spawn_stage(e, lastfd, outfd, line, job_next_pgid(job),
+                          take_terminal);
+        if (pid == -1) {
+            *code = exec_error(e->cmd.exe, errno);
         }
+        return pid;
     }
+    if (pid == -1) {
+        *code = EXIT_FAILURE;
+    }
+    return pid;
 }
 
-void execute_single_command(const struct expr *e, int lastfd, int pipefd[], const struct command_line *line) {
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("FORK");
-        exit(EXIT_FAILURE);
+static int pipeline_length(const struct expr *e) {
+    int count = 1;
+    for (const struct expr *it = e->next; it != NULL &&
+         it->type == EXPR_TYPE_PIPE; it = it->next->next) {
+        ++count;
     }
-    else if (pid == 0) {
-        if (lastfd != -1) {
-            dup2(lastfd, STDIN_FILENO);
-            close(lastfd);
+    return count;
+}
+
+static size_t command_text_append(char *text, size_t size,
+                                  const char *str) {
+    size_t len = strlen(str);
+    if (text != NULL) {
+        if (size > 0) {
+            text[size] = ' ';
+        }
+        memcpy(text + size + (size > 0), str, len + 1);
+    }
+    return size + (size > 0) + len;
+}
+
+/**
+ * Text of the commands from e to end, for jobs and fg. Returns its
+ * length and fills text if it is not NULL.
+ */
+static size_t command_text(const struct expr *e, const struct expr *end,
+                           bool is_background, char *text) {
+    static const char *separators[] = {
+        [EXPR_TYPE_PIPE] = "|", [EXPR_TYPE_AND] = "&&", [EXPR_TYPE_OR] = "||",
+    };
+    size_t size = 0;
+    if (text != NULL) {
+        text[0] = 0;
+    }
+    for (; e != end; e = e->next) {
+        if (e->type != EXPR_TYPE_COMMAND) {
+            size = command_text_append(text, size, separators[e->type]);
+            continue;
         }
+        size = command_text_append(text, size, e->cmd.exe);
+        for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+            size = command_text_append(text, size, e->cmd.args[i]);
+        }
+    }
+    if (is_background) {
+        size = command_text_append(text, size, "&");
+    }
+    return size;
+}
 
-        int outfd = STDOUT_FILENO;
-        if (e->next == NULL || e->next->type != EXPR_TYPE_PIPE) {
-            if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-                outfd = open(line->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            }
-            else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-                outfd = open(line->out_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            }
-            if (outfd == -1) {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-            dup2(outfd, STDOUT_FILENO);
-            if (outfd != STDOUT_FILENO) {
-                close(outfd);
-            }
+static char *command_text_new(const struct expr *e, const struct expr *end,
+                              bool is_background) {
+    char *text = malloc(command_text(e, end, is_background, NULL) + 1);
+    command_text(e, end, is_background, text);
+    return text;
+}
+
+/**
+ * Start the pipeline which starts at e as a new job: all its stages
+ * are started up front with the pipes between them and run
+ * concurrently. A stage never waits for the next one to be started,
+ * so a full pipe can't block the line. *next is set to the
+ * expression after the pipeline.
+ */
+static struct job *start_pipeline(const struct expr *e,
+                                  const struct command_line *line,
+                                  bool is_background,
+                                  const struct expr **next) {
+    int count = pipeline_length(e);
+    const struct expr *end = e;
+    for (int i = 1; i < count; ++i) {
+        end = end->next->next;
+    }
+    end = end->next;
+    char *text = command_text_new(e, end, is_background);
+    struct job *job = job_new(text, count, is_background);
+    free(text);
+
+    int lastfd = -1;
+    int code = EXIT_FAILURE;
+    for (int i = 0; i < count; ++i) {
+        bool is_last = i == count - 1;
+        int pipefd[2] = {-1, -1};
+        if (!is_last && pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("pipe");
+            break;
+        }
+        pid_t pid = launch_stage(e, lastfd, pipefd[1], line, job, &code);
+        if (pid != -1) {
+            job_add_proc(job, pid, is_last);
         }
-        execute_command(&e->cmd);
-    } else {
         if (lastfd != -1) {
             close(lastfd);
         }
-        if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-            lastfd = pipefd[0];
+        lastfd = pipefd[0];
+        if (!is_last) {
             close(pipefd[1]);
-        }
-        else {
-            lastfd = -1;
-        }
-        int status;
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid");
-            exit(EXIT_FAILURE);
+            e = e->next->next;
         }
     }
+    if (lastfd != -1) {
+        close(lastfd);
+    }
+    job_finish(job, code);
+    *next = end;
+    return job;
 }
 
-static void execute_command_line(const struct command_line *line) {
-    assert(line != NULL);
+/**
+ * Wait for a job in the foreground, giving it the terminal. A job
+ * which is done is deleted, a stopped one is left as a background
+ * job. Returns the code of the job.
+ */
+static int wait_foreground(struct job *job) {
+    if (is_interactive && job->pgid != 0) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    int code = job_wait(job);
+    if (is_interactive) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+    if (job->state == JOB_STOPPED) {
+        job->is_background = true;
+        fprintf(stderr, "\n[%d]+  Stopped  %s\n", job->id, job->text);
+    } else {
+        job_delete(job);
+    }
+    return code;
+}
+
+static int execute_builtin(const struct command *cmd);
+
+/**
+ * Run the pipeline which starts at e in the foreground. A lone
+ * built-in runs in the shell itself. *next is set to the expression
+ * after the pipeline. Returns the exit code of its last stage.
+ */
+static int execute_pipeline(const struct expr *e,
+                            const struct command_line *line,
+                            const struct expr **next) {
+    if (pipeline_length(e) == 1 && is_builtin(&e->cmd)) {
+        *next = e->next;
+        return execute_builtin(&e->cmd);
+    }
+    return wait_foreground(start_pipeline(e, line, false, next));
+}
+
+/** Skip the pipeline which starts at e, return the expr after it. */
+static const struct expr *skip_pipeline(const struct expr *e) {
+    for (int i = pipeline_length(e); i > 1; --i) {
+        e = e->next->next;
+    }
+    return e->next;
+}
+
+/**
+ * Run the pipelines of the line one by one. && and || are of the
+ * same priority and are taken from left to right: the pipeline after
+ * && runs only if the code so far is 0, the one after || only if it
+ * is not, and a skipped pipeline keeps the code. So nothing is
+ * started for the pipelines which can't change the result. Returns
+ * the code of the last pipeline run.
+ */
+static int execute_line_foreground(const struct command_line *line) {
     const struct expr *e = line->head;
-    int pipefd[2], lastfd = -1;
+    int code = execute_pipeline(e, line, &e);
+    while (e != NULL && !is_exiting) {
+        bool is_needed = e->type == EXPR_TYPE_AND ? code == EXIT_SUCCESS :
+                         code != EXIT_SUCCESS;
+        if (is_needed) {
+            code = execute_pipeline(e->next, line, &e);
+        } else {
+            e = skip_pipeline(e->next);
+        }
+    }
+    return code;
+}
 
-    if (e != NULL && e->type == EXPR_TYPE_COMMAND &&
-        strcmp(e->cmd.exe, "cd") == 0 && e->next == NULL) {
-        execute_cd(&e->cmd);
-        return;
+/**
+ * Run a background line of several pipelines in a forked copy of
+ * the shell, which is one job.
+ */
+static void start_subshell(const struct command_line *line) {
+    char *text = command_text_new(line->head, NULL, true);
+    struct job *job = job_new(text, 1, true);
+    free(text);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+    } else if (pid == 0) {
+        setpgid(0, 0);
+        set_job_control_signals(SIG_DFL);
+        is_interactive = false;
+        is_subshell = true;
+        job_table_clear();
+        _exit(execute_line_foreground(line));
+    } else {
+        setpgid(pid, pid);
+        job_add_proc(job, pid, true);
     }
+    job_finish(job, EXIT_FAILURE);
+}
 
-    if (e != NULL && e->type == EXPR_TYPE_COMMAND &&
-        strcmp(e->cmd.exe, "exit") == 0 && e->next == NULL) {
-        execute_exit(&e->cmd);
-        return;
+static const char *job_state_name(const struct job *job) {
+    switch (job->state) {
+    case JOB_RUNNING:
+        return "Running";
+    case JOB_STOPPED:
+        return "Stopped";
+    default:
+        return "Done";
+    }
+}
+
+/** Background job by "%N", "N" or the current one with no spec. */
+static struct job *find_job(const struct command *cmd, const char *name) {
+    struct job *job;
+    if (cmd->arg_count == 0) {
+        job = job_by_id(job_table_end() - 1);
+    } else {
+        const char *spec = cmd->args[0];
+        job = job_by_id(atoi(spec[0] == '%' ? spec + 1 : spec));
+    }
+    if (job == NULL || !job->is_background) {
+        fprintf(stderr, "%s: no such job\n", name);
+        return NULL;
+    }
+    return job;
+}
+
+/** List the background jobs. The done ones are forgotten then. */
+static void execute_jobs(void) {
+    job_table_reap();
+    int end = job_table_end();
+    for (int id = 1; id < end; ++id) {
+        struct job *job = job_by_id(id);
+        if (job == NULL || !job->is_background) {
+            continue;
+        }
+        printf("[%d]%c  %-8s %s\n", id, id == end - 1 ? '+' : ' ',
+               job_state_name(job), job->text);
+        if (job->state == JOB_DONE) {
+            job_delete(job);
+        }
     }
+    fflush(stdout);
+}
 
-    while (e != NULL) {
-        if (e->type == EXPR_TYPE_COMMAND) {
-            if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-                if (pipe(pipefd) == -1) {
-                    perror("pipe");
-                    exit(EXIT_FAILURE);
-                }
+/**
+ * Wait for the given jobs, "%N" or a pid each, or for all of them
+ * with no arguments. Returns the code of the last one given.
+ */
+static int execute_wait(const struct command *cmd) {
+    if (cmd->arg_count == 0) {
+        int end = job_table_end();
+        for (int id = 1; id < end; ++id) {
+            struct job *job = job_by_id(id);
+            if (job != NULL && job->is_background) {
+                job_wait(job);
             }
+        }
+        return EXIT_SUCCESS;
+    }
+    int code = EXIT_SUCCESS;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+        const char *spec = cmd->args[i];
+        struct job *job = spec[0] == '%' ? job_by_id(atoi(spec + 1)) :
+                          job_by_pid(atoi(spec));
+        if (job == NULL || !job->is_background) {
+            fprintf(stderr, "wait: %s: no such job\n", spec);
+            code = 127;
+            continue;
+        }
+        code = job_wait(job);
+        if (job->state == JOB_DONE) {
+            job_delete(job);
+        }
+    }
+    return code;
+}
+
+/** Continue a background job in the foreground and wait for it. */
+static int execute_fg(const struct command *cmd) {
+    struct job *job = find_job(cmd, "fg");
+    if (job == NULL) {
+        return EXIT_FAILURE;
+    }
+    printf("%s\n", job->text);
+    fflush(stdout);
+    job->is_background = false;
+    if (job->state == JOB_STOPPED) {
+        kill(-job->pgid, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    return wait_foreground(job);
+}
+
+/** Run a built-in in the shell. Returns its exit code. */
+static int execute_builtin(const struct command *cmd) {
+    if (strcmp(cmd->exe, "cd") == 0) {
+        return execute_cd(cmd);
+    }
+    if (strcmp(cmd->exe, "exit") == 0) {
+        return execute_exit(cmd);
+    }
+    if (strcmp(cmd->exe, "jobs") == 0) {
+        execute_jobs();
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(cmd->exe, "wait") == 0) {
+        return execute_wait(cmd);
+    }
+    assert(strcmp(cmd->exe, "fg") == 0);
+    return execute_fg(cmd);
+}
 
-            execute_single_command(e, lastfd, pipefd, line);
+/** Forget the finished background jobs, report them if interactive. */
+static void report_done_jobs(void) {
+    job_table_reap();
+    struct job *job;
+    while ((job = job_table_pop_done()) != NULL) {
+        if (is_interactive) {
+            fprintf(stderr, "[%d]   Done     %s\n", job->id, job->text);
         }
+        job_delete(job);
+    }
+}
+
+/** Run the line, set last_code. */
+static void execute_command_line(const struct command_line *line) {
+    assert(line != NULL);
+    const struct expr *e = line->head;
 
-        e = e->next;
+    if (!line->is_background) {
+        last_code = execute_line_foreground(line);
+        return;
+    }
+    if (skip_pipeline(e) == NULL) {
+        const struct expr *next;
+        struct job *job = start_pipeline(e, line, true, &next);
+        if (is_interactive) {
+            fprintf(stderr, "[%d] %d\n", job->id, (int)job->pgid);
+        }
+    } else {
+        start_subshell(line);
     }
+    last_code = EXIT_SUCCESS;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--fork") == 0) {
+            launcher = LAUNCHER_FORK;
+        } else {
+            fprintf(stderr, "Usage: %s [--fork]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (job_table_create() != 0) {
+        perror("job_table_create");
+        return EXIT_FAILURE;
+    }
+    if (isatty(STDIN_FILENO)) {
+        is_interactive = true;
+        set_job_control_signals(SIG_IGN);
+        shell_pgid = getpid();
+        setpgid(0, 0);
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
     const size_t buf_size = 1024;
     char buf[buf_size];
     struct parser *p = parser_new();
+    /* Wake up on the input and on the exits of background jobs. */
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = job_table_fd();
+    fds[1].events = POLLIN;
 
     while (true) {
+        report_done_jobs();
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents == 0) {
+            continue;
+        }
         ssize_t rc = read(STDIN_FILENO, buf, buf_size);
         if (rc < 0) {
             perror("Error reading from stdin");
@@ -205,9 +734,14 @@ int main(void) {
             }
             execute_command_line(line);
             command_line_delete(line);
+            if (is_exiting)
+                break;
         }
+        if (is_exiting)
+            break;
     }
 
     parser_delete(p);
-    return 0;
-}
\ No newline at end of file
+    job_table_destroy();
+    return last_code;
+}